@@ -0,0 +1,196 @@
+/**
+ * aggregation-bench: replays traffic through process_data_packet() and flushes
+ * aggregated data every flush_lines lines, reports processed lines per second.
+ *
+ * Usage: aggregation-bench [traffic_file [rounds [flush_lines]]]
+ *
+ * traffic_file should contain statsd metrics one per line, e.g. recorded with
+ * `nc -ul 8125 > traffic_file`. If it's not given, synthetic mix of counters,
+ * timers and gauges is used.
+**/
+
+#define STATSD_AGGREGATOR_NO_MAIN
+#include "../statsd-aggregator.c"
+
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define PACKET_SIZE 1400
+#define SYNTHETIC_LINES 1000000
+#define DEFAULT_ROUNDS 10
+#define DEFAULT_FLUSH_LINES 200000
+
+// delimiters of processed packet, allocated once like the index of a worker
+struct packet_index_s packet_index;
+
+struct traffic_s {
+    char *data;
+    int *packet_offset;
+    int *packet_length;
+    int *packet_lines;
+    int packets;
+    long lines;
+};
+
+double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// skewed random number in [0, n), small values are much more frequent
+int skewed_random(unsigned int *seed, int n) {
+    double r = (double)rand_r(seed) / RAND_MAX;
+    return (int)(n * r * r * r) % n;
+}
+
+char *synthesize_traffic(long lines) {
+    char *data = (char *)malloc(lines * 64);
+    char *p = data;
+    unsigned int seed = 42;
+    long i = 0;
+    int kind = 0;
+
+    for (i = 0; i < lines; i++) {
+        kind = rand_r(&seed) % 100;
+        if (kind < 70) {
+            p += sprintf(p, "service.api.requests.endpoint_%d:%d|c\n", skewed_random(&seed, 5000), 1 + rand_r(&seed) % 3);
+        } else if (kind < 95) {
+            p += sprintf(p, "service.api.latency.endpoint_%d:%d|ms\n", skewed_random(&seed, 500), rand_r(&seed) % 1000);
+        } else {
+            p += sprintf(p, "service.api.queue.size_%d:%d|g\n", skewed_random(&seed, 200), rand_r(&seed) % 100);
+        }
+    }
+    return data;
+}
+
+char *read_traffic(char *filename) {
+    FILE *f = fopen(filename, "r");
+    long size = 0;
+    char *data = NULL;
+
+    if (f == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = (char *)malloc(size + 1);
+    if (fread(data, 1, size, f) != size) {
+        fprintf(stderr, "failed to read %s\n", filename);
+        exit(1);
+    }
+    data[size] = 0;
+    fclose(f);
+    return data;
+}
+
+// splits lines into packets not longer than PACKET_SIZE
+void packetize(struct traffic_s *traffic) {
+    char *p = traffic->data;
+    char *eol = NULL;
+    int allocated = 1024;
+
+    traffic->packets = 0;
+    traffic->lines = 0;
+    traffic->packet_offset = (int *)malloc(allocated * sizeof(int));
+    traffic->packet_length = (int *)malloc(allocated * sizeof(int));
+    traffic->packet_lines = (int *)malloc(allocated * sizeof(int));
+    while (*p != 0) {
+        if (traffic->packets == allocated) {
+            allocated *= 2;
+            traffic->packet_offset = (int *)realloc(traffic->packet_offset, allocated * sizeof(int));
+            traffic->packet_length = (int *)realloc(traffic->packet_length, allocated * sizeof(int));
+            traffic->packet_lines = (int *)realloc(traffic->packet_lines, allocated * sizeof(int));
+        }
+        traffic->packet_offset[traffic->packets] = p - traffic->data;
+        traffic->packet_length[traffic->packets] = 0;
+        traffic->packet_lines[traffic->packets] = 0;
+        while (*p != 0 && (eol = strchr(p, '\n')) != NULL && traffic->packet_length[traffic->packets] + (eol - p + 1) <= PACKET_SIZE) {
+            traffic->packet_length[traffic->packets] += eol - p + 1;
+            traffic->packet_lines[traffic->packets]++;
+            p = eol + 1;
+        }
+        if (traffic->packet_length[traffic->packets] == 0) {
+            // line is too long or not terminated, skip it
+            p = eol != NULL ? eol + 1 : p + strlen(p);
+            continue;
+        }
+        traffic->lines += traffic->packet_lines[traffic->packets];
+        traffic->packets++;
+    }
+}
+
+// flush aggregated data and pretend it was sent
+void flush_and_discard(struct aggregator_s *aggregator) {
+    struct packet_s *packet = NULL;
+
+    downstream_schedule_flush(aggregator);
+    aggregator_reset(aggregator);
+    ev_io_stop(ev_default_loop(0), &(global.downstream.flush_watcher));
+    while ((packet = downstream_dequeue_packet()) != NULL) {
+        downstream_release_packet(packet);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    struct traffic_s traffic;
+    struct aggregator_s aggregator;
+    char downstream[] = "127.0.0.1:8125:8126";
+    char packet[DATA_BUF_SIZE];
+    int rounds = argc > 2 ? atoi(argv[2]) : DEFAULT_ROUNDS;
+    long flush_lines = argc > 3 ? atol(argv[3]) : DEFAULT_FLUSH_LINES;
+    long lines_since_flush = 0;
+    long flushes = 0;
+    int max_slots_used = 0;
+    int round = 0;
+    int i = 0;
+    double start = 0;
+    double elapsed = 0;
+    struct rusage usage;
+
+    // nothing is sent, so errors about unreachable downstream are not interesting
+    global.log_level = ERROR + 1;
+    global.downstream_queue_size = DEFAULT_DOWNSTREAM_QUEUE_SIZE;
+    global.downstream_buf_size = DEFAULT_DOWNSTREAM_BUF_SIZE;
+    global.data_buf_size = DEFAULT_DATA_BUF_SIZE;
+    global.name_idle_intervals = DEFAULT_NAME_IDLE_INTERVALS;
+    global.tokenizer = tokenizer_select();
+    if (init_downstream(downstream) != 0 || aggregator_init(&aggregator) != 0 || init_packet_index(&packet_index) != 0) {
+        fprintf(stderr, "initialization failed\n");
+        return 1;
+    }
+    traffic.data = argc > 1 ? read_traffic(argv[1]) : synthesize_traffic(SYNTHETIC_LINES);
+    packetize(&traffic);
+    if (traffic.lines == 0) {
+        fprintf(stderr, "no traffic to replay\n");
+        return 1;
+    }
+
+    start = now();
+    for (round = 0; round < rounds; round++) {
+        for (i = 0; i < traffic.packets; i++) {
+            // process_data_packet() modifies the packet so we work on a copy, like recv() would do
+            memcpy(packet, traffic.data + traffic.packet_offset[i], traffic.packet_length[i]);
+            process_data_packet(&aggregator, &packet_index, packet, traffic.packet_length[i]);
+            lines_since_flush += traffic.packet_lines[i];
+            if (lines_since_flush >= flush_lines) {
+                if (aggregator.slots_active > max_slots_used) {
+                    max_slots_used = aggregator.slots_active;
+                }
+                flush_and_discard(&aggregator);
+                flushes++;
+                lines_since_flush = 0;
+            }
+        }
+    }
+    flush_and_discard(&aggregator);
+    elapsed = now() - start;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("lines: %ld, packets: %d, rounds: %d, flushes: %ld\n", traffic.lines, traffic.packets, rounds, flushes);
+    printf("slots used per flush: %d, sizeof(slot_s): %lu, max rss: %ld KB\n", max_slots_used, sizeof(slot_s), usage.ru_maxrss);
+    printf("%.0f lines/s, %.1f ns/line\n", traffic.lines * rounds / elapsed, elapsed * 1e9 / (traffic.lines * rounds));
+    return 0;
+}
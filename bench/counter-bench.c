@@ -0,0 +1,171 @@
+/**
+ * counter-bench: throughput of counter value parsing and formatting compared with
+ * strtod() and sprintf(), and lines per second of counter-heavy traffic where few
+ * hot counters get many increments per flush interval.
+**/
+
+#define STATSD_AGGREGATOR_NO_MAIN
+#include "../statsd-aggregator.c"
+
+#include <sys/time.h>
+
+#define VALUES_NUM 1024
+#define CONVERSIONS_PER_RUN 20000000
+#define COUNTER_NAMES 200
+#define PACKETS_NUM 4096
+#define PACKET_SIZE 1400
+#define ROUNDS 200
+// flush every that many packets, so each counter gets a few thousand increments per flush
+#define FLUSH_PACKETS 16384
+
+// delimiters of processed packet, allocated once like the index of a worker
+struct packet_index_s packet_index;
+
+double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// mix of values seen in real counters: mostly small integers, some decimals and sample rates
+int synthesize_value(unsigned int *seed, char *buffer) {
+    int kind = rand_r(seed) % 100;
+
+    if (kind < 80) {
+        return sprintf(buffer, "%d", 1 + rand_r(seed) % 10);
+    } else if (kind < 90) {
+        return sprintf(buffer, "%d", rand_r(seed) % 100000);
+    } else {
+        return sprintf(buffer, "%d.%02d", rand_r(seed) % 1000, rand_r(seed) % 100);
+    }
+}
+
+void run_parse(unsigned int *seed) {
+    char values[VALUES_NUM][32];
+    int lengths[VALUES_NUM];
+    double sum_strtod = 0;
+    double sum_fast = 0;
+    double value = 0;
+    double start = 0;
+    double strtod_rate = 0;
+    double fast_rate = 0;
+    long i = 0;
+
+    for (i = 0; i < VALUES_NUM; i++) {
+        lengths[i] = synthesize_value(seed, values[i]);
+    }
+    start = now();
+    for (i = 0; i < CONVERSIONS_PER_RUN; i++) {
+        sum_strtod += strtod(values[i % VALUES_NUM], NULL);
+    }
+    strtod_rate = CONVERSIONS_PER_RUN / (now() - start);
+    start = now();
+    for (i = 0; i < CONVERSIONS_PER_RUN; i++) {
+        parse_number(values[i % VALUES_NUM], values[i % VALUES_NUM] + lengths[i % VALUES_NUM], &value);
+        sum_fast += value;
+    }
+    fast_rate = CONVERSIONS_PER_RUN / (now() - start);
+    printf("parse:  strtod %12.0f/s, parse_number %12.0f/s, %5.1fx%s\n", strtod_rate, fast_rate, fast_rate / strtod_rate,
+        sum_strtod == sum_fast ? "" : " (results differ!)");
+}
+
+void run_format(unsigned int *seed) {
+    double counters[VALUES_NUM];
+    char buffer[COUNTER_BUF_SIZE];
+    long length_sprintf = 0;
+    long length_fast = 0;
+    double start = 0;
+    double sprintf_rate = 0;
+    double fast_rate = 0;
+    long i = 0;
+
+    for (i = 0; i < VALUES_NUM; i++) {
+        // sums of many increments, some of them are fractional because of sample rates
+        counters[i] = (i % 10 == 0) ? rand_r(seed) / 3.0 : rand_r(seed) % 1000000;
+    }
+    start = now();
+    for (i = 0; i < CONVERSIONS_PER_RUN; i++) {
+        length_sprintf += sprintf(buffer, "%.15g|c\n", counters[i % VALUES_NUM]);
+    }
+    sprintf_rate = CONVERSIONS_PER_RUN / (now() - start);
+    start = now();
+    for (i = 0; i < CONVERSIONS_PER_RUN; i++) {
+        length_fast += format_counter(buffer, counters[i % VALUES_NUM]);
+    }
+    fast_rate = CONVERSIONS_PER_RUN / (now() - start);
+    printf("format: sprintf %11.0f/s, format_counter %10.0f/s, %5.1fx%s\n", sprintf_rate, fast_rate, fast_rate / sprintf_rate,
+        length_sprintf == length_fast ? "" : " (results differ!)");
+}
+
+// flush aggregated data and pretend it was sent
+void flush_and_discard(struct aggregator_s *aggregator) {
+    struct packet_s *packet = NULL;
+
+    downstream_schedule_flush(aggregator);
+    aggregator_reset(aggregator);
+    ev_io_stop(ev_default_loop(0), &(global.downstream.flush_watcher));
+    while ((packet = downstream_dequeue_packet()) != NULL) {
+        downstream_release_packet(packet);
+    }
+}
+
+void run_traffic(unsigned int *seed) {
+    struct aggregator_s aggregator;
+    char downstream[] = "127.0.0.1:8125:8126";
+    char (*packets)[PACKET_SIZE + 64] = malloc(PACKETS_NUM * (PACKET_SIZE + 64));
+    int *lengths = (int *)malloc(PACKETS_NUM * sizeof(int));
+    char packet[DATA_BUF_SIZE];
+    char value[32];
+    long lines = 0;
+    long processed = 0;
+    int round = 0;
+    int i = 0;
+    double start = 0;
+    double elapsed = 0;
+
+    if (packets == NULL || lengths == NULL || init_downstream(downstream) != 0 || aggregator_init(&aggregator) != 0 ||
+        init_packet_index(&packet_index) != 0) {
+        fprintf(stderr, "initialization failed\n");
+        exit(1);
+    }
+    for (i = 0; i < PACKETS_NUM; i++) {
+        lengths[i] = 0;
+        while (lengths[i] < PACKET_SIZE - 64) {
+            synthesize_value(seed, value);
+            lengths[i] += sprintf(packets[i] + lengths[i], "service.api.requests.endpoint_%d:%s|c%s\n",
+                rand_r(seed) % COUNTER_NAMES, value, rand_r(seed) % 10 == 0 ? "|@0.1" : "");
+            lines++;
+        }
+    }
+    start = now();
+    for (round = 0; round < ROUNDS; round++) {
+        for (i = 0; i < PACKETS_NUM; i++) {
+            // process_data_packet() modifies the packet so we work on a copy, like recv() would do
+            memcpy(packet, packets[i], lengths[i]);
+            process_data_packet(&aggregator, &packet_index, packet, lengths[i]);
+            if (++processed % FLUSH_PACKETS == 0) {
+                flush_and_discard(&aggregator);
+            }
+        }
+    }
+    flush_and_discard(&aggregator);
+    elapsed = now() - start;
+    printf("traffic: %d counters, %ld lines per round, %d rounds\n", COUNTER_NAMES, lines, ROUNDS);
+    printf("%.0f lines/s, %.1f ns/line\n", lines * ROUNDS / elapsed, elapsed * 1e9 / (lines * ROUNDS));
+}
+
+int main(int argc, char *argv[]) {
+    unsigned int seed = 42;
+
+    // nothing is sent, so errors about unreachable downstream are not interesting
+    global.log_level = ERROR + 1;
+    global.downstream_queue_size = DEFAULT_DOWNSTREAM_QUEUE_SIZE;
+    global.downstream_buf_size = DEFAULT_DOWNSTREAM_BUF_SIZE;
+    global.data_buf_size = DEFAULT_DATA_BUF_SIZE;
+    global.name_idle_intervals = DEFAULT_NAME_IDLE_INTERVALS;
+    global.tokenizer = tokenizer_select();
+    run_parse(&seed);
+    run_format(&seed);
+    run_traffic(&seed);
+    return 0;
+}
@@ -0,0 +1,745 @@
+/**
+ * e2e-bench: end-to-end load test of statsd-aggregator binary.
+ *
+ * Usage: e2e-bench [options] [traffic_file ...]
+ *
+ *   -e path        statsd-aggregator binary (default ./statsd-aggregator)
+ *   -o key=value   extra config line, can be repeated (e.g. -o workers=4)
+ *   -t threads     load generator threads (default 2)
+ *   -r rate        first measured rate in packets per second (default 5000)
+ *   -d seconds     duration of every rate step (default 1)
+ *   -l percent     tolerated loss (default 0.1)
+ *   -s bytes       longest generated datagram (default 1400)
+ *   -k names       distinct names of synthetic traffic (default 10000)
+ *   -m c,ms,g,s    synthetic mix of counters, timers, gauges and sets in percents (default 70,25,5,0)
+ *
+ * Aggregator is started with generated config, its downstream is a sink in this process which
+ * answers health checks and counts what is flushed to it over udp or tcp. Load generator threads
+ * replay traffic files (one metric per line, e.g. recorded with `nc -ul 8125 > traffic_file`) or
+ * synthetic mix at doubling rates until loss exceeds tolerated one, then the limit is bisected.
+ *
+ * Loss is measured by values: sum of counters (scaled by sample rate) and number of timer values
+ * sent has to arrive to the sink. Every step reports end-to-end latency of probe counters sent
+ * every 10ms, aggregator cpu time per million lines, context switches of its threads per thousand packets
+ * and ratio of ingress to egress bytes. Io backends are compared with -o io_backend=libev and -o io_backend=io_uring.
+**/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAX_CONFIG_LINES 64
+#define MAX_THREADS 64
+#define MAX_PACKET_SIZE 65000
+#define SEND_BATCH_SIZE 64
+#define SINK_BUF_SIZE 65536
+#define SINK_BATCH_SIZE 32
+#define SOCKET_BUF_SIZE (16 * 1024 * 1024)
+#define FLUSH_INTERVAL 0.5
+// probes are kept in the ring, latency of probe older than that is not measured
+#define MAX_PROBES 65536
+#define PROBE_INTERVAL 0.01
+#define PROBE_PREFIX "e2e-bench.probe."
+#define BISECT_STEPS 3
+// generator which sends less than that share of target rate is the bottleneck
+#define MIN_ACHIEVED_RATE 0.9
+#define SYNTHETIC_LINES 1000000
+#define HEALTH_CHECK_UP_RESPONSE "health: up\n"
+
+struct traffic_s {
+    char *data;
+    int *packet_offset;
+    int *packet_length;
+    // values of every packet which should arrive to the sink, see line_values()
+    double *packet_values;
+    int *packet_lines;
+    int packets;
+    long lines;
+};
+
+struct generator_s {
+    pthread_t thread;
+    struct traffic_s *traffic;
+    struct sockaddr_in addr;
+    double rate;
+    double duration;
+    int first_packet;
+    long packets;
+    long lines;
+    long bytes;
+    double values;
+};
+
+struct sink_s {
+    pthread_mutex_t lock;
+    long packets;
+    long bytes;
+    double values;
+    double latency[MAX_PROBES];
+    int probes;
+    int health_checks;
+};
+
+struct step_s {
+    double rate;
+    double achieved_rate;
+    double lines_rate;
+    double loss;
+    double cpu_per_million;
+    double switches_per_thousand;
+    double compression;
+    double latency_p50;
+    double latency_p99;
+    double latency_max;
+};
+
+struct sink_s sink;
+double probe_sent_at[MAX_PROBES];
+char *aggregator_path = "./statsd-aggregator";
+char *config_lines[MAX_CONFIG_LINES];
+int config_lines_num = 0;
+int threads_num = 2;
+double start_rate = 5000;
+double step_duration = 1;
+double tolerated_loss = 0.1;
+int packet_size = 1400;
+int names_num = 10000;
+int mix[4] = {70, 25, 5, 0};
+
+double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+void sleep_for(double seconds) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+/* adds values of single line to counter sum and timer values number. Lines of the same
+ * name can have several values separated by ':', e.g. aggregated timer "name:1|ms:2|ms"
+ */
+void line_values(char *line, char *end, double *values) {
+    char *ptr = memchr(line, ':', end - line);
+    char *type = NULL;
+    char *rate = NULL;
+    double value = 0;
+
+    while (ptr != NULL && ++ptr < end) {
+        value = strtod(ptr, &type);
+        if (type == ptr || type >= end || *type != '|') {
+            return;
+        }
+        type++;
+        if (end - type >= 2 && type[0] == 'm' && type[1] == 's') {
+            *values += 1;
+        } else if (*type == 'c') {
+            rate = memchr(type, '@', end - type);
+            *values += rate != NULL && atof(rate + 1) > 0 ? value / atof(rate + 1) : value;
+        }
+        ptr = memchr(type, ':', end - type);
+    }
+}
+
+char *synthesize_traffic(long lines) {
+    char *data = (char *)malloc(lines * 64);
+    char *p = data;
+    unsigned int seed = 42;
+    long i = 0;
+    int kind = 0;
+
+    for (i = 0; i < lines; i++) {
+        kind = rand_r(&seed) % 100;
+        if (kind < mix[0]) {
+            p += sprintf(p, "e2e.counter.name_%d:%d|c\n", rand_r(&seed) % names_num, 1 + rand_r(&seed) % 3);
+        } else if (kind < mix[0] + mix[1]) {
+            p += sprintf(p, "e2e.timer.name_%d:%d|ms\n", rand_r(&seed) % names_num, rand_r(&seed) % 1000);
+        } else if (kind < mix[0] + mix[1] + mix[2]) {
+            p += sprintf(p, "e2e.gauge.name_%d:%d|g\n", rand_r(&seed) % names_num, rand_r(&seed) % 100);
+        } else {
+            p += sprintf(p, "e2e.set.name_%d:%d|s\n", rand_r(&seed) % names_num, rand_r(&seed) % 1000);
+        }
+    }
+    return data;
+}
+
+// reads and concatenates traffic files
+char *read_traffic(char **filenames, int files_num) {
+    char *data = NULL;
+    long length = 0;
+    long size = 0;
+    FILE *f = NULL;
+    int i = 0;
+
+    for (i = 0; i < files_num; i++) {
+        if ((f = fopen(filenames[i], "r")) == NULL) {
+            fprintf(stderr, "failed to open %s: %s\n", filenames[i], strerror(errno));
+            exit(1);
+        }
+        fseek(f, 0, SEEK_END);
+        size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        data = (char *)realloc(data, length + size + 2);
+        if (fread(data + length, 1, size, f) != size) {
+            fprintf(stderr, "failed to read %s\n", filenames[i]);
+            exit(1);
+        }
+        length += size;
+        if (length > 0 && data[length - 1] != '\n') {
+            data[length++] = '\n';
+        }
+        fclose(f);
+    }
+    data[length] = 0;
+    return data;
+}
+
+// splits lines into packets not longer than packet_size
+void packetize(struct traffic_s *traffic) {
+    char *p = traffic->data;
+    char *eol = NULL;
+    int allocated = 1024;
+
+    traffic->packets = 0;
+    traffic->lines = 0;
+    traffic->packet_offset = (int *)malloc(allocated * sizeof(int));
+    traffic->packet_length = (int *)malloc(allocated * sizeof(int));
+    traffic->packet_values = (double *)malloc(allocated * sizeof(double));
+    traffic->packet_lines = (int *)malloc(allocated * sizeof(int));
+    while (*p != 0) {
+        if (traffic->packets == allocated) {
+            allocated *= 2;
+            traffic->packet_offset = (int *)realloc(traffic->packet_offset, allocated * sizeof(int));
+            traffic->packet_length = (int *)realloc(traffic->packet_length, allocated * sizeof(int));
+            traffic->packet_values = (double *)realloc(traffic->packet_values, allocated * sizeof(double));
+            traffic->packet_lines = (int *)realloc(traffic->packet_lines, allocated * sizeof(int));
+        }
+        traffic->packet_offset[traffic->packets] = p - traffic->data;
+        traffic->packet_length[traffic->packets] = 0;
+        traffic->packet_values[traffic->packets] = 0;
+        traffic->packet_lines[traffic->packets] = 0;
+        while (*p != 0 && (eol = strchr(p, '\n')) != NULL && traffic->packet_length[traffic->packets] + (eol - p + 1) <= packet_size) {
+            line_values(p, eol, traffic->packet_values + traffic->packets);
+            traffic->packet_length[traffic->packets] += eol - p + 1;
+            traffic->packet_lines[traffic->packets]++;
+            p = eol + 1;
+        }
+        if (traffic->packet_length[traffic->packets] == 0) {
+            // line is too long or not terminated, skip it
+            p = eol != NULL ? eol + 1 : p + strlen(p);
+            continue;
+        }
+        traffic->lines += traffic->packet_lines[traffic->packets];
+        traffic->packets++;
+    }
+}
+
+// returns socket bound to loopback, its port is written to port
+int bind_loopback(int type, int port, int *bound_port) {
+    struct sockaddr_in addr;
+    socklen_t length = sizeof(addr);
+    int size = SOCKET_BUF_SIZE;
+    int fd = socket(AF_INET, type, 0);
+    int on = 1;
+
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "failed to bind loopback socket: %s\n", strerror(errno));
+        exit(1);
+    }
+    // forcing buffer size over rmem_max needs CAP_NET_ADMIN
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) != 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    }
+    if (type == SOCK_STREAM && listen(fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "failed to listen: %s\n", strerror(errno));
+        exit(1);
+    }
+    getsockname(fd, (struct sockaddr *)&addr, &length);
+    *bound_port = ntohs(addr.sin_port);
+    return fd;
+}
+
+// counts values and probes of complete lines, returns number of bytes processed
+int sink_process(char *data, int length) {
+    char *p = data;
+    char *eol = NULL;
+    double values = 0;
+    double latency = 0;
+    long probe = 0;
+
+    while ((eol = memchr(p, '\n', data + length - p)) != NULL) {
+        if (strncmp(p, PROBE_PREFIX, strlen(PROBE_PREFIX)) == 0) {
+            probe = atol(p + strlen(PROBE_PREFIX));
+            latency = now() - probe_sent_at[probe % MAX_PROBES];
+            pthread_mutex_lock(&(sink.lock));
+            if (sink.probes < MAX_PROBES) {
+                sink.latency[sink.probes++] = latency;
+            }
+            pthread_mutex_unlock(&(sink.lock));
+        } else {
+            line_values(p, eol, &values);
+        }
+        p = eol + 1;
+    }
+    pthread_mutex_lock(&(sink.lock));
+    sink.values += values;
+    sink.bytes += p - data;
+    pthread_mutex_unlock(&(sink.lock));
+    return p - data;
+}
+
+void *sink_udp(void *arg) {
+    int fd = *(int *)arg;
+    struct mmsghdr msgs[SINK_BATCH_SIZE];
+    struct iovec iovecs[SINK_BATCH_SIZE];
+    char *buffers = (char *)malloc(SINK_BATCH_SIZE * (SINK_BUF_SIZE + 1));
+    char *buffer = NULL;
+    int n = 0;
+    int i = 0;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < SINK_BATCH_SIZE; i++) {
+        iovecs[i].iov_base = buffers + i * (SINK_BUF_SIZE + 1);
+        iovecs[i].iov_len = SINK_BUF_SIZE;
+        msgs[i].msg_hdr.msg_iov = iovecs + i;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    while ((n = recvmmsg(fd, msgs, SINK_BATCH_SIZE, MSG_WAITFORONE, NULL)) >= 0 || errno == EINTR) {
+        for (i = 0; i < n; i++) {
+            buffer = iovecs[i].iov_base;
+            // last line of the packet may have no newline
+            if (msgs[i].msg_len > 0 && buffer[msgs[i].msg_len - 1] != '\n') {
+                buffer[msgs[i].msg_len++] = '\n';
+            }
+            sink_process(buffer, msgs[i].msg_len);
+        }
+        pthread_mutex_lock(&(sink.lock));
+        sink.packets += n > 0 ? n : 0;
+        pthread_mutex_unlock(&(sink.lock));
+    }
+    fprintf(stderr, "sink recvmmsg() failed: %s\n", strerror(errno));
+    return NULL;
+}
+
+// reads lines from downstream tcp connection, line split between reads is kept
+void *sink_tcp_connection(void *arg) {
+    int fd = (int)(long)arg;
+    char *buffer = (char *)malloc(SINK_BUF_SIZE);
+    int length = 0;
+    int processed = 0;
+    int n = 0;
+
+    while ((n = recv(fd, buffer + length, SINK_BUF_SIZE - length, 0)) > 0) {
+        length += n;
+        processed = sink_process(buffer, length);
+        memmove(buffer, buffer + processed, length - processed);
+        length -= processed;
+        pthread_mutex_lock(&(sink.lock));
+        sink.packets++;
+        pthread_mutex_unlock(&(sink.lock));
+    }
+    close(fd);
+    free(buffer);
+    return NULL;
+}
+
+// answers every health check request with up
+void *sink_health_connection(void *arg) {
+    int fd = (int)(long)arg;
+    char buffer[64];
+
+    while (recv(fd, buffer, sizeof(buffer), 0) > 0) {
+        if (send(fd, HEALTH_CHECK_UP_RESPONSE, strlen(HEALTH_CHECK_UP_RESPONSE), MSG_NOSIGNAL) < 0) {
+            break;
+        }
+        __atomic_add_fetch(&(sink.health_checks), 1, __ATOMIC_RELAXED);
+    }
+    close(fd);
+    return NULL;
+}
+
+struct acceptor_s {
+    int fd;
+    void *(*handler)(void *);
+};
+
+void *sink_accept(void *arg) {
+    struct acceptor_s *acceptor = (struct acceptor_s *)arg;
+    pthread_t thread;
+    int fd = -1;
+
+    while ((fd = accept(acceptor->fd, NULL, NULL)) >= 0 || errno == EINTR) {
+        if (fd >= 0 && pthread_create(&thread, NULL, acceptor->handler, (void *)(long)fd) == 0) {
+            pthread_detach(thread);
+        }
+    }
+    fprintf(stderr, "sink accept() failed: %s\n", strerror(errno));
+    return NULL;
+}
+
+// starts sink threads, data is accepted over both udp and tcp on the same port
+int start_sink(int *data_port, int *health_port) {
+    static int udp_fd = -1;
+    static struct acceptor_s tcp_acceptor;
+    static struct acceptor_s health_acceptor;
+    pthread_t thread;
+
+    pthread_mutex_init(&(sink.lock), NULL);
+    udp_fd = bind_loopback(SOCK_DGRAM, 0, data_port);
+    tcp_acceptor.fd = bind_loopback(SOCK_STREAM, *data_port, data_port);
+    tcp_acceptor.handler = sink_tcp_connection;
+    health_acceptor.fd = bind_loopback(SOCK_STREAM, 0, health_port);
+    health_acceptor.handler = sink_health_connection;
+    return pthread_create(&thread, NULL, sink_udp, &udp_fd) != 0 ||
+        pthread_create(&thread, NULL, sink_accept, &tcp_acceptor) != 0 ||
+        pthread_create(&thread, NULL, sink_accept, &health_acceptor) != 0;
+}
+
+// returns free udp port on loopback
+int free_port() {
+    int port = 0;
+    close(bind_loopback(SOCK_DGRAM, 0, &port));
+    return port;
+}
+
+pid_t start_aggregator(int data_port, int sink_port, int health_port) {
+    char config_file[] = "/tmp/e2e-bench-XXXXXX";
+    int fd = mkstemp(config_file);
+    FILE *config = fd >= 0 ? fdopen(fd, "w") : NULL;
+    pid_t pid = 0;
+    int i = 0;
+
+    if (config == NULL) {
+        fprintf(stderr, "failed to create config: %s\n", strerror(errno));
+        exit(1);
+    }
+    fprintf(config, "data_port=%d\ndownstream=127.0.0.1:%d:%d\ndownstream_flush_interval=%.1f\n", data_port, sink_port,
+        health_port, FLUSH_INTERVAL);
+    fprintf(config, "downstream_health_check_interval=%.1f\nlog_level=4\n", FLUSH_INTERVAL);
+    for (i = 0; i < config_lines_num; i++) {
+        fprintf(config, "%s\n", config_lines[i]);
+    }
+    fclose(config);
+    if ((pid = fork()) == 0) {
+        execl(aggregator_path, aggregator_path, config_file, NULL);
+        fprintf(stderr, "failed to run %s: %s\n", aggregator_path, strerror(errno));
+        _exit(1);
+    }
+    // config is read once downstream is checked, so it can be removed then
+    for (i = 0; i < 50 && __atomic_load_n(&(sink.health_checks), __ATOMIC_RELAXED) == 0; i++) {
+        sleep_for(0.1);
+        if (waitpid(pid, NULL, WNOHANG) != 0) {
+            pid = -1;
+            break;
+        }
+    }
+    unlink(config_file);
+    if (pid > 0 && sink.health_checks == 0) {
+        fprintf(stderr, "aggregator didn't check downstream health\n");
+        kill(pid, SIGKILL);
+        pid = -1;
+    }
+    return pid;
+}
+
+// returns user and system cpu time of the process in seconds
+double process_cpu_time(pid_t pid) {
+    char filename[64];
+    char buffer[1024];
+    unsigned long utime = 0;
+    unsigned long stime = 0;
+    char *p = NULL;
+    FILE *f = NULL;
+    int n = 0;
+
+    snprintf(filename, sizeof(filename), "/proc/%d/stat", pid);
+    if ((f = fopen(filename, "r")) == NULL) {
+        return 0;
+    }
+    n = fread(buffer, 1, sizeof(buffer) - 1, f);
+    fclose(f);
+    buffer[n > 0 ? n : 0] = 0;
+    // process name can have spaces, fields are counted after it. utime and stime are 14th and 15th
+    if ((p = strrchr(buffer, ')')) == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+        return 0;
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+// returns voluntary and involuntary context switches of all threads of the process
+long process_context_switches(pid_t pid) {
+    char filename[300];
+    char line[256];
+    struct dirent *entry = NULL;
+    long switches = 0;
+    long value = 0;
+    DIR *dir = NULL;
+    FILE *f = NULL;
+
+    snprintf(filename, sizeof(filename), "/proc/%d/task", pid);
+    if ((dir = opendir(filename)) == NULL) {
+        return 0;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(filename, sizeof(filename), "/proc/%d/task/%s/status", pid, entry->d_name);
+        if ((f = fopen(filename, "r")) == NULL) {
+            continue;
+        }
+        while (fgets(line, sizeof(line), f) != NULL) {
+            if (sscanf(line, "voluntary_ctxt_switches: %ld", &value) == 1 || sscanf(line, "nonvoluntary_ctxt_switches: %ld", &value) == 1) {
+                switches += value;
+            }
+        }
+        fclose(f);
+    }
+    closedir(dir);
+    return switches;
+}
+
+// sends traffic at given rate, packets are sent in batches and thread sleeps when it is ahead
+void *generate(void *arg) {
+    struct generator_s *generator = (struct generator_s *)arg;
+    struct traffic_s *traffic = generator->traffic;
+    struct mmsghdr msgs[SEND_BATCH_SIZE];
+    struct iovec iovecs[SEND_BATCH_SIZE];
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int packet = generator->first_packet;
+    double start = now();
+    double elapsed = 0;
+    long due = 0;
+    int batch = 0;
+    int sent = 0;
+    int i = 0;
+
+    memset(msgs, 0, sizeof(msgs));
+    while ((elapsed = now() - start) < generator->duration) {
+        due = (long)(generator->rate * elapsed) - generator->packets;
+        if (due <= 0) {
+            sleep_for(0.0001);
+            continue;
+        }
+        batch = due > SEND_BATCH_SIZE ? SEND_BATCH_SIZE : due;
+        for (i = 0; i < batch; i++) {
+            iovecs[i].iov_base = traffic->data + traffic->packet_offset[(packet + i) % traffic->packets];
+            iovecs[i].iov_len = traffic->packet_length[(packet + i) % traffic->packets];
+            msgs[i].msg_hdr.msg_iov = iovecs + i;
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &(generator->addr);
+            msgs[i].msg_hdr.msg_namelen = sizeof(generator->addr);
+        }
+        if ((sent = sendmmsg(fd, msgs, batch, 0)) <= 0) {
+            continue;
+        }
+        for (i = 0; i < sent; i++) {
+            generator->lines += traffic->packet_lines[packet];
+            generator->bytes += traffic->packet_length[packet];
+            generator->values += traffic->packet_values[packet];
+            packet = (packet + 1) % traffic->packets;
+        }
+        generator->packets += sent;
+    }
+    close(fd);
+    return NULL;
+}
+
+int percentile_compare(const void *a, const void *b) {
+    return *(double *)a < *(double *)b ? -1 : *(double *)a > *(double *)b;
+}
+
+// sends probes while generators are running, then waits until aggregated data is flushed
+void run_step(struct traffic_s *traffic, pid_t pid, int data_port, double rate, struct step_s *step) {
+    static long probe = 0;
+    struct generator_s generators[MAX_THREADS];
+    struct sockaddr_in addr;
+    char line[64];
+    int probe_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    long packets = 0;
+    long lines = 0;
+    long bytes = 0;
+    double values = 0;
+    double sink_values = 0;
+    long sink_bytes = 0;
+    double cpu = process_cpu_time(pid);
+    long switches = process_context_switches(pid);
+    double start = now();
+    int i = 0;
+
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(data_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    pthread_mutex_lock(&(sink.lock));
+    sink_values = sink.values;
+    sink_bytes = sink.bytes;
+    sink.probes = 0;
+    pthread_mutex_unlock(&(sink.lock));
+    for (i = 0; i < threads_num; i++) {
+        memset(generators + i, 0, sizeof(struct generator_s));
+        generators[i].traffic = traffic;
+        generators[i].addr = addr;
+        generators[i].rate = rate / threads_num;
+        generators[i].duration = step_duration;
+        generators[i].first_packet = (long)traffic->packets * i / threads_num;
+        pthread_create(&(generators[i].thread), NULL, generate, generators + i);
+    }
+    while (now() - start < step_duration) {
+        probe_sent_at[probe % MAX_PROBES] = now();
+        sendto(probe_fd, line, sprintf(line, PROBE_PREFIX "%ld:1|c\n", probe++), 0, (struct sockaddr *)&addr, sizeof(addr));
+        sleep_for(PROBE_INTERVAL);
+    }
+    for (i = 0; i < threads_num; i++) {
+        pthread_join(generators[i].thread, NULL);
+        packets += generators[i].packets;
+        lines += generators[i].lines;
+        bytes += generators[i].bytes;
+        values += generators[i].values;
+    }
+    // data received before the step ended is sent with the next flush
+    sleep_for(3 * FLUSH_INTERVAL);
+    close(probe_fd);
+
+    pthread_mutex_lock(&(sink.lock));
+    sink_values = sink.values - sink_values;
+    sink_bytes = sink.bytes - sink_bytes;
+    qsort(sink.latency, sink.probes, sizeof(double), percentile_compare);
+    step->latency_p50 = sink.probes > 0 ? sink.latency[sink.probes / 2] : 0;
+    step->latency_p99 = sink.probes > 0 ? sink.latency[sink.probes * 99 / 100] : 0;
+    step->latency_max = sink.probes > 0 ? sink.latency[sink.probes - 1] : 0;
+    pthread_mutex_unlock(&(sink.lock));
+    step->rate = rate;
+    step->achieved_rate = packets / step_duration;
+    step->lines_rate = lines / step_duration;
+    step->loss = values > 0 ? 100.0 * (values - sink_values) / values : 0;
+    step->cpu_per_million = lines > 0 ? (process_cpu_time(pid) - cpu) * 1e6 / lines : 0;
+    step->switches_per_thousand = packets > 0 ? (process_context_switches(pid) - switches) * 1e3 / packets : 0;
+    step->compression = sink_bytes > 0 ? (double)bytes / sink_bytes : 0;
+    printf("  %9.0f packets/s: sent %9.0f packets/s %10.0f lines/s, loss %6.2f%%, cpu %7.3f s per 1M lines, "
+        "%6.1f switches per 1K packets, ingress/egress %5.1f, latency p50 %.3f p99 %.3f max %.3f s\n", step->rate,
+        step->achieved_rate, step->lines_rate, step->loss, step->cpu_per_million, step->switches_per_thousand,
+        step->compression, step->latency_p50,
+        step->latency_p99, step->latency_max);
+}
+
+void usage(char *name) {
+    fprintf(stderr, "Usage: %s [-e aggregator] [-o key=value] [-t threads] [-r rate] [-d seconds] [-l loss_percent] "
+        "[-s packet_size] [-k names] [-m counters,timers,gauges,sets] [traffic_file ...]\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    struct traffic_s traffic;
+    struct step_s step;
+    struct step_s best;
+    double good = 0;
+    double bad = 0;
+    double rate = 0;
+    int data_port = free_port();
+    int sink_port = 0;
+    int health_port = 0;
+    int limited = 0;
+    pid_t pid = 0;
+    int opt = 0;
+    int i = 0;
+
+    while ((opt = getopt(argc, argv, "e:o:t:r:d:l:s:k:m:")) != -1) {
+        switch (opt) {
+            case 'e': aggregator_path = optarg; break;
+            case 'o':
+                if (config_lines_num < MAX_CONFIG_LINES) {
+                    config_lines[config_lines_num++] = optarg;
+                }
+                break;
+            case 't': threads_num = atoi(optarg); break;
+            case 'r': start_rate = atof(optarg); break;
+            case 'd': step_duration = atof(optarg); break;
+            case 'l': tolerated_loss = atof(optarg); break;
+            case 's': packet_size = atoi(optarg); break;
+            case 'k': names_num = atoi(optarg); break;
+            case 'm':
+                if (sscanf(optarg, "%d,%d,%d,%d", mix, mix + 1, mix + 2, mix + 3) != 4) {
+                    usage(argv[0]);
+                }
+                break;
+            default: usage(argv[0]);
+        }
+    }
+    if (threads_num < 1 || threads_num > MAX_THREADS || start_rate <= 0 || step_duration <= 0 || names_num < 1 ||
+            packet_size < 64 || packet_size > MAX_PACKET_SIZE || mix[0] + mix[1] + mix[2] + mix[3] != 100) {
+        usage(argv[0]);
+    }
+    traffic.data = optind < argc ? read_traffic(argv + optind, argc - optind) : synthesize_traffic(SYNTHETIC_LINES);
+    packetize(&traffic);
+    if (traffic.lines == 0) {
+        fprintf(stderr, "no traffic to replay\n");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if (start_sink(&sink_port, &health_port) != 0 || (pid = start_aggregator(data_port, sink_port, health_port)) <= 0) {
+        fprintf(stderr, "initialization failed\n");
+        return 1;
+    }
+    printf("%ld lines in %d packets, %.1f lines per packet, %d generator threads\n", traffic.lines, traffic.packets,
+        (double)traffic.lines / traffic.packets, threads_num);
+
+    // rate is doubled until there is loss, then the highest rate without it is bisected
+    memset(&best, 0, sizeof(best));
+    for (rate = start_rate; bad == 0; rate *= 2) {
+        run_step(&traffic, pid, data_port, rate, &step);
+        if (step.loss > tolerated_loss) {
+            bad = rate;
+        } else if (step.achieved_rate < rate * MIN_ACHIEVED_RATE) {
+            limited = 1;
+            best = step;
+            break;
+        } else {
+            good = rate;
+            best = step;
+        }
+    }
+    for (i = 0; i < BISECT_STEPS && ! limited && good > 0; i++) {
+        rate = (good + bad) / 2;
+        run_step(&traffic, pid, data_port, rate, &step);
+        if (step.loss > tolerated_loss) {
+            bad = rate;
+        } else {
+            good = rate;
+            best = step;
+        }
+    }
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
+    if (best.rate == 0) {
+        printf("loss above %.2f%% at the lowest rate\n", tolerated_loss);
+        return 0;
+    }
+    printf("max sustainable rate%s: %.0f packets/s, %.0f lines/s, loss %.2f%%, cpu %.3f s per 1M lines, "
+        "%.1f switches per 1K packets, ingress/egress %.1f, latency p50 %.3f p99 %.3f s\n", limited ? " (generator limit)" : "",
+        best.achieved_rate, best.lines_rate, best.loss, best.cpu_per_million, best.switches_per_thousand, best.compression,
+        best.latency_p50, best.latency_p99);
+    return 0;
+}
@@ -0,0 +1,310 @@
+/**
+ * packet-size-bench: throughput of ingest and flush with 1.4K, 9K and 64K packets.
+ *
+ * Usage: packet-size-bench
+ *
+ * Ingest sends synthetic traffic packed into datagrams of given size over loopback,
+ * reads them back with recvmmsg() and processes them. Flush packs the same set of
+ * distinct metrics into packets of given size and sends them over loopback with
+ * sendmmsg(). Both report lines and megabytes per second and packets per second.
+**/
+
+#define STATSD_AGGREGATOR_NO_MAIN
+#include "../statsd-aggregator.c"
+
+#include <sys/time.h>
+
+#define SYNTHETIC_LINES 200000
+// every size is measured until that many lines are processed
+#define LINES_PER_RUN 5000000
+// aggregated data is flushed every that many lines on ingest
+#define FLUSH_LINES 200000
+// how many distinct metrics are packed on every flush
+#define FLUSH_SLOTS 50000
+#define FLUSH_ROUNDS 100
+// datagrams sent before reading them back should fit the socket buffer
+#define SOCKET_BUF_SIZE (4 * 1024 * 1024)
+#define MAX_BATCH_BYTES (128 * 1024)
+
+// delimiters of processed packet, allocated once like the index of a worker
+struct packet_index_s packet_index;
+
+struct traffic_s {
+    char *data;
+    int *packet_offset;
+    int *packet_length;
+    int packets;
+    long lines;
+};
+
+double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+char *synthesize_traffic(long lines) {
+    char *data = (char *)malloc(lines * 64);
+    char *p = data;
+    unsigned int seed = 42;
+    long i = 0;
+    int kind = 0;
+
+    for (i = 0; i < lines; i++) {
+        kind = rand_r(&seed) % 100;
+        if (kind < 70) {
+            p += sprintf(p, "service.api.requests.endpoint_%d:%d|c\n", rand_r(&seed) % 5000, 1 + rand_r(&seed) % 3);
+        } else if (kind < 95) {
+            p += sprintf(p, "service.api.latency.endpoint_%d:%d|ms\n", rand_r(&seed) % 500, rand_r(&seed) % 1000);
+        } else {
+            p += sprintf(p, "service.api.queue.size_%d:%d|g\n", rand_r(&seed) % 200, rand_r(&seed) % 100);
+        }
+    }
+    return data;
+}
+
+// splits lines into packets not longer than size
+void packetize(struct traffic_s *traffic, int size) {
+    char *p = traffic->data;
+    char *eol = NULL;
+    int allocated = 1024;
+
+    traffic->packets = 0;
+    traffic->lines = 0;
+    traffic->packet_offset = (int *)malloc(allocated * sizeof(int));
+    traffic->packet_length = (int *)malloc(allocated * sizeof(int));
+    while (*p != 0) {
+        if (traffic->packets == allocated) {
+            allocated *= 2;
+            traffic->packet_offset = (int *)realloc(traffic->packet_offset, allocated * sizeof(int));
+            traffic->packet_length = (int *)realloc(traffic->packet_length, allocated * sizeof(int));
+        }
+        traffic->packet_offset[traffic->packets] = p - traffic->data;
+        traffic->packet_length[traffic->packets] = 0;
+        while (*p != 0 && (eol = strchr(p, '\n')) != NULL && traffic->packet_length[traffic->packets] + (eol - p + 1) <= size) {
+            traffic->packet_length[traffic->packets] += eol - p + 1;
+            traffic->lines++;
+            p = eol + 1;
+        }
+        traffic->packets++;
+    }
+}
+
+// returns udp socket bound to loopback, its port is written to port
+int bind_loopback(int *port) {
+    struct sockaddr_in addr;
+    socklen_t length = sizeof(addr);
+    int size = SOCKET_BUF_SIZE;
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        fprintf(stderr, "failed to bind loopback socket: %s\n", strerror(errno));
+        exit(1);
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    getsockname(fd, (struct sockaddr *)&addr, &length);
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+// reads and drops everything waiting in the socket, returns number of datagrams
+long drain(int fd, struct mmsghdr *msgs) {
+    long received = 0;
+    int n = 0;
+
+    while ((n = recvmmsg(fd, msgs, DEFAULT_DATA_RECV_BATCH_SIZE, MSG_DONTWAIT, NULL)) > 0) {
+        received += n;
+    }
+    return received;
+}
+
+// packets of the pool have size of the previous run, so pool is emptied before size is changed
+void reset_packet_pool() {
+    struct packet_s *packet = NULL;
+
+    while ((packet = downstream_dequeue_packet()) != NULL) {
+        downstream_release_packet(packet);
+    }
+    downstream_release_packet(global.downstream.active_packet);
+    while ((packet = global.downstream.free_packets) != NULL) {
+        global.downstream.free_packets = packet->next;
+        free(packet);
+    }
+    global.downstream.packets_allocated = 0;
+    global.downstream.active_packet = downstream_get_packet();
+}
+
+// flush aggregated data and pretend it was sent
+void flush_and_discard(struct aggregator_s *aggregator) {
+    struct packet_s *packet = NULL;
+    struct downstream_host_s *host = global.downstream.downstream_hosts;
+
+    // no host is alive, so packets stay in the queue
+    host->health_client.alive = 0;
+    downstream_schedule_flush(aggregator);
+    aggregator_reset(aggregator);
+    while ((packet = downstream_dequeue_packet()) != NULL) {
+        downstream_release_packet(packet);
+    }
+    host->health_client.alive = 1;
+}
+
+void run_ingest(struct traffic_s *traffic, struct aggregator_s *aggregator, int size, int receiver, int receiver_port) {
+    struct sockaddr_in addr;
+    struct mmsghdr send_msgs[DEFAULT_DATA_RECV_BATCH_SIZE];
+    struct iovec send_iovecs[DEFAULT_DATA_RECV_BATCH_SIZE];
+    struct mmsghdr *recv_msgs = NULL;
+    struct iovec *recv_iovecs = NULL;
+    char *buffers = NULL;
+    int sender = socket(AF_INET, SOCK_DGRAM, 0);
+    int batch = MAX_BATCH_BYTES / size;
+    unsigned long lines_start = stat_get(STAT_LINES_RECEIVED);
+    unsigned long lines = 0;
+    unsigned long flushed_lines = 0;
+    long bytes = 0;
+    long datagrams = 0;
+    long packet = 0;
+    double start = 0;
+    double elapsed = 0;
+    int received = 0;
+    int sent = 0;
+    int i = 0;
+
+    batch = batch < 1 ? 1 : batch > DEFAULT_DATA_RECV_BATCH_SIZE ? DEFAULT_DATA_RECV_BATCH_SIZE : batch;
+    buffers = (char *)malloc(batch * global.data_buf_size);
+    recv_msgs = (struct mmsghdr *)calloc(batch, sizeof(struct mmsghdr));
+    recv_iovecs = (struct iovec *)calloc(batch, sizeof(struct iovec));
+    for (i = 0; i < batch; i++) {
+        recv_iovecs[i].iov_base = buffers + i * global.data_buf_size;
+        recv_iovecs[i].iov_len = global.data_buf_size - 1;
+        recv_msgs[i].msg_hdr.msg_iov = recv_iovecs + i;
+        recv_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(receiver_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    memset(send_msgs, 0, sizeof(send_msgs));
+
+    start = now();
+    while (lines < LINES_PER_RUN) {
+        for (i = 0; i < batch; i++) {
+            send_iovecs[i].iov_base = traffic->data + traffic->packet_offset[packet];
+            send_iovecs[i].iov_len = traffic->packet_length[packet];
+            send_msgs[i].msg_hdr.msg_iov = send_iovecs + i;
+            send_msgs[i].msg_hdr.msg_iovlen = 1;
+            send_msgs[i].msg_hdr.msg_name = &addr;
+            send_msgs[i].msg_hdr.msg_namelen = sizeof(addr);
+            packet = (packet + 1) % traffic->packets;
+        }
+        sent = sendmmsg(sender, send_msgs, batch, 0);
+        received = sent > 0 ? recvmmsg(receiver, recv_msgs, sent, MSG_DONTWAIT, NULL) : 0;
+        for (i = 0; i < received; i++) {
+            bytes += recv_msgs[i].msg_len;
+            process_data_packet(aggregator, &packet_index, recv_iovecs[i].iov_base, recv_msgs[i].msg_len);
+        }
+        datagrams += received > 0 ? received : 0;
+        lines = stat_get(STAT_LINES_RECEIVED) - lines_start;
+        if (lines - flushed_lines >= FLUSH_LINES) {
+            flush_and_discard(aggregator);
+            flushed_lines = lines;
+        }
+    }
+    flush_and_discard(aggregator);
+    elapsed = now() - start;
+    printf("  ingest %6d bytes %12.0f lines/s %8.1f MB/s %10.0f packets/s\n", size, lines / elapsed,
+        bytes / elapsed / 1e6, datagrams / elapsed);
+    close(sender);
+    free(buffers);
+    free(recv_msgs);
+    free(recv_iovecs);
+}
+
+void run_flush(struct aggregator_s *aggregator, int size, int receiver) {
+    struct mmsghdr *msgs = (struct mmsghdr *)calloc(DEFAULT_DATA_RECV_BATCH_SIZE, sizeof(struct mmsghdr));
+    struct iovec *iovecs = (struct iovec *)calloc(DEFAULT_DATA_RECV_BATCH_SIZE, sizeof(struct iovec));
+    char *buffers = (char *)malloc(DEFAULT_DATA_RECV_BATCH_SIZE * MAX_DATA_BUF_SIZE);
+    unsigned long packets_start = stat_get(STAT_PACKETS_SENT);
+    unsigned long bytes_start = stat_get(STAT_BYTES_SENT);
+    unsigned long packets = 0;
+    long received = 0;
+    double start = 0;
+    double elapsed = 0;
+    int round = 0;
+    int i = 0;
+
+    for (i = 0; i < DEFAULT_DATA_RECV_BATCH_SIZE; i++) {
+        iovecs[i].iov_base = buffers + i * MAX_DATA_BUF_SIZE;
+        iovecs[i].iov_len = MAX_DATA_BUF_SIZE;
+        msgs[i].msg_hdr.msg_iov = iovecs + i;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    start = now();
+    for (round = 0; round < FLUSH_ROUNDS; round++) {
+        // aggregator isn't reset, so the same metrics are packed every round
+        downstream_schedule_flush(aggregator);
+        while (global.downstream.queue_head != NULL) {
+            received += drain(receiver, msgs);
+            downstream_flush(ev_default_loop(0));
+        }
+        received += drain(receiver, msgs);
+    }
+    elapsed = now() - start;
+    packets = stat_get(STAT_PACKETS_SENT) - packets_start;
+    printf("  flush  %6d bytes %12.0f lines/s %8.1f MB/s %10.0f packets/s, %.1f%% received\n", size,
+        (double)aggregator->slots_active * FLUSH_ROUNDS / elapsed, (stat_get(STAT_BYTES_SENT) - bytes_start) / elapsed / 1e6,
+        packets / elapsed, packets > 0 ? 100.0 * received / packets : 0);
+    free(msgs);
+    free(iovecs);
+    free(buffers);
+}
+
+int main(int argc, char *argv[]) {
+    static int sizes[] = {1400, 9000, 65000};
+    struct traffic_s traffic;
+    struct aggregator_s aggregator;
+    struct aggregator_s flush_aggregator;
+    char downstream[64];
+    char line[DATA_BUF_SIZE];
+    int receiver_port = 0;
+    int flush_receiver_port = 0;
+    int receiver = bind_loopback(&receiver_port);
+    int flush_receiver = bind_loopback(&flush_receiver_port);
+    int i = 0;
+
+    global.log_level = ERROR + 1;
+    // whole flush should fit the queue, so nothing is dropped before it is sent
+    global.downstream_queue_size = 64 * 1024 * 1024;
+    global.downstream_buf_size = DEFAULT_DOWNSTREAM_BUF_SIZE;
+    global.data_buf_size = MAX_DATA_BUF_SIZE;
+    global.name_idle_intervals = DEFAULT_NAME_IDLE_INTERVALS;
+    global.tokenizer = tokenizer_select();
+    snprintf(downstream, sizeof(downstream), "127.0.0.1:%d:%d", flush_receiver_port, flush_receiver_port);
+    if (init_downstream(downstream) != 0 || aggregator_init(&aggregator) != 0 || aggregator_init(&flush_aggregator) != 0 ||
+        init_packet_index(&packet_index) != 0) {
+        fprintf(stderr, "initialization failed\n");
+        return 1;
+    }
+    update_downstreams(ev_default_loop(0));
+    global.downstream.downstream_hosts->health_client.alive = 1;
+    for (i = 0; i < FLUSH_SLOTS; i++) {
+        add_self_metric_line(&flush_aggregator, &packet_index, line, sprintf(line, "service.api.requests.endpoint_%d:%d|c\n", i, i));
+    }
+    traffic.data = synthesize_traffic(SYNTHETIC_LINES);
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        global.downstream_buf_size = sizes[i];
+        reset_packet_pool();
+        packetize(&traffic, sizes[i]);
+        printf("%d bytes: %d packets, %.1f lines per packet\n", sizes[i], traffic.packets, (double)traffic.lines / traffic.packets);
+        run_ingest(&traffic, &aggregator, sizes[i], receiver, receiver_port);
+        run_flush(&flush_aggregator, sizes[i], flush_receiver);
+        free(traffic.packet_offset);
+        free(traffic.packet_length);
+    }
+    return 0;
+}
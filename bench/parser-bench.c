@@ -0,0 +1,280 @@
+/**
+ * parser-bench: lines per second per core of packet tokenizers compared with memchr()
+ * passes over every line, and of the whole packet processing with each tokenizer.
+ *
+ * Usage: parser-bench [traffic_file...]
+ *
+ * traffic_file should contain statsd metrics one per line, e.g. recorded with
+ * `nc -ul 8125 > traffic_file`. Synthetic mix of counters, timers and gauges is
+ * always measured, recorded corpora are measured after it.
+**/
+
+#define STATSD_AGGREGATOR_NO_MAIN
+#include "../statsd-aggregator.c"
+
+#include <sys/time.h>
+
+#define PACKET_SIZE 1400
+#define SYNTHETIC_LINES 200000
+// every corpus is replayed until that many lines are processed
+#define LINES_PER_RUN 20000000
+// aggregated data is flushed every that many packets
+#define FLUSH_PACKETS 8192
+
+// delimiters of processed packet, allocated once like the index of a worker
+struct packet_index_s packet_index;
+
+struct corpus_s {
+    char *name;
+    char *data;
+    int *packet_offset;
+    int *packet_length;
+    int packets;
+    long lines;
+};
+
+struct tokenizer_s {
+    char *name;
+    tokenizer_f tokenize;
+};
+
+double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+char *synthesize_traffic(long lines) {
+    char *data = (char *)malloc(lines * 80);
+    char *p = data;
+    unsigned int seed = 42;
+    long i = 0;
+    int kind = 0;
+
+    for (i = 0; i < lines; i++) {
+        kind = rand_r(&seed) % 100;
+        if (kind < 60) {
+            p += sprintf(p, "service.api.requests.endpoint_%d.status_%d:%d|c\n", rand_r(&seed) % 5000, 200 + rand_r(&seed) % 5, 1 + rand_r(&seed) % 3);
+        } else if (kind < 70) {
+            p += sprintf(p, "service.api.requests.endpoint_%d:%d|c|@0.1\n", rand_r(&seed) % 5000, 1 + rand_r(&seed) % 3);
+        } else if (kind < 95) {
+            p += sprintf(p, "service.api.latency.endpoint_%d:%d|ms:%d|ms\n", rand_r(&seed) % 500, rand_r(&seed) % 1000, rand_r(&seed) % 1000);
+        } else {
+            p += sprintf(p, "service.api.queue.size_%d:%d|g\n", rand_r(&seed) % 200, rand_r(&seed) % 100);
+        }
+    }
+    return data;
+}
+
+char *read_traffic(char *filename) {
+    FILE *f = fopen(filename, "r");
+    long size = 0;
+    char *data = NULL;
+
+    if (f == NULL) {
+        fprintf(stderr, "failed to open %s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = (char *)malloc(size + 1);
+    if (fread(data, 1, size, f) != size) {
+        fprintf(stderr, "failed to read %s\n", filename);
+        exit(1);
+    }
+    data[size] = 0;
+    fclose(f);
+    return data;
+}
+
+// splits lines into packets not longer than PACKET_SIZE, too long lines are skipped
+void packetize(struct corpus_s *corpus) {
+    char *p = corpus->data;
+    char *eol = NULL;
+    int allocated = 1024;
+
+    corpus->packets = 0;
+    corpus->lines = 0;
+    corpus->packet_offset = (int *)malloc(allocated * sizeof(int));
+    corpus->packet_length = (int *)malloc(allocated * sizeof(int));
+    while (*p != 0) {
+        if (corpus->packets == allocated) {
+            allocated *= 2;
+            corpus->packet_offset = (int *)realloc(corpus->packet_offset, allocated * sizeof(int));
+            corpus->packet_length = (int *)realloc(corpus->packet_length, allocated * sizeof(int));
+        }
+        corpus->packet_offset[corpus->packets] = p - corpus->data;
+        corpus->packet_length[corpus->packets] = 0;
+        while (*p != 0 && (eol = strchr(p, '\n')) != NULL && corpus->packet_length[corpus->packets] + (eol - p + 1) <= PACKET_SIZE) {
+            corpus->packet_length[corpus->packets] += eol - p + 1;
+            corpus->lines++;
+            p = eol + 1;
+        }
+        if (corpus->packet_length[corpus->packets] == 0) {
+            p = eol != NULL ? eol + 1 : p + strlen(p);
+            continue;
+        }
+        corpus->packets++;
+    }
+}
+
+// finds the same delimiters as the tokenizer with memchr() passes over every line and value
+long scan_with_memchr(char *buffer, int length) {
+    char *end = buffer + length;
+    char *line = buffer;
+    char *eol = NULL;
+    char *value = NULL;
+    char *separator = NULL;
+    char *type = NULL;
+    long found = 0;
+
+    while ((eol = memchr(line, '\n', end - line)) != NULL) {
+        value = memchr(line, ':', eol - line);
+        while (value != NULL) {
+            value++;
+            separator = memchr(value, ':', eol - value);
+            if (separator == NULL) {
+                separator = eol;
+            }
+            type = memchr(value, '|', separator - value);
+            if (type != NULL) {
+                found += memchr(type + 1, '|', separator - type) != NULL;
+            }
+            found++;
+            value = separator == eol ? NULL : separator;
+        }
+        line = eol + 1;
+    }
+    return found;
+}
+
+void run_tokenizers(struct corpus_s *corpus, struct tokenizer_s *tokenizers, int tokenizers_num) {
+    long rounds = LINES_PER_RUN / corpus->lines + 1;
+    long found = 0;
+    long round = 0;
+    double start = 0;
+    double elapsed = 0;
+    int i = 0;
+    int t = 0;
+
+    start = now();
+    for (round = 0; round < rounds; round++) {
+        for (i = 0; i < corpus->packets; i++) {
+            found += scan_with_memchr(corpus->data + corpus->packet_offset[i], corpus->packet_length[i]);
+        }
+    }
+    elapsed = now() - start;
+    printf("  scan   %-8s %12.0f lines/s %7.1f ns/line\n", "memchr", corpus->lines * rounds / elapsed,
+        elapsed * 1e9 / (corpus->lines * rounds));
+    for (t = 0; t < tokenizers_num; t++) {
+        start = now();
+        for (round = 0; round < rounds; round++) {
+            for (i = 0; i < corpus->packets; i++) {
+                tokenizers[t].tokenize(corpus->data + corpus->packet_offset[i], corpus->packet_length[i], &packet_index);
+                found += packet_index.delimiters_num;
+            }
+        }
+        elapsed = now() - start;
+        printf("  scan   %-8s %12.0f lines/s %7.1f ns/line\n", tokenizers[t].name, corpus->lines * rounds / elapsed,
+            elapsed * 1e9 / (corpus->lines * rounds));
+    }
+    // keeps the compiler from throwing scans away
+    if (found < 0) {
+        printf("no delimiters found\n");
+    }
+}
+
+// flush aggregated data and pretend it was sent
+void flush_and_discard(struct aggregator_s *aggregator) {
+    struct packet_s *packet = NULL;
+
+    downstream_schedule_flush(aggregator);
+    aggregator_reset(aggregator);
+    ev_io_stop(ev_default_loop(0), &(global.downstream.flush_watcher));
+    while ((packet = downstream_dequeue_packet()) != NULL) {
+        downstream_release_packet(packet);
+    }
+}
+
+void run_processing(struct corpus_s *corpus, struct aggregator_s *aggregator, struct tokenizer_s *tokenizers, int tokenizers_num) {
+    char packet[DATA_BUF_SIZE];
+    long rounds = LINES_PER_RUN / corpus->lines + 1;
+    long packets_since_flush = 0;
+    long round = 0;
+    double start = 0;
+    double elapsed = 0;
+    int i = 0;
+    int t = 0;
+
+    for (t = 0; t < tokenizers_num; t++) {
+        global.tokenizer = tokenizers[t].tokenize;
+        start = now();
+        for (round = 0; round < rounds; round++) {
+            for (i = 0; i < corpus->packets; i++) {
+                // process_data_packet() modifies the packet so we work on a copy, like recv() would do
+                memcpy(packet, corpus->data + corpus->packet_offset[i], corpus->packet_length[i]);
+                process_data_packet(aggregator, &packet_index, packet, corpus->packet_length[i]);
+                if (++packets_since_flush == FLUSH_PACKETS) {
+                    flush_and_discard(aggregator);
+                    packets_since_flush = 0;
+                }
+            }
+        }
+        flush_and_discard(aggregator);
+        elapsed = now() - start;
+        printf("  packet %-8s %12.0f lines/s %7.1f ns/line\n", tokenizers[t].name, corpus->lines * rounds / elapsed,
+            elapsed * 1e9 / (corpus->lines * rounds));
+    }
+}
+
+int main(int argc, char *argv[]) {
+    struct tokenizer_s tokenizers[3];
+    int tokenizers_num = 0;
+    struct corpus_s corpus;
+    struct aggregator_s aggregator;
+    char downstream[] = "127.0.0.1:8125:8126";
+    int i = 0;
+
+    // nothing is sent, so errors about unreachable downstream are not interesting
+    global.log_level = ERROR + 1;
+    global.downstream_queue_size = DEFAULT_DOWNSTREAM_QUEUE_SIZE;
+    global.downstream_buf_size = DEFAULT_DOWNSTREAM_BUF_SIZE;
+    global.data_buf_size = DEFAULT_DATA_BUF_SIZE;
+    global.name_idle_intervals = DEFAULT_NAME_IDLE_INTERVALS;
+    if (init_downstream(downstream) != 0 || aggregator_init(&aggregator) != 0 || init_packet_index(&packet_index) != 0) {
+        fprintf(stderr, "initialization failed\n");
+        return 1;
+    }
+    tokenizers[tokenizers_num].name = "scalar";
+    tokenizers[tokenizers_num++].tokenize = tokenize_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        tokenizers[tokenizers_num].name = "sse2";
+        tokenizers[tokenizers_num++].tokenize = tokenize_sse2;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        tokenizers[tokenizers_num].name = "avx2";
+        tokenizers[tokenizers_num++].tokenize = tokenize_avx2;
+    }
+#endif
+
+    for (i = 0; i < argc; i++) {
+        corpus.name = i == 0 ? "synthetic" : argv[i];
+        corpus.data = i == 0 ? synthesize_traffic(SYNTHETIC_LINES) : read_traffic(argv[i]);
+        packetize(&corpus);
+        if (corpus.lines == 0) {
+            fprintf(stderr, "no traffic in %s\n", corpus.name);
+            return 1;
+        }
+        printf("%s: %ld lines, %d packets, %.1f bytes per line\n", corpus.name, corpus.lines, corpus.packets,
+            (double)(corpus.packet_offset[corpus.packets - 1] + corpus.packet_length[corpus.packets - 1]) / corpus.lines);
+        run_tokenizers(&corpus, tokenizers, tokenizers_num);
+        run_processing(&corpus, &aggregator, tokenizers, tokenizers_num);
+        free(corpus.data);
+        free(corpus.packet_offset);
+        free(corpus.packet_length);
+    }
+    return 0;
+}
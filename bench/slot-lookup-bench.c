@@ -0,0 +1,102 @@
+/**
+ * slot-lookup-bench: compares hash index lookup of slots with linear scan
+ * which was used by find_slot() before, for different number of distinct names.
+**/
+
+#define STATSD_AGGREGATOR_NO_MAIN
+#include "../statsd-aggregator.c"
+
+#include <sys/time.h>
+
+#define LOOKUPS_PER_RUN 2000000
+#define LINEAR_SCAN_MAX_WORK 4000000000.0
+
+// lookup as it was done by find_slot() before hash index was introduced
+int linear_scan(slot_s *slots, char *names, int slots_used, char *line, int name_length) {
+    int i = 0;
+    for (i = 0; i < slots_used; i++) {
+        if (slots[i].name_length == name_length) {
+            if (memcmp(line, names + slots[i].name, name_length) == 0) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+void run(int names_num) {
+    slot_s *slots = (slot_s *)malloc(names_num * sizeof(slot_s));
+    char (*names)[64] = malloc(names_num * 64);
+    int *lengths = (int *)malloc(names_num * sizeof(int));
+    struct slot_index_s index;
+    int index_size = 1;
+    uint32_t position = 0;
+    long i = 0;
+    long lookups = 0;
+    long found = 0;
+    double start = 0;
+    double linear_rate = 0;
+    double hash_rate = 0;
+
+    while (index_size < 2 * names_num) {
+        index_size <<= 1;
+    }
+    if (slots == NULL || names == NULL || lengths == NULL || slot_index_init(&index, index_size) != 0) {
+        fprintf(stderr, "failed to allocate memory\n");
+        exit(1);
+    }
+    for (i = 0; i < names_num; i++) {
+        // realistic names share long common prefix
+        lengths[i] = sprintf(names[i], "application.host-%03ld.requests.endpoint_%ld:", i % 100, i);
+        slots[i].name = i * 64;
+        slots[i].name_length = lengths[i];
+        slots[i].hash = hash_name(names[i], lengths[i]);
+        slot_index_lookup(&index, slots, (char *)names, slots[i].hash, names[i], lengths[i], &position);
+        slot_index_insert(&index, position, slots[i].hash, i);
+    }
+
+    // linear scan is quadratic, so we limit amount of work for big tables
+    lookups = LOOKUPS_PER_RUN;
+    if ((double)lookups * names_num > LINEAR_SCAN_MAX_WORK) {
+        lookups = LINEAR_SCAN_MAX_WORK / names_num;
+    }
+    start = now();
+    for (i = 0; i < lookups; i++) {
+        found += linear_scan(slots, (char *)names, names_num, names[(i * 7919) % names_num], lengths[(i * 7919) % names_num]) >= 0;
+    }
+    linear_rate = lookups / (now() - start);
+
+    lookups = LOOKUPS_PER_RUN;
+    start = now();
+    for (i = 0; i < lookups; i++) {
+        // hash is computed here because find_slot() computes it for every line
+        char *name = names[(i * 7919) % names_num];
+        int length = lengths[(i * 7919) % names_num];
+        found += slot_index_lookup(&index, slots, (char *)names, hash_name(name, length), name, length, &position) >= 0;
+    }
+    hash_rate = lookups / (now() - start);
+
+    printf("%8d %16.0f %16.0f %8.1fx %ld\n", names_num, linear_rate, hash_rate, hash_rate / linear_rate, found);
+    free(index.entries);
+    free(lengths);
+    free(names);
+    free(slots);
+}
+
+int main(int argc, char *argv[]) {
+    int names_num[] = {10, 100, 1000, 10000};
+    int i = 0;
+
+    global.log_level = ERROR;
+    printf("%8s %16s %16s %9s %s\n", "names", "linear/s", "hash/s", "speedup", "hits");
+    for (i = 0; i < sizeof(names_num) / sizeof(names_num[0]); i++) {
+        run(names_num[i]);
+    }
+    return 0;
+}
@@ -5,12 +5,17 @@
 
 #pragma GCC diagnostic ignored "-Wstrict-aliasing"
 
+// needed for recvmmsg()
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <netinet/in.h>
 #include <ev.h>
 #include <netdb.h>
+#include <resolv.h>
+#include <arpa/nameser.h>
 #include <sys/fcntl.h>
 #include <time.h>
 #include <signal.h>
@@ -19,42 +24,256 @@
 #include <errno.h>
 #include <pthread.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+// io_uring is used through raw syscalls, only kernel headers are needed
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+// multishot receive and provided buffer rings came with linux 6.0 headers
+#if defined(IORING_RECV_MULTISHOT) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING
+#endif
 
-// Size of buffer for outgoing packets. Should be below MTU.
-// TODO Probably should be configured via configuration file?
-#define DOWNSTREAM_BUF_SIZE 1450
-#define DOWNSTREAM_BUF_NUM 16
+// Size of buffer for outgoing packets. Should be below MTU, default fits ethernet MTU.
+// Biggest one is the largest udp payload
+#define DEFAULT_DOWNSTREAM_BUF_SIZE 1450
+#define MIN_DOWNSTREAM_BUF_SIZE 512
+#define MAX_DOWNSTREAM_BUF_SIZE 65507
+// how many bytes of outgoing packets can wait for sending
+#define DEFAULT_DOWNSTREAM_QUEUE_SIZE 1048576
+// how many packets are sent with single sendmmsg() call
+#define DOWNSTREAM_SEND_BATCH_SIZE 64
+// submission queue entries of io_uring of every thread, half of them can be taken by sends of the flush queue
+#define URING_ENTRIES 256
+#define URING_SEND_SLOTS (URING_ENTRIES / 2)
+// provided buffers of the data socket are registered as this group
+#define URING_BUFFER_GROUP 0
+// Size of buffer for incoming packets, longer datagrams are truncated. Packet index keeps 16 bit
+// offsets, so buffer can't be longer than 64K
+#define DEFAULT_DATA_BUF_SIZE 4096
+#define MIN_DATA_BUF_SIZE 512
+#define MAX_DATA_BUF_SIZE 65536
 // Size of other temporary buffers
 #define DATA_BUF_SIZE 4096
 #define LOG_BUF_SIZE 2048
+// log lines are collected in this buffer and written out by log_flush()
+#define LOG_WRITER_BUF_SIZE 65536
+// how often buffered log lines are written out
+#define LOG_FLUSH_INTERVAL 0.1
+// how many log lines per second are written, the rest is counted and dropped
+#define DEFAULT_LOG_RATE_LIMIT 1000
+// messages below this level are compiled out, e.g. make LOG_MIN_LEVEL=4 keeps errors only
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 0
+#endif
+
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+// arguments are not evaluated if level is disabled, so disabled message costs single predictable branch
+#define log_msg(level, ...) do { \
+    if ((level) >= LOG_MIN_LEVEL && unlikely((level) >= global.log_level)) { \
+        log_write((level), __VA_ARGS__); \
+    } \
+} while (0)
+
+// how many datagrams we try to read with single recvmmsg() call
+#define DEFAULT_DATA_RECV_BATCH_SIZE 32
+#define MAX_DATA_RECV_BATCH_SIZE 1024
 
-// worst scenario: a lot of metrics with unique short names.
-// Metric would look like: aa:1|c\n
-// Metric length is 7 chars
-// Example: 1450 / 7 = 207 so we need 207 slots if DOWNSTREAM_BUF_SIZE is 1450
-#define NUM_OF_SLOTS (DOWNSTREAM_BUF_SIZE / 7)
+// how many threads read data socket
+#define DEFAULT_WORKERS_NUM 1
+#define MAX_WORKERS_NUM 256
+// how many tcp and unix stream connections can be open at once
+#define MAX_STREAM_CLIENTS 1024
+
+// slots table grows to hold every distinct metric name seen during flush interval,
+// this is how many slots we allocate at start
+#define NUM_OF_SLOTS 256
+// initial size of the arena for slot names and values, it grows when needed
+#define ARENA_SIZE 65536
+// minimal and maximal size of chunk of slot values
+#define VALUES_CHUNK_SIZE 64
+#define MAX_VALUES_CHUNK_SIZE 4096
 
 #define MAX_COUNTER_LENGTH 18 // because of "%.15g|c\n"
+// "%.15g|c\n" can be longer than MAX_COUNTER_LENGTH if exponent is used
+#define COUNTER_BUF_SIZE 32
+// integers with up to 15 digits are printed by "%.15g" without exponent
+#define MAX_EXACT_COUNTER 1e15
+// number of significant digits which are parsed exactly without strtod()
+#define MAX_FAST_PARSE_DIGITS 15
+
+// timer sketch buckets keep that many top bits of mantissa, relative error is below 2^-(bits + 1)
+#define TIMER_SKETCH_PRECISION_BITS 7
+// sign bit of the value is kept in the key, so negative values are bucketed by magnitude
+#define TIMER_SKETCH_NEGATIVE_KEY (1u << (63 - (52 - TIMER_SKETCH_PRECISION_BITS)))
+// initial number of buckets in timer sketch, should be power of 2
+#define TIMER_SKETCH_SIZE 16
+#define MAX_TIMER_PERCENTILES 16
+#define DEFAULT_TIMER_PERCENTILES "50,90,99"
+// "%.15g" of the value with ".p99_99" suffix and type, negative value is preceded with "0|g:"
+#define MAX_TIMER_SUMMARY_LENGTH 48
+
+// initial size of hash table over set members, should be power of 2
+#define SET_TABLE_SIZE 16
+// sets with more distinct members than that are counted with HyperLogLog, 0 - never
+#define DEFAULT_SET_HLL_THRESHOLD 0
+// names which got no data during that many intervals of their aggregator are evicted
+#define DEFAULT_NAME_IDLE_INTERVALS 10
+// how many name_limit prefixes can be configured and how long they can be
+#define MAX_NAME_LIMITS 32
+#define MAX_NAME_LIMIT_PREFIX_LENGTH 128
+// names over the limit are rolled up into prefix followed by this suffix
+#define NAME_LIMIT_OVERFLOW_SUFFIX "overflow:"
+// HyperLogLog has 2^HLL_PRECISION registers, standard error is 1.04 / sqrt(2^HLL_PRECISION)
+#define HLL_PRECISION 12
+#define HLL_REGISTERS (1 << HLL_PRECISION)
+
+// points of every downstream host on the consistent hash ring, more points spread metrics more evenly
+#define DOWNSTREAM_RING_POINTS 160
 
-// default interval to check if downstream ips changed
+// default interval to check if downstream ips changed, records with shorter TTL are checked more often
 #define DEFAULT_DNS_REFRESH_INTERVAL 60
+#define MIN_DNS_REFRESH_INTERVAL 1
+#define DNS_ANSWER_BUF_SIZE 4096
 
 // default interval to check downstream health
 #define DEFAULT_DOWNSTREAM_HEALTHCHECK_INTERVAL 1.0
+// delay before reconnecting downstream tcp connection, it doubles after every failure
+#define MIN_DOWNSTREAM_TCP_BACKOFF 0.1
+#define MAX_DOWNSTREAM_TCP_BACKOFF 30.0
+// spool keeps packets on disk while no downstream host is up
+#define DEFAULT_SPOOL_SIZE 67108864
+#define MIN_SPOOL_SIZE 1048576
+#define DEFAULT_SPOOL_DRAIN_RATE 5000
+// spooled packets are sent in small portions this often, so the loop isn't busy with them for long
+#define SPOOL_DRAIN_INTERVAL 0.01
+#define SPOOL_MAGIC 0x4c4f4f50
 
 #define DEFAULT_LOG_LEVEL 0
+// histograms have power of two buckets of nanoseconds, the last one is ~9 minutes
+#define HISTOGRAM_BUCKETS 40
+// size of the stats report served on admin port
+#define STATS_BUF_SIZE 8192
 #define MAX_DOWNSTREAM_NUM 32
 #define MAX_PACKETS_PER_SOCKET 1000
 
-// structure to accumulate metrics data for specific name
+// initial size of hash index for slots, should be power of 2 and at least 2 * NUM_OF_SLOTS
+#define SLOT_INDEX_SIZE 512
+
+// offset which doesn't point to any arena data
+#define ARENA_NULL UINT32_MAX
+#define ARENA_PTR(arena, offset) ((arena)->buffer + (offset))
+
+// bump allocator for slot names and values. Data is referenced by offsets since
+// buffer can be moved when arena grows. Values arena is reset on every flush, names arena is compacted on eviction
+struct arena_s {
+    char *buffer;
+    uint32_t size;
+    uint32_t used;
+};
+
+// chunk of slot values in the arena, values are separated with ':' and never span chunks
 typedef struct {
-    char buffer[DOWNSTREAM_BUF_SIZE];
-    int name_length;
-    int length;
-    double counter;
-    int type;
+    // offset of the next chunk
+    uint32_t next;
+    uint32_t length;
+    uint32_t size;
+    char data[];
+} values_chunk_s;
+
+// bucket of timer sketch, key 0 marks empty bucket
+typedef struct {
+    uint32_t key;
+    uint32_t count;
+} timer_bucket_s;
+
+// mergeable sketch of timer values, it is stored in arena and buckets form open addressing hash table
+typedef struct {
+    double sum;
+    double min;
+    double max;
+    uint64_t count;
+    // zero values are counted here instead of buckets
+    uint32_t zero_count;
+    uint32_t buckets_used;
+    uint32_t mask;
+    timer_bucket_s buckets[];
+} timer_sketch_s;
+
+// structure to accumulate metrics data for specific name.
+// It holds metadata only and is kept small so that slots are densely packed.
+// Name and hash live across flushes, other fields are reset when slot gets data in a new interval
+typedef struct {
+    // hash of the metric name
+    uint32_t hash;
+    // names arena offset of the metric name (including ':')
+    uint32_t name;
+    // arena offsets of the first and the last chunk of values
+    uint32_t values_head;
+    uint32_t values_tail;
+    // total length of values, for counters and timer sketches it is number of samples
+    uint32_t values_length;
+    uint16_t name_length;
+    uint8_t type;
+    uint8_t flags;
+    union {
+        // sum of counter or value of gauge
+        double counter;
+        // arena offset of the hash table over set members or HyperLogLog registers
+        uint32_t members;
+    };
 } slot_s;
 
+// slot flags
+// gauge got absolute value, otherwise it has only sum of deltas
+#define SLOT_GAUGE_ABSOLUTE 1
+// set is counted with HyperLogLog
+#define SLOT_SET_HLL 2
+
+// set member stored in values of the slot
+typedef struct {
+    uint32_t hash;
+    // arena offset of the member, 0 marks empty entry
+    uint32_t offset;
+    uint32_t length;
+} set_member_s;
+
+// open addressing hash table over distinct members of the set
+typedef struct {
+    uint32_t used;
+    uint32_t mask;
+    set_member_s members[];
+} set_table_s;
+
+// entry of open addressing hash index over slots
+typedef struct {
+    uint32_t hash;
+    // entry is valid only if its generation matches generation of the index
+    uint32_t generation;
+    int slot_idx;
+} slot_index_entry_s;
+
+// hash index over slots. Bumping generation invalidates all entries at once,
+// so index can be cleared on every flush without touching its memory
+struct slot_index_s {
+    slot_index_entry_s *entries;
+    uint32_t mask;
+    uint32_t generation;
+};
+
 #define STRLEN(s) (sizeof(s) / sizeof(s[0]) - 1)
 
 #define DOWNSTREAM_HEALTH_CHECK_BUF_SIZE 32
@@ -65,67 +284,481 @@ typedef struct {
 struct downstream_health_client_s {
     // ev_io structure used for downstream health checks
     struct ev_io super;
-    // sockaddr for health connection
-    struct sockaddr_in sa_in;
+    // sockaddr for health connection, it has family of the host address
+    struct sockaddr_storage sa;
+    socklen_t sa_len;
     // bit flag if this downstream is alive
     unsigned int alive:1;
 };
 
+// persistent connection to the downstream data port used in tcp mode
+struct downstream_tcp_client_s {
+    // ev_io structure used for connecting, writing and noticing closed connection, should be first member
+    struct ev_io super;
+    // events the watcher is started with, 0 if it is stopped
+    int events;
+    unsigned int connected:1;
+    // sockaddr for data connection, it has family of the host address
+    struct sockaddr_storage sa;
+    socklen_t sa_len;
+    // packets routed to this host, head one can be partially written
+    struct packet_s *queue_head;
+    struct packet_s *queue_tail;
+    int queue_length;
+    int head_offset;
+    // reconnect isn't attempted before reconnect_at, backoff doubles after every failure
+    ev_tstamp backoff;
+    ev_tstamp reconnect_at;
+};
+
 struct downstream_host_s {
-    struct sockaddr_in sa_in_data;
+    // sockaddr for data, it has family of the flush socket. IPv4 address is mapped to IPv6 if the socket is dual-stack
+    struct sockaddr_storage sa_data;
+    socklen_t sa_data_len;
     struct downstream_host_s *next;
     struct downstream_health_client_s health_client;
+    struct downstream_tcp_client_s tcp_client;
+};
+
+// addresses of the downstream host name, ports are not set. Resolver thread fills it and hands it to
+// the loop thread, it isn't changed after that
+struct dns_result_s {
+    int addrs_num;
+    struct sockaddr_storage addrs[MAX_DOWNSTREAM_NUM];
+};
+
+// how packets are spread between downstream hosts
+enum downstream_routing_e {
+    // every packet goes to the next healthy host
+    ROUTING_ROUND_ROBIN,
+    // every metric name goes to the same host while it is healthy
+    ROUTING_CONSISTENT_HASH
+};
+
+// point of the consistent hash ring, metric belongs to the first point at or after its hash
+typedef struct {
+    uint32_t hash;
+    // index in ring_hosts
+    int host;
+} ring_point_s;
+
+// how timers are aggregated
+enum timer_aggregation_e {
+    // all values are sent
+    TIMER_AGGREGATION_RAW,
+    // count, sum, min, max and percentiles are sent
+    TIMER_AGGREGATION_SUMMARY
+};
+
+// how data is sent to downstream hosts
+enum downstream_protocol_e {
+    // packets not exceeding MTU, one datagram each
+    PROTOCOL_UDP,
+    // stream of lines over persistent connection to every host
+    PROTOCOL_TCP
+};
+
+// how sockets are read and written
+enum io_backend_e {
+    // readiness notifications of libev, one syscall per batch
+    IO_BACKEND_LIBEV,
+    // completions of io_uring, see struct uring_s
+    IO_BACKEND_IO_URING
+};
+
+// what to drop when flush queue is full
+enum drop_policy_e {
+    DROP_OLDEST,
+    DROP_NEWEST
+};
+
+// what to do with names over name_limit
+enum name_limit_policy_e {
+    // values are added to the overflow metric of the prefix
+    NAME_LIMIT_ROLLUP,
+    NAME_LIMIT_DROP
+};
+
+// how many distinct names with given prefix get their own slot during flush interval
+struct name_limit_s {
+    char prefix[MAX_NAME_LIMIT_PREFIX_LENGTH];
+    int prefix_length;
+    int limit;
+    // prefix followed by NAME_LIMIT_OVERFLOW_SUFFIX
+    char overflow_name[MAX_NAME_LIMIT_PREFIX_LENGTH + sizeof(NAME_LIMIT_OVERFLOW_SUFFIX)];
+    int overflow_length;
+};
+
+// outgoing packet, packets are linked into flush queue or pool of free packets
+struct packet_s {
+    struct packet_s *next;
+    int length;
+    // hash of the first metric name in the packet, picks downstream host in consistent hash mode
+    uint32_t hash;
+    // downstream_buf_size bytes
+    char data[];
+};
+
+// spool file starts with header, records of packets follow it
+struct spool_header_s {
+    uint32_t magic;
+    uint32_t reserved;
+    // records before read_offset are sent, records after write_offset are not written yet
+    uint64_t read_offset;
+    uint64_t write_offset;
+};
+
+// record of the spooled packet, packet data follows it
+struct spool_record_s {
+    uint32_t length;
+    uint32_t hash;
+};
+
+// structure that holds spool file state
+struct spool_s {
+    // mapping of the whole spool file, NULL if spool is disabled
+    char *map;
+    uint64_t size;
+    // set when packets didn't fit, so it's logged once until spool is drained
+    int full;
+    // sends spooled packets while downstream hosts are up
+    struct ev_timer drain_watcher;
 };
 
 // structure that holds downstream data
 struct downstream_s {
-    // buffer where data is added
-    int active_buffer_idx;
-    char *active_buffer;
-    int active_buffer_length;
-    // buffer ready for flush
-    int flush_buffer_idx;
-    // memory for active and flush buffers
-    char buffer[DOWNSTREAM_BUF_SIZE * DOWNSTREAM_BUF_NUM];
-    // lengths of buffers from the above array
-    int buffer_length[DOWNSTREAM_BUF_NUM];
+    // packet where data is added
+    struct packet_s *active_packet;
+    // packets ready for flush, oldest first
+    struct packet_s *queue_head;
+    struct packet_s *queue_tail;
+    int queue_length;
+    // sent packets which can be reused
+    struct packet_s *free_packets;
+    // how many packets are allocated, it is limited by queue_size
+    int packets_allocated;
     char *data_host;
     int data_port;
     int health_port;
-    // new ip addrs filled in by the downstream_refresh()
-    struct in_addr in_addr_new[MAX_DOWNSTREAM_NUM];
-    // flag that new sockaddr data is available
-    int in_addr_new_ready;
+    // single slot handoff of new addresses from downstream_refresh() thread, swapped atomically
+    struct dns_result_s *dns_result;
+    // wakes the loop when new addresses are available
+    struct ev_async dns_watcher;
     // id extended ev_io structure used for sending data to downstream
     struct ev_io flush_watcher;
-    // slots for accumulating metrics
-    slot_s slots[NUM_OF_SLOTS];
-    // how many slots are used
-    int slots_used;
+    // family of the flush socket, AF_INET6 socket is dual-stack
+    int flush_family;
     // how many downstream hosts we have
     int downstream_host_num;
     struct downstream_host_s *downstream_hosts;
     int packets_sent;
     struct downstream_host_s *current_downstream_host;
+    // consistent hash ring over downstream hosts, sorted by hash. It is rebuilt when hosts are added
+    // or removed, hosts which are down are skipped on lookup so only their metrics move
+    ring_point_s ring[MAX_DOWNSTREAM_NUM * DOWNSTREAM_RING_POINTS];
+    int ring_size;
+    struct downstream_host_s *ring_hosts[MAX_DOWNSTREAM_NUM];
+    // hash of metric name being packed, it is copied into new packets
+    uint32_t packet_hash;
+    // per slot hashes and hosts, and slots grouped by host, used on flush in consistent hash mode
+    uint32_t *slot_hashes;
+    int *slot_hosts;
+    int *slot_order;
+    int slot_buffers_size;
+};
+
+// names of the name_limit prefix admitted and shed by the aggregator during current interval
+struct name_limit_usage_s {
+    // names which got their own slot
+    int names;
+    // how many of them had data in the previous interval
+    int returned;
+    // names which got their own slot in the previous interval, they are admitted first
+    int reserved;
+    // metrics rolled up or dropped
+    unsigned long shed;
+    // values arena offset of HyperLogLog registers over hashes of shed names, ARENA_NULL if nothing was shed
+    uint32_t shed_names;
+};
+
+/* structure that holds metrics accumulated during flush interval. Slots are interned names which are kept
+ * across intervals, so recurring names are neither copied nor inserted into the index again
+ */
+struct aggregator_s {
+    // slots for accumulating metrics
+    slot_s *slots;
+    // interval when slot got data last time, slots of older intervals have no data to flush
+    uint32_t *slot_intervals;
+    // how many slots are allocated
+    int slots_allocated;
+    // how many slots are used by interned names
+    int slots_used;
+    // how many slots got data in the current interval
+    int slots_active;
+    // incremented on every reset
+    uint32_t interval;
+    // hash index to find slot by metric name
+    struct slot_index_s slot_index;
+    // memory for slot values, it is reset on every flush
+    struct arena_s arena;
+    // memory for slot names
+    struct arena_s names;
+    // usage of every name_limit prefix
+    struct name_limit_usage_s name_limits[MAX_NAME_LIMITS];
+    // set while self-metrics are added, they are never shed
+    int self_metrics;
+};
+
+// returns 1 if slot got data in the current interval
+static inline int slot_active(struct aggregator_s *aggregator, int slot_idx) {
+    return aggregator->slot_intervals[slot_idx] == aggregator->interval;
+}
+
+// self-metrics counters
+enum stat_e {
+    STAT_WAKEUPS,
+    STAT_PACKETS_RECEIVED,
+    STAT_BYTES_RECEIVED,
+    STAT_LINES_RECEIVED,
+    STAT_INVALID_METRICS,
+    STAT_FLUSHES,
+    STAT_PACKETS_SENT,
+    STAT_BYTES_SENT,
+    STAT_SEND_FAILURES,
+    STAT_PACKETS_DROPPED,
+    STAT_BYTES_DROPPED,
+    STAT_PACKETS_SPOOLED,
+    STAT_PACKETS_UNSPOOLED,
+    STAT_METRICS_SHED,
+    STATS_NUM
+};
+
+enum histogram_e {
+    HISTOGRAM_PARSE,
+    HISTOGRAM_FLUSH,
+    HISTOGRAMS_NUM
+};
+
+// self-metrics of single thread. Only the owner thread writes them, others read them without locks
+struct stats_s {
+    unsigned long counters[STATS_NUM];
+    unsigned long histograms[HISTOGRAMS_NUM][HISTOGRAM_BUCKETS];
+};
+
+// delimiters of the packet found by single pass of the tokenizer. Offsets fit 16 bits
+// since UDP datagram is shorter than 64K. '@' isn't indexed, sample rate is recognized
+// by the byte after the second '|' of the value. Arrays are allocated once per worker by init_packet_index()
+struct packet_index_s {
+    // offsets of ':', '|' and '\n' in order of appearance, SIMD tokenizers write up to 3 entries past the last one
+    uint16_t *delimiters;
+    // index of the terminating '\n' in delimiters for every line
+    uint16_t *lines;
+    int delimiters_num;
+    int lines_num;
+};
+
+typedef void (*tokenizer_f)(char *buffer, int length, struct packet_index_s *index);
+
+// what io_uring completion is for, it is kept in the low byte of user_data
+enum uring_op_e {
+    URING_OP_RECV = 1,
+    URING_OP_SEND,
+    URING_OP_CANCEL
+};
+
+/* io_uring of a thread, its rings are shared with the kernel. Worker reads data socket with multishot receive
+ * into provided buffers, worker 0 also sends the flush queue through it. Completions are reaped from the loop
+ */
+struct uring_s {
+    // ev_io structure used for waiting completions, should be first member
+    struct ev_io watcher;
+    // -1 if io_uring isn't used
+    int fd;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    // tail of submission queue which isn't published to the kernel yet
+    unsigned sq_pending_tail;
+    // receive buffers, buffers_num of data_buf_size each
+    struct io_uring_buf_ring *buf_ring;
+    char *buffers;
+    int buffers_num;
+    // receive of the data socket is armed with this generation, completions of older ones are not rearmed
+    uint32_t recv_generation;
+    int recv_armed;
+    // set if kernel doesn't support multishot receive, data socket is read with recvmmsg() then
+    int recv_disabled;
+    // messages of sends in flight, free slots are kept in the stack
+    struct msghdr *send_msgs;
+    struct iovec *send_iovecs;
+    struct packet_s **send_packets;
+    int *send_free;
+    int send_free_num;
+    // datagrams reaped while the flush packs the aggregator, they are kept in their buffers till the next reap
+    int *deferred_bids;
+    int *deferred_lengths;
+    int deferred_num;
+};
+
+// structure that holds buffers for batched reads from data socket
+struct ingest_s {
+    // data_recv_batch_size buffers of data_buf_size each
+    char *buffer;
+    struct mmsghdr *msgs;
+    struct iovec *iovecs;
+    // delimiters of the packet being processed, shared by all data sources of the worker
+    struct packet_index_s index;
+};
+
+// tcp or unix stream connection. Line can be split between reads, its beginning is kept at the start of the buffer
+struct stream_client_s {
+    // ev_io structure used for reading the connection, should be first member
+    struct ev_io watcher;
+    // link in the pool of free clients
+    struct stream_client_s *next;
+    // bytes of incomplete line in the buffer
+    int length;
+    // set if line didn't fit into the buffer, the rest of it is skipped
+    int skip_line;
+    // data_buf_size bytes
+    char buffer[];
+};
+
+// each worker reads its own data socket in its own thread and aggregates data into its own aggregator.
+// On flush aggregators of other workers are merged into the one of worker 0, which runs in the main thread
+struct worker_s {
+    // ev_io structure used for reading data socket, should be first member
+    struct ev_io socket_watcher;
+    int id;
+    pthread_t thread;
+    struct ev_loop *loop;
+    struct ingest_s ingest;
+    // names are interned once per worker and kept across flushes
+    struct aggregator_s aggregator;
+    // protects aggregator, it is held by the worker while data is processed and by the flush while data is merged
+    pthread_mutex_t lock;
+    // self-metrics of the worker thread, worker 0 uses global ones
+    struct stats_s stats;
+    // socket bound to new data port on config reload, -1 if there is none. It is swapped in by the worker thread
+    int new_socket;
+    struct ev_async new_socket_watcher;
+    // used instead of socket_watcher with io_backend=io_uring
+    struct uring_s uring;
 };
 
 // globally accessed structure with commonly used data
 struct global_s {
     // port we are listening on
     int data_port;
+    // how many datagrams we read per recvmmsg() call
+    int data_recv_batch_size;
+    // size of buffers for incoming and outgoing packets
+    int data_buf_size;
+    int downstream_buf_size;
+    // how many workers read data socket
+    int workers_num;
+    enum io_backend_e io_backend;
+    struct worker_s *workers;
+    // self-metrics of the main thread
+    struct stats_s stats;
+    // sum of self-metrics of all threads at the last flush
+    struct stats_s stats_flushed;
+    // how many slots were used by the last flush and how many names are interned
+    int slots_used;
+    int slots_interned;
+    // port for stats requests, 0 if disabled
+    int admin_port;
+    // watchers of tcp and udp admin sockets
+    struct ev_io admin_tcp_watcher;
+    struct ev_io admin_udp_watcher;
+    // additional listeners, they are read by the main thread into worker 0 aggregator. 0 or NULL if disabled
+    int tcp_port;
+    char *unix_dgram_socket;
+    char *unix_stream_socket;
+    struct ev_io tcp_watcher;
+    struct ev_io unix_dgram_watcher;
+    struct ev_io unix_stream_watcher;
+    // open stream connections and pool of closed ones which can be reused
+    int stream_clients_num;
+    struct stream_client_s *free_stream_clients;
+    // if set self-metrics are sent with this prefix on every flush
+    char *self_metrics_prefix;
     struct downstream_s downstream;
+    // value of downstream config line
+    char *downstream_config;
+    // config is loaded from this file on start and on SIGHUP
+    char *config_file;
+    struct ev_signal sighup_watcher;
+    struct ev_periodic downstream_flush_timer_watcher;
+    struct ev_periodic downstream_healthcheck_timer_watcher;
+    // set if downstream_refresh() thread is started
+    int downstream_refresh_started;
     // how often we flush data
     ev_tstamp downstream_flush_interval;
     // how noisy is our log
     int log_level;
+    // how many log lines per second we write, 0 means no limit
+    int log_rate_limit;
     // how often we want to check if downstream ips were changed
     int dns_refresh_interval;
     // how often we check health of the downstreams
     ev_tstamp downstream_health_check_interval;
+    // how many bytes of packets can wait in the flush queue
+    int downstream_queue_size;
+    // what to drop if flush queue is full
+    enum drop_policy_e downstream_queue_drop_policy;
+    // file where packets are kept while no downstream host is up, NULL if disabled
+    char *spool_file;
+    uint64_t spool_size;
+    // how many spooled packets per second are sent when downstream is up again
+    int spool_drain_rate;
+    struct spool_s spool;
+    enum timer_aggregation_e timer_aggregation;
+    enum downstream_routing_e downstream_routing;
+    enum downstream_protocol_e downstream_protocol;
+    // how many distinct members set can have before it is switched to HyperLogLog
+    int set_hll_threshold;
+    // names without data during that many intervals are evicted
+    int name_idle_intervals;
+    // limits of distinct names per flush interval, longest matching prefix applies
+    struct name_limit_s name_limits[MAX_NAME_LIMITS];
+    int name_limits_num;
+    enum name_limit_policy_e name_limit_policy;
+    // percentiles sent for timers in summary mode
+    double timer_percentiles[MAX_TIMER_PERCENTILES];
+    int timer_percentiles_num;
+    // finds delimiters in data packets, the best one for the cpu is picked on start
+    tokenizer_f tokenizer;
 };
 
 struct global_s global;
 
+// self-metrics of the current thread
+__thread struct stats_s *thread_stats = &(global.stats);
+
+// buffered log writer, it is shared by all threads
+struct log_writer_s {
+    pthread_mutex_t lock;
+    char buffer[LOG_WRITER_BUF_SIZE];
+    int length;
+    // formatted timestamp is cached for the current second
+    time_t timestamp_time;
+    char timestamp[32];
+    int timestamp_length;
+    // lines written during current second and lines dropped because of log_rate_limit
+    int lines_this_second;
+    unsigned long lines_suppressed;
+};
+
+// lock is recursive because signal handlers log too
+struct log_writer_s log_writer = { .lock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP };
+
 // numeric values for log levels
 enum log_level_e {
     TRACE,
@@ -138,6 +771,9 @@ enum log_level_e {
 enum metric_type_e {
     TYPE_UNKNOWN,
     TYPE_COUNTER,
+    TYPE_TIMER,
+    TYPE_GAUGE,
+    TYPE_SET,
     TYPE_OTHER
 };
 
@@ -147,400 +783,3595 @@ char *log_level_name(enum log_level_e level) {
     return name[level];
 }
 
-// function to log message
-void log_msg(int level, char *format, ...) {
-    va_list args;
-    time_t t;
-    struct tm *tinfo;
-    char buffer[LOG_BUF_SIZE];
+// writes buffered log lines to stdout, log_writer.lock should be held
+void log_flush_locked() {
+    if (log_writer.length > 0) {
+        fwrite(log_writer.buffer, 1, log_writer.length, stdout);
+        fflush(stdout);
+        log_writer.length = 0;
+    }
+}
+
+// adds formatted line to the log buffer, log_writer.lock should be held
+void log_append_locked(int level, char *format, va_list args) {
     int l = 0;
 
-    if (level < global.log_level) {
-        return;
+    if (LOG_WRITER_BUF_SIZE - log_writer.length < LOG_BUF_SIZE) {
+        log_flush_locked();
     }
+    memcpy(log_writer.buffer + log_writer.length, log_writer.timestamp, log_writer.timestamp_length);
+    l = log_writer.timestamp_length;
+    l += sprintf(log_writer.buffer + log_writer.length + l, " %s ", log_level_name(level));
+    l += vsnprintf(log_writer.buffer + log_writer.length + l, LOG_BUF_SIZE - l - 1, format, args);
+    if (l > LOG_BUF_SIZE - 2) {
+        // message was truncated
+        l = LOG_BUF_SIZE - 2;
+    }
+    log_writer.buffer[log_writer.length + l] = '\n';
+    log_writer.length += l + 1;
+}
+
+void log_append(int level, char *format, ...) {
+    va_list args;
+
     va_start(args, format);
-    time(&t);
-    tinfo = localtime(&t);
-    l = strftime(buffer, LOG_BUF_SIZE, "%Y-%m-%d %H:%M:%S", tinfo);
-    l += sprintf(buffer + l, " %s ", log_level_name(level));
-    vsnprintf(buffer + l, LOG_BUF_SIZE - l, format, args);
+    log_append_locked(level, format, args);
     va_end(args);
-    fprintf(stdout, "%s\n", buffer);
-    fflush(stdout);
 }
 
-void set_current_downstream_host() {
-    struct downstream_host_s *host = global.downstream.current_downstream_host;
-    int i = 0;
+// updates cached timestamp and resets rate limit once per second, log_writer.lock should be held
+void log_tick_locked() {
+    time_t t = time(NULL);
+    struct tm tinfo;
 
-    if (host == NULL) {
-        host = global.downstream.downstream_hosts;
-    }
-    if (host == NULL) {
+    if (t == log_writer.timestamp_time) {
         return;
     }
-    for (i = 0; i < global.downstream.downstream_host_num; i++) {
-        host = host->next;
-        if (host == NULL) {
-            host = global.downstream.downstream_hosts;
-        }
-        if (host->health_client.alive == 1) {
-            global.downstream.current_downstream_host = host;
-            return;
-        }
+    log_writer.timestamp_time = t;
+    localtime_r(&t, &tinfo);
+    log_writer.timestamp_length = strftime(log_writer.timestamp, sizeof(log_writer.timestamp), "%Y-%m-%d %H:%M:%S", &tinfo);
+    if (log_writer.lines_suppressed > 0) {
+        log_append(WARN, "%s: %lu log lines suppressed because of log_rate_limit", __func__, log_writer.lines_suppressed);
+        log_writer.lines_suppressed = 0;
     }
-    global.downstream.current_downstream_host = NULL;
+    log_writer.lines_this_second = 0;
 }
 
-// this function flushes data to downstream
-void downstream_flush_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
-    int bytes_send;
-    int flush_buffer_idx = global.downstream.flush_buffer_idx;
-
-    if (EV_ERROR & revents) {
-        log_msg(ERROR, "%s: invalid event %s", __func__, strerror(errno));
-        return;
+// it is called periodically from the main loop and on exit
+void log_flush() {
+    pthread_mutex_lock(&log_writer.lock);
+    if (log_writer.lines_suppressed > 0) {
+        log_tick_locked();
     }
+    log_flush_locked();
+    pthread_mutex_unlock(&log_writer.lock);
+}
 
-    set_current_downstream_host();
-    if (global.downstream.current_downstream_host == NULL) {
-        log_msg(ERROR, "%s: no downstream hosts", __func__);
-        ev_io_stop(loop, watcher);
+// function to log message, it should be called via log_msg() macro
+void log_write(int level, char *format, ...) {
+    va_list args;
+
+    pthread_mutex_lock(&log_writer.lock);
+    log_tick_locked();
+    if (global.log_rate_limit > 0 && log_writer.lines_this_second >= global.log_rate_limit) {
+        // misbehaving client can produce a flood of errors, let's not spend our time on it
+        log_writer.lines_suppressed++;
+        pthread_mutex_unlock(&log_writer.lock);
         return;
     }
-    log_msg(DEBUG, "%s: flushing to %s", __func__, inet_ntoa(global.downstream.current_downstream_host->sa_in_data.sin_addr));
-
-    bytes_send = sendto(watcher->fd,
-        global.downstream.buffer + flush_buffer_idx * DOWNSTREAM_BUF_SIZE,
-        global.downstream.buffer_length[flush_buffer_idx],
-        0,
-        (struct sockaddr *) (&(global.downstream.current_downstream_host->sa_in_data)),
-        sizeof(global.downstream.current_downstream_host->sa_in_data));
-    // update flush time
-    global.downstream.buffer_length[flush_buffer_idx] = 0;
-    global.downstream.packets_sent++;
-    global.downstream.flush_buffer_idx = (flush_buffer_idx + 1) % DOWNSTREAM_BUF_NUM;
-    log_msg(TRACE, "%s: flushed buffer %d", __func__, flush_buffer_idx);
-    if (global.downstream.flush_buffer_idx == global.downstream.active_buffer_idx) {
-        ev_io_stop(loop, watcher);
+    log_writer.lines_this_second++;
+    va_start(args, format);
+    log_append_locked(level, format, args);
+    va_end(args);
+    pthread_mutex_unlock(&log_writer.lock);
+}
+
+char *stat_name(enum stat_e stat) {
+    static char *name[] = { "wakeups", "packets_received", "bytes_received", "lines_received", "invalid_metrics",
+        "flushes", "packets_sent", "bytes_sent", "send_failures", "packets_dropped", "bytes_dropped",
+        "packets_spooled", "packets_unspooled", "metrics_shed"};
+    return name[stat];
+}
+
+char *histogram_name(enum histogram_e histogram) {
+    static char *name[] = { "parse_latency", "flush_latency"};
+    return name[histogram];
+}
+
+// counters have single writer, so there is no need in atomic increment, relaxed store is enough for readers
+void stat_add(enum stat_e stat, unsigned long value) {
+    unsigned long *counter = thread_stats->counters + stat;
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+unsigned long stat_get(enum stat_e stat) {
+    return __atomic_load_n(thread_stats->counters + stat, __ATOMIC_RELAXED);
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// adds duration in nanoseconds to the histogram, bucket i counts durations in [2^(i-1), 2^i)
+void histogram_add(enum histogram_e histogram, uint64_t ns) {
+    int bucket = ns > 0 ? 64 - __builtin_clzll(ns) : 0;
+    unsigned long *counter = NULL;
+
+    if (bucket >= HISTOGRAM_BUCKETS) {
+        bucket = HISTOGRAM_BUCKETS - 1;
     }
-    if (bytes_send < 0) {
-        log_msg(ERROR, "%s: sendto() failed %s", __func__, strerror(errno));
+    counter = thread_stats->histograms[histogram] + bucket;
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+// returns number of samples in the histogram
+unsigned long histogram_count(unsigned long *buckets) {
+    unsigned long count = 0;
+    int i = 0;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        count += buckets[i];
     }
+    return count;
 }
 
-/* this function switches active and flush buffers, registers handler to send data when
- * socket would be ready
- */
-void downstream_schedule_flush() {
-    int new_socket_fd = 0;
+// returns upper bound of the bucket with given percentile in microseconds
+double histogram_percentile(unsigned long *buckets, double percentile) {
+    unsigned long count = histogram_count(buckets);
+    unsigned long rank = 0;
+    unsigned long seen = 0;
     int i = 0;
-    int slot_data_length = 0;
-    int active_buffer_length = 0;
-    struct ev_io *watcher = NULL;
-    int new_active_buffer_idx = (global.downstream.active_buffer_idx + 1) % DOWNSTREAM_BUF_NUM;
-    // if active_buffer_idx == flush_buffer_idx this means that all previous
-    // flushes are done (no filled buffers in the queue) and we need to schedule new one
-    int need_to_schedule_flush = (global.downstream.active_buffer_idx == global.downstream.flush_buffer_idx);
 
-    if (global.downstream.buffer_length[new_active_buffer_idx] > 0) {
-        log_msg(ERROR, "%s: previous flush is not completed, loosing data.", __func__);
-        global.downstream.active_buffer_length = 0;
-        global.downstream.slots_used = 0;
-        return;
+    if (count == 0) {
+        return 0;
     }
-    for (i = 0; i < global.downstream.slots_used; i++) {
-        slot_data_length = global.downstream.slots[i].length;
-        if (slot_data_length == global.downstream.slots[i].name_length) {
-            continue;
+    rank = (unsigned long)(count * percentile / 100);
+    for (i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+        seen += buckets[i];
+        if (seen > rank) {
+            break;
         }
-        *(global.downstream.slots[i].buffer + slot_data_length - 1) = '\n';
-        memcpy(global.downstream.active_buffer + active_buffer_length, global.downstream.slots[i].buffer, slot_data_length);
-        active_buffer_length += slot_data_length;
-    }
-    log_msg(TRACE, "%s: flushing buffer: \"%.*s\"", __func__, active_buffer_length, global.downstream.active_buffer);
-    global.downstream.buffer_length[global.downstream.active_buffer_idx] = active_buffer_length;
-    global.downstream.active_buffer = global.downstream.buffer + new_active_buffer_idx * DOWNSTREAM_BUF_SIZE;
-    global.downstream.active_buffer_length = 0;
-    global.downstream.slots_used = 0;
-    global.downstream.active_buffer_idx = new_active_buffer_idx;
-    log_msg(TRACE, "%s: new active buffer idx = %d", __func__, new_active_buffer_idx);
-    if (need_to_schedule_flush) {
-        watcher = &(global.downstream.flush_watcher);
-        if (global.downstream.packets_sent > MAX_PACKETS_PER_SOCKET) {
-            global.downstream.packets_sent = 0;
-            new_socket_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-            if (new_socket_fd < 0) {
-                log_msg(ERROR, "%s: socket() failed %s", __func__, strerror(errno));
-            } else {
-                close(watcher->fd);
-                watcher->fd = new_socket_fd;
-            }
+    }
+    return (double)(1ull << i) / 1000;
+}
+
+void stats_accumulate(struct stats_s *total, struct stats_s *stats) {
+    int i = 0;
+    int j = 0;
+
+    for (i = 0; i < STATS_NUM; i++) {
+        total->counters[i] += __atomic_load_n(stats->counters + i, __ATOMIC_RELAXED);
+    }
+    for (i = 0; i < HISTOGRAMS_NUM; i++) {
+        for (j = 0; j < HISTOGRAM_BUCKETS; j++) {
+            total->histograms[i][j] += __atomic_load_n(stats->histograms[i] + j, __ATOMIC_RELAXED);
         }
-        ev_io_init(watcher, downstream_flush_cb, watcher->fd, EV_WRITE);
-        ev_io_start(ev_default_loop(0), watcher);
     }
 }
 
-int add_slot(char *line, int name_length) {
-    global.downstream.slots[global.downstream.slots_used].name_length = name_length;
-    global.downstream.slots[global.downstream.slots_used].length = name_length;
-    global.downstream.slots[global.downstream.slots_used].type = TYPE_UNKNOWN;
-    global.downstream.slots[global.downstream.slots_used].counter = 0.0;
-    global.downstream.active_buffer_length += name_length;
-    memcpy(global.downstream.slots[global.downstream.slots_used].buffer, line, name_length);
-    log_msg(TRACE, "%s: created %.*s at slot %d", __func__, name_length, line, global.downstream.slots_used);
-    return global.downstream.slots_used++;
+// sums self-metrics of all threads
+void stats_collect(struct stats_s *total) {
+    int i = 0;
+
+    memset(total, 0, sizeof(*total));
+    stats_accumulate(total, &(global.stats));
+    // worker 0 runs in the main thread
+    for (i = 1; i < global.workers_num; i++) {
+        stats_accumulate(total, &(global.workers[i].stats));
+    }
 }
 
-int find_slot(char *line, int name_length) {
+// FNV-1a hash of the metric name
+uint32_t hash_name(char *name, int length) {
+    uint32_t hash = 2166136261u;
     int i = 0;
-    for (i = 0; i < global.downstream.slots_used; i++) {
-        if (global.downstream.slots[i].name_length == name_length) {
-            if (memcmp(line, global.downstream.slots[i].buffer, name_length) == 0) {
-                log_msg(TRACE, "%s: found %.*s at slot %d", __func__, name_length, line, i);
-                return i;
-            }
-        }
+
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
     }
-    if (global.downstream.active_buffer_length + name_length > DOWNSTREAM_BUF_SIZE) {
-        log_msg(TRACE, "%s: active_buffer_length = %d, name_length = %d, scheduling flush", __func__, global.downstream.active_buffer_length, name_length);
-        downstream_schedule_flush();
+    return hash;
+}
+
+// FNV-1a has weak high bits, so let's mix them (murmur3 finalizer)
+uint32_t hash_mix(uint32_t hash) {
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// returns numeric address of sockaddr, buffer is reused by the next call in the same thread
+char *address_string(struct sockaddr_storage *sa) {
+    static __thread char buffer[INET6_ADDRSTRLEN];
+    void *addr = sa->ss_family == AF_INET6 ? (void *)&(((struct sockaddr_in6 *)sa)->sin6_addr) : (void *)&(((struct sockaddr_in *)sa)->sin_addr);
+
+    if (inet_ntop(sa->ss_family, addr, buffer, sizeof(buffer)) == NULL) {
+        return "unknown";
     }
-    return add_slot(line, name_length);
+    return buffer;
 }
 
-void insert_values_into_slot(int initial_slot_idx, char *line, char *colon_ptr, int length) {
-    int slot_idx = initial_slot_idx;
-    ssize_t bytes_in_buffer;
-    char *buffer_ptr = colon_ptr + 1;
-    char *delimiter_ptr = colon_ptr;
-    char *target_ptr = NULL;
-    int data_length = 0;
-    int name_length = global.downstream.slots[slot_idx].name_length;
-    char *type_ptr = NULL;
-    int metric_type = 0;
-    double counter = 0;
-    char *counter_ptr = NULL;
-    int counter_len = 0;
-    char *endptr = NULL;
-    char *rate_ptr = NULL;
-    double rate = 1;
+// returns 1 if both sockaddrs have the same address, ports are ignored
+int address_equal(struct sockaddr_storage *a, struct sockaddr_storage *b) {
+    if (a->ss_family != b->ss_family) {
+        return 0;
+    }
+    if (a->ss_family == AF_INET6) {
+        return memcmp(&(((struct sockaddr_in6 *)a)->sin6_addr), &(((struct sockaddr_in6 *)b)->sin6_addr), sizeof(struct in6_addr)) == 0;
+    }
+    return ((struct sockaddr_in *)a)->sin_addr.s_addr == ((struct sockaddr_in *)b)->sin_addr.s_addr;
+}
 
-    bytes_in_buffer = length - (colon_ptr - line) - 1;
-    log_msg(TRACE, "%s: metrics data \"%.*s\"", __func__, (int)bytes_in_buffer, colon_ptr);
-    while (delimiter_ptr != NULL) {
-        delimiter_ptr = memchr(buffer_ptr, ':', bytes_in_buffer);
-        if (delimiter_ptr == NULL) {
-            data_length = bytes_in_buffer;
-        } else {
-            data_length = delimiter_ptr - buffer_ptr + 1;
-        }
-        type_ptr = memchr(buffer_ptr, '|', data_length);
-        if (type_ptr == NULL) {
-            log_msg(ERROR, "%s: invalid metric data \"%.*s\"", __func__, data_length, buffer_ptr);
-            bytes_in_buffer -= data_length;
-            buffer_ptr += data_length;
-            continue;
-        }
-        metric_type = TYPE_OTHER;
-        if (*(type_ptr + 1) == 'c') {
-            metric_type = TYPE_COUNTER;
-        }
-        if (global.downstream.slots[slot_idx].type == TYPE_UNKNOWN) {
-            global.downstream.slots[slot_idx].type = metric_type;
+/* fills target with the address and port for a socket of given family, IPv4 address is mapped to IPv6 for AF_INET6.
+ * Returns length of the sockaddr or 0 if IPv6 address can't be used with IPv4 socket
+ */
+socklen_t address_with_port(struct sockaddr_storage *target, struct sockaddr_storage *addr, int port, int family) {
+    struct sockaddr_in6 *target6 = (struct sockaddr_in6 *)target;
+    struct sockaddr_in *target4 = (struct sockaddr_in *)target;
+
+    memset(target, 0, sizeof(struct sockaddr_storage));
+    if (family == AF_INET6) {
+        target6->sin6_family = AF_INET6;
+        target6->sin6_port = htons(port);
+        if (addr->ss_family == AF_INET6) {
+            target6->sin6_addr = ((struct sockaddr_in6 *)addr)->sin6_addr;
+            target6->sin6_scope_id = ((struct sockaddr_in6 *)addr)->sin6_scope_id;
         } else {
-            if (global.downstream.slots[slot_idx].type != metric_type) {
-                log_msg(ERROR, "%s: got improper metric type for \"%.*s\"", __func__, global.downstream.slots[slot_idx].name_length, global.downstream.slots[slot_idx].buffer);
-                bytes_in_buffer -= data_length;
-                buffer_ptr += data_length;
-                continue;
-            }
+            // ::ffff:a.b.c.d
+            target6->sin6_addr.s6_addr[10] = 0xff;
+            target6->sin6_addr.s6_addr[11] = 0xff;
+            memcpy(target6->sin6_addr.s6_addr + 12, &(((struct sockaddr_in *)addr)->sin_addr), 4);
         }
-        // if metric is counter let's use maximum possible length of resulting string (because of "%.15g|c\n" below)
-        if (global.downstream.active_buffer_length + (metric_type == TYPE_COUNTER ? MAX_COUNTER_LENGTH : data_length) > DOWNSTREAM_BUF_SIZE) {
-            downstream_schedule_flush();
-            slot_idx = add_slot(line, name_length);
-            global.downstream.slots[slot_idx].type = metric_type;
+        return sizeof(struct sockaddr_in6);
+    }
+    if (addr->ss_family != AF_INET) {
+        return 0;
+    }
+    target4->sin_family = AF_INET;
+    target4->sin_port = htons(port);
+    target4->sin_addr = ((struct sockaddr_in *)addr)->sin_addr;
+    return sizeof(struct sockaddr_in);
+}
+
+// creates udp or tcp socket, AF_INET6 socket is made dual-stack so it works with IPv4 addresses too. Returns -1 on error
+int dual_stack_socket(int family, int type) {
+    int fd = socket(family, type, 0);
+    int v6only = 0;
+
+    if (fd >= 0 && family == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// size should be power of 2
+int slot_index_init(struct slot_index_s *index, int size) {
+    index->entries = (slot_index_entry_s *)calloc(size, sizeof(slot_index_entry_s));
+    if (index->entries == NULL) {
+        log_msg(ERROR, "%s: failed to allocate memory for slot index", __func__);
+        return 1;
+    }
+    index->mask = size - 1;
+    index->generation = 1;
+    return 0;
+}
+
+void slot_index_clear(struct slot_index_s *index) {
+    index->generation++;
+    // generation counter wrapped, entries from 2^32 flushes ago could look valid again
+    if (index->generation == 0) {
+        memset(index->entries, 0, (index->mask + 1) * sizeof(slot_index_entry_s));
+        index->generation = 1;
+    }
+}
+
+// returns index of slot with given name or -1, *position is set to the index entry where
+// slot with this name should be inserted. Slot names are looked up in names buffer
+int slot_index_lookup(struct slot_index_s *index, slot_s *slots, char *names, uint32_t hash, char *name, int name_length, uint32_t *position) {
+    uint32_t i = hash & index->mask;
+    slot_index_entry_s *entry = NULL;
+
+    while (1) {
+        entry = index->entries + i;
+        if (entry->generation != index->generation) {
+            *position = i;
+            return -1;
         }
-        target_ptr = global.downstream.slots[slot_idx].buffer + global.downstream.slots[slot_idx].length;
-        log_msg(TRACE, "%s: adding \"%.*s\"", __func__, data_length, buffer_ptr);
-        if (metric_type == TYPE_COUNTER) {
-            rate = 1;
-            rate_ptr = memchr(type_ptr + 1, '|', data_length - (type_ptr - buffer_ptr));
-            if (rate_ptr != NULL && *(rate_ptr + 1) == '@') {
-                errno = 0;
-                rate = strtod(rate_ptr + 2, &endptr);
-                if (errno != 0 || (endptr + 1) != (buffer_ptr + data_length)) {
-                    log_msg(TRACE, "%s: invalid rate in counter data \"%.*s\"", __func__, data_length - 1, buffer_ptr);
-                    rate = 1;
-                }
-            }
-            errno = 0;
-            counter = strtod(buffer_ptr, &endptr) / rate;
-            if (errno != 0 || endptr != type_ptr) {
-                log_msg(ERROR, "%s: invalid value in counter data \"%.*s\"", __func__, data_length - 1, buffer_ptr);
-            } else {
-                counter_ptr = global.downstream.slots[slot_idx].buffer + name_length;
-                global.downstream.slots[slot_idx].counter += counter;
-                counter_len = sprintf(counter_ptr, "%.15g|c\n", global.downstream.slots[slot_idx].counter);
-                global.downstream.active_buffer_length -= global.downstream.slots[slot_idx].length;
-                global.downstream.slots[slot_idx].length = global.downstream.slots[slot_idx].name_length + counter_len;
-                global.downstream.active_buffer_length += global.downstream.slots[slot_idx].length;
-                log_msg(TRACE, "%s: counter delta = %.15g, counter value = %.15g", __func__, counter, global.downstream.slots[slot_idx].counter);
-            }
-        } else {
-            memcpy(target_ptr, buffer_ptr, data_length);
-            target_ptr += data_length;
-            *(target_ptr - 1) = ':';
-            global.downstream.slots[slot_idx].length += data_length;
-            global.downstream.active_buffer_length += data_length;
+        if (entry->hash == hash && slots[entry->slot_idx].name_length == name_length &&
+            memcmp(names + slots[entry->slot_idx].name, name, name_length) == 0) {
+            return entry->slot_idx;
         }
-        bytes_in_buffer -= data_length;
-        buffer_ptr += data_length;
+        i = (i + 1) & index->mask;
     }
-    log_msg(TRACE, "%s: buffer after insert: \"%.*s\"", __func__, global.downstream.slots[slot_idx].length, global.downstream.slots[slot_idx].buffer);
 }
 
-// function to process single metrics line
-int process_data_line(char *line, int length) {
-    int slot_idx = -1;
-    char *colon_ptr = memchr(line, ':', length);
-    // if ':' wasn't found this is not valid statsd metric
-    if (colon_ptr == NULL) {
-        *(line + length - 1) = 0;
-        log_msg(ERROR, "%s: invalid metric %s", __func__, line);
+void slot_index_insert(struct slot_index_s *index, uint32_t position, uint32_t hash, int slot_idx) {
+    slot_index_entry_s *entry = index->entries + position;
+
+    entry->hash = hash;
+    entry->generation = index->generation;
+    entry->slot_idx = slot_idx;
+}
+
+// doubles size of the index and reinserts used slots
+int slot_index_grow(struct slot_index_s *index, slot_s *slots, char *names, int slots_used) {
+    struct slot_index_s new_index;
+    uint32_t position = 0;
+    int i = 0;
+
+    if (slot_index_init(&new_index, (index->mask + 1) * 2) != 0) {
         return 1;
     }
-    slot_idx = find_slot(line, colon_ptr - line + 1);
-    insert_values_into_slot(slot_idx, line, colon_ptr, length);
+    for (i = 0; i < slots_used; i++) {
+        slot_index_lookup(&new_index, slots, names, slots[i].hash, names + slots[i].name, slots[i].name_length, &position);
+        slot_index_insert(&new_index, position, slots[i].hash, i);
+    }
+    free(index->entries);
+    *index = new_index;
     return 0;
 }
 
-void udp_read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
-    char buffer[DATA_BUF_SIZE];
-    ssize_t bytes_in_buffer;
-    char *buffer_ptr = buffer;
-    char *delimiter_ptr = buffer;
-    int line_length = 0;
+int arena_init(struct arena_s *arena, uint32_t size) {
+    arena->buffer = (char *)malloc(size);
+    if (arena->buffer == NULL) {
+        log_msg(ERROR, "%s: failed to allocate memory for arena", __func__);
+        return 1;
+    }
+    arena->size = size;
+    arena->used = 0;
+    return 0;
+}
+
+// returns offset of allocated memory or ARENA_NULL, previously returned pointers are invalidated
+uint32_t arena_alloc(struct arena_s *arena, uint32_t length) {
+    uint32_t offset = arena->used;
+    uint32_t size = arena->size;
+    char *buffer = NULL;
+
+    // keep chunk headers and timer sketches aligned
+    length = (length + 7) & ~7u;
+    if (length > UINT32_MAX - offset - 1) {
+        log_msg(ERROR, "%s: arena is too big", __func__);
+        return ARENA_NULL;
+    }
+    if (offset + length > size) {
+        while (offset + length > size) {
+            size = size <= UINT32_MAX / 2 ? size * 2 : UINT32_MAX;
+        }
+        buffer = (char *)realloc(arena->buffer, size);
+        if (buffer == NULL) {
+            log_msg(ERROR, "%s: failed to allocate memory for arena", __func__);
+            return ARENA_NULL;
+        }
+        log_msg(DEBUG, "%s: arena grew to %u bytes", __func__, size);
+        arena->buffer = buffer;
+        arena->size = size;
+    }
+    arena->used += length;
+    return offset;
+}
+
+void arena_reset(struct arena_s *arena) {
+    arena->used = 0;
+}
+
+/* key of the sketch bucket is sign, exponent and top bits of mantissa of the value, so keys grow with magnitude
+ * of the value. Keys of negative values have TIMER_SKETCH_NEGATIVE_KEY set
+ */
+uint32_t timer_sketch_key(double value) {
+    uint64_t bits = 0;
+
+    memcpy(&bits, &value, sizeof(bits));
+    return (uint32_t)(bits >> (52 - TIMER_SKETCH_PRECISION_BITS));
+}
+
+// returns middle of the bucket range
+double timer_sketch_value(uint32_t key) {
+    uint64_t lower_bits = (uint64_t)key << (52 - TIMER_SKETCH_PRECISION_BITS);
+    uint64_t upper_bits = (uint64_t)(key + 1) << (52 - TIMER_SKETCH_PRECISION_BITS);
+    double lower = 0;
+    double upper = 0;
+
+    memcpy(&lower, &lower_bits, sizeof(lower));
+    memcpy(&upper, &upper_bits, sizeof(upper));
+    return (lower + upper) / 2;
+}
+
+void timer_sketch_add_bucket(timer_sketch_s *sketch, uint32_t key, uint32_t count) {
+    uint32_t i = key * 2654435761u;
+
+    for (i &= sketch->mask; sketch->buckets[i].key != 0; i = (i + 1) & sketch->mask) {
+        if (sketch->buckets[i].key == key) {
+            sketch->buckets[i].count += count;
+            return;
+        }
+    }
+    sketch->buckets[i].key = key;
+    sketch->buckets[i].count = count;
+    sketch->buckets_used++;
+}
+
+// returns arena offset of sketch of the slot with room for one more bucket or ARENA_NULL if we are out of memory
+uint32_t timer_sketch_reserve(struct arena_s *arena, slot_s *slot) {
+    timer_sketch_s *sketch = NULL;
+    timer_sketch_s *old_sketch = NULL;
+    uint32_t size = TIMER_SKETCH_SIZE;
+    uint32_t offset = 0;
+    uint32_t i = 0;
+
+    if (slot->values_head != ARENA_NULL) {
+        sketch = (timer_sketch_s *)ARENA_PTR(arena, slot->values_head);
+        // keep load factor below 0.5
+        if ((sketch->buckets_used + 1) * 2 <= sketch->mask + 1) {
+            return slot->values_head;
+        }
+        size = (sketch->mask + 1) * 2;
+    }
+    offset = arena_alloc(arena, sizeof(timer_sketch_s) + size * sizeof(timer_bucket_s));
+    if (offset == ARENA_NULL) {
+        return ARENA_NULL;
+    }
+    // arena_alloc() can move arena, so pointers are taken after it
+    sketch = (timer_sketch_s *)ARENA_PTR(arena, offset);
+    memset(sketch, 0, sizeof(timer_sketch_s) + size * sizeof(timer_bucket_s));
+    sketch->mask = size - 1;
+    if (slot->values_head == ARENA_NULL) {
+        sketch->min = INFINITY;
+        sketch->max = -INFINITY;
+    } else {
+        // old buckets are rehashed, memory of the old sketch is released with the arena on flush
+        old_sketch = (timer_sketch_s *)ARENA_PTR(arena, slot->values_head);
+        sketch->sum = old_sketch->sum;
+        sketch->min = old_sketch->min;
+        sketch->max = old_sketch->max;
+        sketch->count = old_sketch->count;
+        sketch->zero_count = old_sketch->zero_count;
+        for (i = 0; i <= old_sketch->mask; i++) {
+            if (old_sketch->buckets[i].key != 0) {
+                timer_sketch_add_bucket(sketch, old_sketch->buckets[i].key, old_sketch->buckets[i].count);
+            }
+        }
+    }
+    slot->values_head = offset;
+    slot->values_tail = offset;
+    return offset;
+}
+
+// adds value which was sampled weight times
+void timer_sketch_add(timer_sketch_s *sketch, double value, uint32_t weight) {
+    sketch->sum += value * weight;
+    sketch->count += weight;
+    if (value < sketch->min) {
+        sketch->min = value;
+    }
+    if (value > sketch->max) {
+        sketch->max = value;
+    }
+    if (value != 0) {
+        timer_sketch_add_bucket(sketch, timer_sketch_key(value), weight);
+    } else {
+        sketch->zero_count += weight;
+    }
+}
+
+// returns position of the bucket in value order, negative keys go first in reverse order
+int64_t timer_bucket_order(uint32_t key) {
+    return (key & TIMER_SKETCH_NEGATIVE_KEY) ? -(int64_t)(key & ~TIMER_SKETCH_NEGATIVE_KEY) : (int64_t)key;
+}
+
+int timer_bucket_compare(const void *a, const void *b) {
+    int64_t order_a = timer_bucket_order(((timer_bucket_s *)a)->key);
+    int64_t order_b = timer_bucket_order(((timer_bucket_s *)b)->key);
+    return order_a < order_b ? -1 : order_a > order_b;
+}
+
+// sorts buckets by value in place, sketch can't be updated after that
+void timer_sketch_sort(timer_sketch_s *sketch) {
+    uint32_t used = 0;
+    uint32_t i = 0;
+
+    for (i = 0; i <= sketch->mask; i++) {
+        if (sketch->buckets[i].key != 0) {
+            sketch->buckets[used++] = sketch->buckets[i];
+        }
+    }
+    qsort(sketch->buckets, used, sizeof(timer_bucket_s), timer_bucket_compare);
+}
+
+// returns approximate percentile of the sorted sketch, zero values are between negative and positive buckets
+double timer_sketch_percentile(timer_sketch_s *sketch, double percentile) {
+    double rank = sketch->count * percentile / 100;
+    double value = 0;
+    uint64_t seen = 0;
+    int zeros_seen = 0;
+    uint32_t i = 0;
+
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (i = 0; i < sketch->buckets_used && seen < rank; i++) {
+        // zero values go right before the first positive bucket
+        if (! zeros_seen && ! (sketch->buckets[i].key & TIMER_SKETCH_NEGATIVE_KEY)) {
+            zeros_seen = 1;
+            seen += sketch->zero_count;
+            if (seen >= rank) {
+                value = 0;
+                break;
+            }
+        }
+        seen += sketch->buckets[i].count;
+        value = timer_sketch_value(sketch->buckets[i].key);
+    }
+    // rank is in zero values if there are no positive buckets
+    if (seen < rank) {
+        value = 0;
+    }
+    if (value < sketch->min) {
+        value = sketch->min;
+    }
+    if (value > sketch->max) {
+        value = sketch->max;
+    }
+    return value;
+}
+
+void hll_add(uint8_t *registers, uint32_t hash) {
+    uint32_t rank = 0;
+
+    hash = hash_mix(hash);
+    // first bits select register, register keeps max position of the first set bit in the rest
+    rank = (hash << HLL_PRECISION) == 0 ? 32 - HLL_PRECISION + 1 : __builtin_clz(hash << HLL_PRECISION) + 1;
+    if (rank > registers[hash >> (32 - HLL_PRECISION)]) {
+        registers[hash >> (32 - HLL_PRECISION)] = rank;
+    }
+}
+
+void hll_merge(uint8_t *target, uint8_t *source) {
+    int i = 0;
+
+    for (i = 0; i < HLL_REGISTERS; i++) {
+        if (source[i] > target[i]) {
+            target[i] = source[i];
+        }
+    }
+}
+
+double hll_estimate(uint8_t *registers) {
+    double alpha = 0.7213 / (1 + 1.079 / HLL_REGISTERS);
+    double sum = 0;
+    double estimate = 0;
+    int zeros = 0;
+    int i = 0;
+
+    for (i = 0; i < HLL_REGISTERS; i++) {
+        sum += 1.0 / (1ull << registers[i]);
+        zeros += (registers[i] == 0);
+    }
+    estimate = alpha * HLL_REGISTERS * HLL_REGISTERS / sum;
+    // linear counting is more precise for small cardinalities
+    if (estimate <= 2.5 * HLL_REGISTERS && zeros > 0) {
+        estimate = HLL_REGISTERS * log((double)HLL_REGISTERS / zeros);
+    }
+    return estimate;
+}
+
+void set_current_downstream_host() {
+    struct downstream_host_s *host = global.downstream.current_downstream_host;
+    int i = 0;
+
+    if (host == NULL) {
+        host = global.downstream.downstream_hosts;
+    }
+    if (host == NULL) {
+        return;
+    }
+    for (i = 0; i < global.downstream.downstream_host_num; i++) {
+        host = host->next;
+        if (host == NULL) {
+            host = global.downstream.downstream_hosts;
+        }
+        if (host->health_client.alive == 1) {
+            global.downstream.current_downstream_host = host;
+            return;
+        }
+    }
+    global.downstream.current_downstream_host = NULL;
+}
+
+int ring_point_compare(const void *a, const void *b) {
+    uint32_t hash_a = ((ring_point_s *)a)->hash;
+    uint32_t hash_b = ((ring_point_s *)b)->hash;
+
+    return hash_a < hash_b ? -1 : hash_a > hash_b;
+}
+
+// places DOWNSTREAM_RING_POINTS points of every host on the ring. Points depend on host address only,
+// so hosts which stay keep their points
+void downstream_build_ring() {
+    struct downstream_host_s *host = NULL;
+    char point_name[64];
+    int hosts = 0;
+    int i = 0;
+
+    global.downstream.ring_size = 0;
+    for (host = global.downstream.downstream_hosts; host != NULL && hosts < MAX_DOWNSTREAM_NUM; host = host->next) {
+        for (i = 0; i < DOWNSTREAM_RING_POINTS; i++) {
+            global.downstream.ring[global.downstream.ring_size].hash = hash_mix(hash_name(point_name,
+                snprintf(point_name, sizeof(point_name), "%s:%d-%d", address_string(&(host->health_client.sa)), global.downstream.data_port, i)));
+            global.downstream.ring[global.downstream.ring_size++].host = hosts;
+        }
+        global.downstream.ring_hosts[hosts++] = host;
+    }
+    qsort(global.downstream.ring, global.downstream.ring_size, sizeof(ring_point_s), ring_point_compare);
+    log_msg(DEBUG, "%s: %d hosts on consistent hash ring", __func__, hosts);
+}
+
+// returns index in ring_hosts of the healthy host the metric with given hash belongs to or -1 if there is none
+int downstream_ring_lookup(uint32_t hash) {
+    ring_point_s *ring = global.downstream.ring;
+    int size = global.downstream.ring_size;
+    int low = 0;
+    int high = size;
+    int middle = 0;
+    int i = 0;
+
+    hash = hash_mix(hash);
+    while (low < high) {
+        middle = (low + high) / 2;
+        if (ring[middle].hash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    // points of hosts which are down are skipped, so their metrics go to the next points
+    for (i = 0; i < size; i++) {
+        if (global.downstream.ring_hosts[ring[(low + i) % size].host]->health_client.alive == 1) {
+            return ring[(low + i) % size].host;
+        }
+    }
+    return -1;
+}
+
+void downstream_flush_cb(struct ev_loop *loop, struct ev_io *watcher, int revents);
+
+// returns packet from the pool or newly allocated one, NULL if queue_size limit is reached
+struct packet_s *downstream_get_packet() {
+    struct packet_s *packet = global.downstream.free_packets;
+
+    if (packet != NULL) {
+        global.downstream.free_packets = packet->next;
+    } else if ((global.downstream.packets_allocated + 1) * (sizeof(struct packet_s) + global.downstream_buf_size) <= global.downstream_queue_size ||
+            global.downstream.packets_allocated == 0) {
+        packet = (struct packet_s *)malloc(sizeof(struct packet_s) + global.downstream_buf_size);
+        if (packet == NULL) {
+            log_msg(ERROR, "%s: failed to allocate memory for packet", __func__);
+            return NULL;
+        }
+        global.downstream.packets_allocated++;
+    } else {
+        return NULL;
+    }
+    packet->next = NULL;
+    packet->length = 0;
+    packet->hash = global.downstream.packet_hash;
+    return packet;
+}
+
+void downstream_release_packet(struct packet_s *packet) {
+    packet->next = global.downstream.free_packets;
+    global.downstream.free_packets = packet;
+}
+
+void downstream_enqueue_packet(struct packet_s *packet) {
+    packet->next = NULL;
+    if (global.downstream.queue_tail == NULL) {
+        global.downstream.queue_head = packet;
+    } else {
+        global.downstream.queue_tail->next = packet;
+    }
+    global.downstream.queue_tail = packet;
+    global.downstream.queue_length++;
+}
+
+struct packet_s *downstream_dequeue_packet() {
+    struct packet_s *packet = global.downstream.queue_head;
+
+    if (packet != NULL) {
+        global.downstream.queue_head = packet->next;
+        if (global.downstream.queue_head == NULL) {
+            global.downstream.queue_tail = NULL;
+        }
+        global.downstream.queue_length--;
+    }
+    return packet;
+}
+
+// picks host for the packet, NULL if there are no healthy hosts
+struct downstream_host_s *downstream_route_packet(struct packet_s *packet) {
+    int ring_host = 0;
+
+    if (global.downstream_routing == ROUTING_CONSISTENT_HASH) {
+        // all metrics of the packet belong to the host of the first one unless hosts changed since packing
+        ring_host = downstream_ring_lookup(packet->hash);
+        return ring_host < 0 ? NULL : global.downstream.ring_hosts[ring_host];
+    }
+    set_current_downstream_host();
+    return global.downstream.current_downstream_host;
+}
+
+void downstream_tcp_cb(struct ev_loop *loop, struct ev_io *watcher, int revents);
+
+// (re)starts watcher of tcp client with given events, it is stopped if events are 0
+void downstream_tcp_watch(struct ev_loop *loop, struct downstream_tcp_client_s *client, int events) {
+    if (client->events == events) {
+        return;
+    }
+    if (client->events != 0) {
+        ev_io_stop(loop, &(client->super));
+    }
+    client->events = events;
+    if (events != 0) {
+        ev_io_init(&(client->super), downstream_tcp_cb, client->super.fd, events);
+        ev_io_start(loop, &(client->super));
+    }
+}
+
+/* closes connection and schedules reconnect. Partially written packet is dropped since the line it was cut in
+ * is lost anyway, the rest of the queue waits for new connection
+ */
+void downstream_tcp_disconnect(struct ev_loop *loop, struct downstream_tcp_client_s *client) {
+    struct packet_s *packet = client->queue_head;
+
+    downstream_tcp_watch(loop, client, 0);
+    if (client->super.fd >= 0) {
+        close(client->super.fd);
+        client->super.fd = -1;
+    }
+    client->connected = 0;
+    if (packet != NULL && client->head_offset > 0) {
+        stat_add(STAT_PACKETS_DROPPED, 1);
+        stat_add(STAT_BYTES_DROPPED, packet->length - client->head_offset);
+        client->queue_head = packet->next;
+        if (client->queue_head == NULL) {
+            client->queue_tail = NULL;
+        }
+        client->queue_length--;
+        client->head_offset = 0;
+        downstream_release_packet(packet);
+    }
+    client->backoff = client->backoff == 0 ? MIN_DOWNSTREAM_TCP_BACKOFF : client->backoff * 2;
+    if (client->backoff > MAX_DOWNSTREAM_TCP_BACKOFF) {
+        client->backoff = MAX_DOWNSTREAM_TCP_BACKOFF;
+    }
+    client->reconnect_at = ev_now(loop) + client->backoff;
+    log_msg(WARN, "%s: connection to %s is closed, reconnecting in %.1fs, %d packets queued", __func__,
+        address_string(&(client->sa)), client->backoff, client->queue_length);
+}
+
+// moves queued packets except partially written one to the front of the flush queue so they are routed again
+void downstream_tcp_requeue(struct downstream_tcp_client_s *client) {
+    struct packet_s *first = client->queue_head;
+    struct packet_s *partial = NULL;
+    int moved = client->queue_length;
+
+    if (first != NULL && client->head_offset > 0) {
+        partial = first;
+        first = first->next;
+        moved--;
+    }
+    if (first == NULL) {
+        return;
+    }
+    client->queue_tail->next = global.downstream.queue_head;
+    if (global.downstream.queue_head == NULL) {
+        global.downstream.queue_tail = client->queue_tail;
+    }
+    global.downstream.queue_head = first;
+    global.downstream.queue_length += moved;
+    if (partial != NULL) {
+        partial->next = NULL;
+    }
+    client->queue_head = partial;
+    client->queue_tail = partial;
+    client->queue_length -= moved;
+}
+
+// takes the oldest packet which isn't being written from the longest host queue, NULL if there is none
+struct packet_s *downstream_tcp_drop_oldest() {
+    struct downstream_tcp_client_s *longest = NULL;
+    struct downstream_tcp_client_s *client = NULL;
+    struct downstream_host_s *host = NULL;
+    struct packet_s **link = NULL;
+    struct packet_s *packet = NULL;
+
+    for (host = global.downstream.downstream_hosts; host != NULL; host = host->next) {
+        client = &(host->tcp_client);
+        if (client->queue_length - (client->head_offset > 0) > 0 && (longest == NULL || client->queue_length > longest->queue_length)) {
+            longest = client;
+        }
+    }
+    if (longest == NULL) {
+        return NULL;
+    }
+    link = longest->head_offset > 0 ? &(longest->queue_head->next) : &(longest->queue_head);
+    packet = *link;
+    *link = packet->next;
+    if (longest->queue_tail == packet) {
+        longest->queue_tail = link == &(longest->queue_head) ? NULL : longest->queue_head;
+    }
+    longest->queue_length--;
+    return packet;
+}
+
+// this function writes queued packets with writev() until socket buffer is full
+void downstream_tcp_write(struct ev_loop *loop, struct downstream_tcp_client_s *client) {
+    struct iovec iovecs[DOWNSTREAM_SEND_BATCH_SIZE];
+    struct packet_s *packet = NULL;
+    ssize_t requested = 0;
+    ssize_t written = 0;
+    ssize_t offset = 0;
+    int iovecs_num = 0;
+    int sent = 0;
+
+    while (client->queue_head != NULL) {
+        iovecs_num = 0;
+        requested = -client->head_offset;
+        for (packet = client->queue_head; packet != NULL && iovecs_num < DOWNSTREAM_SEND_BATCH_SIZE; packet = packet->next) {
+            iovecs[iovecs_num].iov_base = packet->data;
+            iovecs[iovecs_num].iov_len = packet->length;
+            requested += packet->length;
+            iovecs_num++;
+        }
+        iovecs[0].iov_base = client->queue_head->data + client->head_offset;
+        iovecs[0].iov_len -= client->head_offset;
+        written = writev(client->super.fd, iovecs, iovecs_num);
+        if (written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                break;
+            }
+            log_msg(ERROR, "%s: writev() to %s failed %s", __func__, address_string(&(client->sa)), strerror(errno));
+            stat_add(STAT_SEND_FAILURES, 1);
+            downstream_tcp_disconnect(loop, client);
+            return;
+        }
+        stat_add(STAT_BYTES_SENT, written);
+        offset = client->head_offset + written;
+        sent = 0;
+        while (client->queue_head != NULL && offset >= client->queue_head->length) {
+            offset -= client->queue_head->length;
+            packet = client->queue_head;
+            client->queue_head = packet->next;
+            client->queue_length--;
+            downstream_release_packet(packet);
+            sent++;
+        }
+        if (client->queue_head == NULL) {
+            client->queue_tail = NULL;
+        }
+        client->head_offset = offset;
+        stat_add(STAT_PACKETS_SENT, sent);
+        log_msg(TRACE, "%s: flushed %d packets to %s, %d left in queue", __func__, sent, address_string(&(client->sa)), client->queue_length);
+        if (written < requested) {
+            // socket buffer is full
+            break;
+        }
+    }
+    // closed connection is noticed by read event even if there is nothing to write
+    downstream_tcp_watch(loop, client, client->queue_head != NULL ? EV_READ | EV_WRITE : EV_READ);
+}
+
+// starts nonblocking connect if backoff delay is over, data is written when connection is established
+void downstream_tcp_connect(struct ev_loop *loop, struct downstream_tcp_client_s *client) {
+    if (ev_now(loop) < client->reconnect_at) {
+        return;
+    }
+    client->super.fd = socket(client->sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (client->super.fd < 0) {
+        log_msg(ERROR, "%s: socket() failed %s", __func__, strerror(errno));
+        downstream_tcp_disconnect(loop, client);
+        return;
+    }
+    if (connect(client->super.fd, (struct sockaddr *)&(client->sa), client->sa_len) == 0) {
+        client->connected = 1;
+        client->backoff = 0;
+        downstream_tcp_write(loop, client);
+    } else if (errno == EINPROGRESS) {
+        downstream_tcp_watch(loop, client, EV_WRITE);
+    } else {
+        log_msg(WARN, "%s: connect() to %s failed %s", __func__, address_string(&(client->sa)), strerror(errno));
+        downstream_tcp_disconnect(loop, client);
+    }
+}
+
+void downstream_tcp_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    struct downstream_tcp_client_s *client = (struct downstream_tcp_client_s *)watcher;
+    char buffer[DOWNSTREAM_HEALTH_CHECK_BUF_SIZE];
+    socklen_t length = sizeof(int);
+    ssize_t n = 0;
+    int err = 0;
+
+    if (! client->connected) {
+        getsockopt(watcher->fd, SOL_SOCKET, SO_ERROR, &err, &length);
+        if (err != 0) {
+            log_msg(WARN, "%s: connect() to %s failed %s", __func__, address_string(&(client->sa)), strerror(err));
+            downstream_tcp_disconnect(loop, client);
+            return;
+        }
+        log_msg(INFO, "%s: connected to %s", __func__, address_string(&(client->sa)));
+        client->connected = 1;
+        client->backoff = 0;
+        downstream_tcp_write(loop, client);
+        return;
+    }
+    if (revents & EV_READ) {
+        // downstream doesn't send anything, so readable socket is closed or broken
+        n = recv(watcher->fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            downstream_tcp_disconnect(loop, client);
+            return;
+        }
+    }
+    if (revents & EV_WRITE) {
+        downstream_tcp_write(loop, client);
+    }
+}
+
+/* moves packets from the flush queue to the spool while it has room. Pages of the file are preallocated,
+ * so copying into the mapping doesn't wait for disk, dirty pages are written back by the kernel
+ */
+void spool_write_queue() {
+    struct spool_header_s *header = (struct spool_header_s *)global.spool.map;
+    struct spool_record_s record;
+    struct packet_s *packet = NULL;
+    uint64_t offset = 0;
+    int packets = 0;
+
+    if (header == NULL) {
+        return;
+    }
+    offset = header->write_offset;
+    while ((packet = global.downstream.queue_head) != NULL && offset + sizeof(record) + packet->length <= global.spool.size) {
+        record.length = packet->length;
+        record.hash = packet->hash;
+        memcpy(global.spool.map + offset, &record, sizeof(record));
+        memcpy(global.spool.map + offset + sizeof(record), packet->data, packet->length);
+        offset += sizeof(record) + packet->length;
+        downstream_release_packet(downstream_dequeue_packet());
+        packets++;
+    }
+    // offset is moved after the whole batch is copied, so a partial batch isn't read if we crash
+    header->write_offset = offset;
+    stat_add(STAT_PACKETS_SPOOLED, packets);
+    log_msg(DEBUG, "%s: spooled %d packets, %lu bytes in spool", __func__, packets, header->write_offset - header->read_offset);
+    if (global.downstream.queue_head != NULL && ! global.spool.full) {
+        global.spool.full = 1;
+        log_msg(ERROR, "%s: spool %s is full, packets are kept in the flush queue", __func__, global.spool_file);
+    }
+}
+
+/* in tcp mode packets from the flush queue are routed to queues of downstream hosts, which are written
+ * over persistent connections. Packets of hosts which went down are routed again
+ */
+void downstream_flush_tcp(struct ev_loop *loop) {
+    struct downstream_host_s *host = NULL;
+    struct downstream_tcp_client_s *client = NULL;
+    struct packet_s *packet = NULL;
+
+    for (host = global.downstream.downstream_hosts; host != NULL; host = host->next) {
+        if (host->health_client.alive == 0) {
+            downstream_tcp_requeue(&(host->tcp_client));
+        }
+    }
+    while (global.downstream.queue_head != NULL) {
+        host = downstream_route_packet(global.downstream.queue_head);
+        if (host == NULL) {
+            log_msg(ERROR, "%s: no downstream hosts", __func__);
+            spool_write_queue();
+            break;
+        }
+        client = &(host->tcp_client);
+        packet = downstream_dequeue_packet();
+        packet->next = NULL;
+        if (client->queue_tail == NULL) {
+            client->queue_head = packet;
+        } else {
+            client->queue_tail->next = packet;
+        }
+        client->queue_tail = packet;
+        client->queue_length++;
+    }
+    for (host = global.downstream.downstream_hosts; host != NULL; host = host->next) {
+        client = &(host->tcp_client);
+        if (client->super.fd < 0 && client->queue_head != NULL) {
+            downstream_tcp_connect(loop, client);
+        } else if (client->connected && client->queue_head != NULL) {
+            downstream_tcp_write(loop, client);
+        }
+    }
+}
+
+#ifdef HAVE_IO_URING
+// there are no libc wrappers for io_uring syscalls
+int uring_enter(int fd, unsigned to_submit) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, NULL, 0);
+}
+
+// hands buffer back to the kernel for the next receive
+void uring_provide_buffer(struct uring_s *uring, int bid) {
+    struct io_uring_buf *buf = uring->buf_ring->bufs + (uring->buf_ring->tail & (uring->buffers_num - 1));
+
+    buf->addr = (uint64_t)(uintptr_t)(uring->buffers + bid * global.data_buf_size);
+    // leave one byte to append '\n' if packet doesn't end with it
+    buf->len = global.data_buf_size - 1;
+    buf->bid = bid;
+    __atomic_store_n(&(uring->buf_ring->tail), uring->buf_ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+/* sets up io_uring with buffers_num receive buffers and send_slots sends in flight. Returns 1 if kernel doesn't
+ * support it, caller falls back to libev then
+ */
+int uring_init(struct uring_s *uring, int buffers_num, int send_slots) {
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    size_t ring_size = 0;
+    size_t cq_size = 0;
+    char *ring = NULL;
+    int i = 0;
+
+    memset(&params, 0, sizeof(params));
+    uring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (uring->fd < 0) {
+        log_msg(WARN, "%s: io_uring_setup() failed %s", __func__, strerror(errno));
+        return 1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+        log_msg(WARN, "%s: io_uring of this kernel is too old", __func__);
+        close(uring->fd);
+        uring->fd = -1;
+        return 1;
+    }
+    // submission and completion rings share single mapping
+    ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring_size = cq_size > ring_size ? cq_size : ring_size;
+    ring = (char *)mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+    uring->sqes = (struct io_uring_sqe *)mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+    uring->buf_ring = (struct io_uring_buf_ring *)mmap(NULL, buffers_num * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED || uring->sqes == MAP_FAILED || uring->buf_ring == MAP_FAILED) {
+        log_msg(ERROR, "%s: mmap() failed %s", __func__, strerror(errno));
+        close(uring->fd);
+        uring->fd = -1;
+        return 1;
+    }
+    uring->entries = params.sq_entries;
+    uring->sq_head = (unsigned *)(ring + params.sq_off.head);
+    uring->sq_tail = (unsigned *)(ring + params.sq_off.tail);
+    uring->sq_array = (unsigned *)(ring + params.sq_off.array);
+    uring->sq_pending_tail = *(uring->sq_tail);
+    uring->cq_head = (unsigned *)(ring + params.cq_off.head);
+    uring->cq_tail = (unsigned *)(ring + params.cq_off.tail);
+    uring->cq_mask = *(unsigned *)(ring + params.cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)uring->buf_ring;
+    reg.ring_entries = buffers_num;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        log_msg(WARN, "%s: provided buffer ring is not supported %s", __func__, strerror(errno));
+        close(uring->fd);
+        uring->fd = -1;
+        return 1;
+    }
+    uring->buffers_num = buffers_num;
+    uring->buffers = (char *)malloc(buffers_num * global.data_buf_size);
+    uring->send_msgs = (struct msghdr *)calloc(send_slots, sizeof(struct msghdr));
+    uring->send_iovecs = (struct iovec *)calloc(send_slots, sizeof(struct iovec));
+    uring->send_packets = (struct packet_s **)calloc(send_slots, sizeof(struct packet_s *));
+    uring->send_free = (int *)calloc(send_slots, sizeof(int));
+    // only the thread which sends waits for sends during the flush
+    uring->deferred_bids = (int *)calloc(send_slots > 0 ? buffers_num : 0, sizeof(int));
+    uring->deferred_lengths = (int *)calloc(send_slots > 0 ? buffers_num : 0, sizeof(int));
+    if (uring->buffers == NULL || (send_slots > 0 && (uring->send_msgs == NULL || uring->send_iovecs == NULL ||
+            uring->send_packets == NULL || uring->send_free == NULL || uring->deferred_bids == NULL || uring->deferred_lengths == NULL))) {
+        log_msg(ERROR, "%s: failed to allocate memory for io_uring buffers", __func__);
+        close(uring->fd);
+        uring->fd = -1;
+        return 1;
+    }
+    for (i = 0; i < buffers_num; i++) {
+        uring_provide_buffer(uring, i);
+    }
+    for (i = 0; i < send_slots; i++) {
+        uring->send_free[i] = i;
+        uring->send_msgs[i].msg_iov = uring->send_iovecs + i;
+        uring->send_msgs[i].msg_iovlen = 1;
+    }
+    uring->send_free_num = send_slots;
+    uring->deferred_num = 0;
+    uring->recv_generation = 0;
+    uring->recv_armed = 0;
+    uring->recv_disabled = 0;
+    return 0;
+}
+
+// returns cleared submission queue entry or NULL if queue is full, entries are passed to the kernel by uring_submit()
+struct io_uring_sqe *uring_get_sqe(struct uring_s *uring, uint64_t user_data) {
+    unsigned tail = uring->sq_pending_tail;
+    struct io_uring_sqe *sqe = NULL;
+
+    if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->entries) {
+        return NULL;
+    }
+    uring->sq_array[tail & (uring->entries - 1)] = tail & (uring->entries - 1);
+    sqe = uring->sqes + (tail & (uring->entries - 1));
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = user_data;
+    uring->sq_pending_tail++;
+    return sqe;
+}
+
+// single syscall submits everything queued since the last call
+void uring_submit(struct uring_s *uring) {
+    unsigned to_submit = uring->sq_pending_tail - *(uring->sq_tail);
+
+    if (to_submit == 0) {
+        return;
+    }
+    __atomic_store_n(uring->sq_tail, uring->sq_pending_tail, __ATOMIC_RELEASE);
+    if (uring_enter(uring->fd, to_submit) < 0 && errno != EINTR) {
+        log_msg(ERROR, "%s: io_uring_enter() failed %s", __func__, strerror(errno));
+    }
+}
+
+/* queues packets from the flush queue as sends of io_uring of worker 0, they are submitted with single syscall.
+ * Packets leave the queue when they are submitted and are released when send completes
+ */
+void downstream_flush_uring(struct uring_s *uring) {
+    struct downstream_host_s *host = NULL;
+    struct packet_s *packet = NULL;
+    struct io_uring_sqe *sqe = NULL;
+    int slot = 0;
+
+    while (global.downstream.queue_head != NULL && uring->send_free_num > 0) {
+        host = downstream_route_packet(global.downstream.queue_head);
+        if (host == NULL) {
+            log_msg(ERROR, "%s: no downstream hosts", __func__);
+            spool_write_queue();
+            break;
+        }
+        slot = uring->send_free[uring->send_free_num - 1];
+        sqe = uring_get_sqe(uring, ((uint64_t)slot << 8) | URING_OP_SEND);
+        if (sqe == NULL) {
+            break;
+        }
+        uring->send_free_num--;
+        packet = downstream_dequeue_packet();
+        uring->send_packets[slot] = packet;
+        uring->send_iovecs[slot].iov_base = packet->data;
+        uring->send_iovecs[slot].iov_len = packet->length;
+        uring->send_msgs[slot].msg_name = &(host->sa_data);
+        uring->send_msgs[slot].msg_namelen = host->sa_data_len;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = global.downstream.flush_watcher.fd;
+        sqe->addr = (uint64_t)(uintptr_t)(uring->send_msgs + slot);
+        sqe->len = 1;
+    }
+    log_msg(TRACE, "%s: %d sends in flight, %d packets left in queue", __func__, URING_SEND_SLOTS - uring->send_free_num,
+        global.downstream.queue_length);
+    uring_submit(uring);
+}
+
+// releases packet of completed send
+void uring_send_complete(struct uring_s *uring, struct io_uring_cqe *cqe) {
+    int slot = cqe->user_data >> 8;
+    struct packet_s *packet = uring->send_packets[slot];
+
+    if (cqe->res < 0) {
+        log_msg(ERROR, "%s: sendmsg() failed %s", __func__, strerror(-cqe->res));
+        stat_add(STAT_SEND_FAILURES, 1);
+        stat_add(STAT_PACKETS_DROPPED, 1);
+        stat_add(STAT_BYTES_DROPPED, packet->length);
+    } else {
+        stat_add(STAT_PACKETS_SENT, 1);
+        stat_add(STAT_BYTES_SENT, packet->length);
+        global.downstream.packets_sent++;
+    }
+    downstream_release_packet(packet);
+    uring->send_packets[slot] = NULL;
+    uring->send_free[uring->send_free_num++] = slot;
+}
+#endif
+
+/* this function sends packets from the flush queue with sendmmsg() calls, spreading them
+ * between healthy downstream hosts. Write watcher is used only if socket is not ready
+ */
+void downstream_flush(struct ev_loop *loop) {
+    struct ev_io *watcher = &(global.downstream.flush_watcher);
+    struct mmsghdr msgs[DOWNSTREAM_SEND_BATCH_SIZE];
+    struct iovec iovecs[DOWNSTREAM_SEND_BATCH_SIZE];
+    struct downstream_host_s *host = NULL;
+    struct packet_s *packet = NULL;
+    int new_socket_fd = 0;
+    int msgs_num = 0;
+    int sent = 0;
+    int i = 0;
+
+    if (global.downstream_protocol == PROTOCOL_TCP) {
+        downstream_flush_tcp(loop);
+        return;
+    }
+    if (ev_is_active(watcher)) {
+        ev_io_stop(loop, watcher);
+    }
+    if (global.downstream.packets_sent > MAX_PACKETS_PER_SOCKET) {
+        global.downstream.packets_sent = 0;
+        new_socket_fd = dual_stack_socket(global.downstream.flush_family, SOCK_DGRAM);
+        if (new_socket_fd < 0) {
+            log_msg(ERROR, "%s: socket() failed %s", __func__, strerror(errno));
+        } else {
+            // sends in flight keep the old socket open till they complete
+            close(watcher->fd);
+            watcher->fd = new_socket_fd;
+        }
+    }
+#ifdef HAVE_IO_URING
+    if (global.io_backend == IO_BACKEND_IO_URING && global.workers != NULL && global.workers->uring.fd >= 0) {
+        downstream_flush_uring(&(global.workers->uring));
+        return;
+    }
+#endif
+    while (global.downstream.queue_head != NULL) {
+        memset(msgs, 0, sizeof(msgs));
+        msgs_num = 0;
+        for (packet = global.downstream.queue_head; packet != NULL && msgs_num < DOWNSTREAM_SEND_BATCH_SIZE; packet = packet->next) {
+            host = downstream_route_packet(packet);
+            if (host == NULL) {
+                log_msg(ERROR, "%s: no downstream hosts", __func__);
+                spool_write_queue();
+                return;
+            }
+            log_msg(DEBUG, "%s: flushing to %s", __func__, address_string(&(host->health_client.sa)));
+            iovecs[msgs_num].iov_base = packet->data;
+            iovecs[msgs_num].iov_len = packet->length;
+            msgs[msgs_num].msg_hdr.msg_iov = iovecs + msgs_num;
+            msgs[msgs_num].msg_hdr.msg_iovlen = 1;
+            msgs[msgs_num].msg_hdr.msg_name = &(host->sa_data);
+            msgs[msgs_num].msg_hdr.msg_namelen = host->sa_data_len;
+            msgs_num++;
+        }
+        sent = sendmmsg(watcher->fd, msgs, msgs_num, MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                ev_io_init(watcher, downstream_flush_cb, watcher->fd, EV_WRITE);
+                ev_io_start(loop, watcher);
+                return;
+            }
+            // first packet can't be sent, let's drop it and try the rest
+            log_msg(ERROR, "%s: sendmmsg() failed %s", __func__, strerror(errno));
+            stat_add(STAT_SEND_FAILURES, 1);
+            stat_add(STAT_PACKETS_DROPPED, 1);
+            stat_add(STAT_BYTES_DROPPED, global.downstream.queue_head->length);
+            downstream_release_packet(downstream_dequeue_packet());
+            sent = 0;
+        }
+        for (i = 0; i < sent; i++) {
+            stat_add(STAT_BYTES_SENT, global.downstream.queue_head->length);
+            downstream_release_packet(downstream_dequeue_packet());
+        }
+        stat_add(STAT_PACKETS_SENT, sent);
+        log_msg(TRACE, "%s: flushed %d packets, %d left in queue", __func__, sent, global.downstream.queue_length);
+        global.downstream.packets_sent += sent;
+    }
+}
+
+// this function is called when downstream socket becomes writable after sendmmsg() returned EAGAIN
+void downstream_flush_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    if (EV_ERROR & revents) {
+        log_msg(ERROR, "%s: invalid event %s", __func__, strerror(errno));
+        return;
+    }
+    downstream_flush(loop);
+}
+
+int downstream_hosts_alive();
+
+/* sends spooled packets at spool_drain_rate while downstream hosts are up. Packets are taken from the pool,
+ * so the flush queue limit applies to them too. Spool is rewound when all of them are sent
+ */
+void spool_drain_cb(struct ev_loop *loop, struct ev_timer *watcher, int revents) {
+    struct spool_header_s *header = (struct spool_header_s *)global.spool.map;
+    struct spool_record_s record;
+    struct packet_s *packet = NULL;
+    int budget = global.spool_drain_rate * SPOOL_DRAIN_INTERVAL;
+    int packets = 0;
+
+    budget = budget > 0 ? budget : 1;
+    while (packets < budget && header->read_offset < header->write_offset && downstream_hosts_alive() > 0 &&
+            (packet = downstream_get_packet()) != NULL) {
+        memcpy(&record, global.spool.map + header->read_offset, sizeof(record));
+        if (header->read_offset + sizeof(record) + record.length > header->write_offset) {
+            log_msg(ERROR, "%s: spool %s is corrupted, dropping %lu bytes", __func__, global.spool_file,
+                header->write_offset - header->read_offset);
+            downstream_release_packet(packet);
+            header->read_offset = header->write_offset;
+            break;
+        }
+        if (record.length > global.downstream_buf_size) {
+            // downstream_buf_size was decreased since packet was spooled
+            stat_add(STAT_PACKETS_DROPPED, 1);
+            stat_add(STAT_BYTES_DROPPED, record.length);
+            downstream_release_packet(packet);
+        } else {
+            memcpy(packet->data, global.spool.map + header->read_offset + sizeof(record), record.length);
+            packet->length = record.length;
+            packet->hash = record.hash;
+            downstream_enqueue_packet(packet);
+            packets++;
+        }
+        header->read_offset += sizeof(record) + record.length;
+    }
+    stat_add(STAT_PACKETS_UNSPOOLED, packets);
+    if (header->read_offset == header->write_offset) {
+        log_msg(INFO, "%s: spool %s is drained", __func__, global.spool_file);
+        header->read_offset = header->write_offset = sizeof(struct spool_header_s);
+        global.spool.full = 0;
+        ev_timer_stop(loop, watcher);
+    } else if (downstream_hosts_alive() == 0) {
+        ev_timer_stop(loop, watcher);
+    } else {
+        // records of the next portion are read ahead, so that page faults don't wait for disk
+        madvise(global.spool.map + (header->read_offset & ~((uint64_t)getpagesize() - 1)),
+            budget * (sizeof(record) + global.downstream_buf_size), MADV_WILLNEED);
+    }
+    if (packets > 0 && ! ev_is_active(&(global.downstream.flush_watcher))) {
+        downstream_flush(loop);
+    }
+}
+
+// how many bytes of packets wait in the spool
+uint64_t spool_bytes() {
+    struct spool_header_s *header = (struct spool_header_s *)global.spool.map;
+    return header->write_offset - header->read_offset;
+}
+
+// starts sending spooled packets, it is called when downstream host goes up
+void spool_start_drain(struct ev_loop *loop) {
+    struct spool_header_s *header = (struct spool_header_s *)global.spool.map;
+
+    if (header != NULL && header->read_offset < header->write_offset && ! ev_is_active(&(global.spool.drain_watcher))) {
+        log_msg(INFO, "%s: sending %lu bytes from spool %s", __func__, header->write_offset - header->read_offset, global.spool_file);
+        ev_timer_start(loop, &(global.spool.drain_watcher));
+    }
+}
+
+// opens or creates spool file, packets left by previous run are sent when downstream is up
+int init_spool() {
+    struct spool_header_s *header = NULL;
+    struct stat st;
+    uint64_t size = global.spool_size;
+    uint64_t write_offset = 0;
+    int fd = -1;
+
+    if (global.spool_file == NULL) {
+        return 0;
+    }
+    if ((fd = open(global.spool_file, O_RDWR | O_CREAT, 0600)) < 0 || fstat(fd, &st) != 0) {
+        log_msg(ERROR, "%s: failed to open %s: %s", __func__, global.spool_file, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
+    }
+    // spool which doesn't fit new spool_size is kept as is until it is drained
+    if (st.st_size > size && pread(fd, &write_offset, sizeof(write_offset), offsetof(struct spool_header_s, write_offset)) == sizeof(write_offset) &&
+            write_offset > size && write_offset <= st.st_size) {
+        size = st.st_size;
+    }
+    if (ftruncate(fd, size) != 0 || (errno = posix_fallocate(fd, 0, size)) != 0) {
+        log_msg(ERROR, "%s: failed to allocate %lu bytes for %s: %s", __func__, size, global.spool_file, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    global.spool.map = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (global.spool.map == MAP_FAILED) {
+        log_msg(ERROR, "%s: mmap() failed %s", __func__, strerror(errno));
+        global.spool.map = NULL;
+        return 1;
+    }
+    global.spool.size = size;
+    header = (struct spool_header_s *)global.spool.map;
+    if (header->magic != SPOOL_MAGIC || header->read_offset < sizeof(struct spool_header_s) ||
+            header->read_offset > header->write_offset || header->write_offset > size) {
+        header->magic = SPOOL_MAGIC;
+        header->read_offset = header->write_offset = sizeof(struct spool_header_s);
+    } else if (header->read_offset < header->write_offset) {
+        log_msg(INFO, "%s: %lu bytes are left in spool %s", __func__, header->write_offset - header->read_offset, global.spool_file);
+    }
+    ev_timer_init(&(global.spool.drain_watcher), spool_drain_cb, SPOOL_DRAIN_INTERVAL, SPOOL_DRAIN_INTERVAL);
+    return 0;
+}
+
+#ifdef HAVE_IO_URING
+int uring_wait_sends();
+#endif
+
+/* this function moves filled active packet into the flush queue and makes new packet active.
+ * If queue is full packets are dropped according to downstream_queue_drop_policy
+ */
+void downstream_next_active_packet() {
+    struct packet_s *packet = downstream_get_packet();
+
+    if (packet == NULL) {
+        // queue is full, let's try to send it right away
+        downstream_flush(ev_default_loop(0));
+        packet = downstream_get_packet();
+    }
+#ifdef HAVE_IO_URING
+    while (packet == NULL && uring_wait_sends()) {
+        packet = downstream_get_packet();
+    }
+#endif
+    if (packet == NULL) {
+        if (global.downstream_queue_drop_policy == DROP_OLDEST && global.downstream.queue_head != NULL) {
+            packet = downstream_dequeue_packet();
+        } else if (global.downstream_queue_drop_policy == DROP_OLDEST && (packet = downstream_tcp_drop_oldest()) != NULL) {
+            // in tcp mode packets wait in queues of the hosts
+        } else {
+            // active packet is the newest one
+            packet = global.downstream.active_packet;
+            global.downstream.active_packet = NULL;
+        }
+        stat_add(STAT_PACKETS_DROPPED, 1);
+        stat_add(STAT_BYTES_DROPPED, packet->length);
+        packet->next = NULL;
+        packet->length = 0;
+        packet->hash = global.downstream.packet_hash;
+    }
+    if (global.downstream.active_packet != NULL) {
+        log_msg(TRACE, "%s: queueing packet: \"%.*s\"", __func__, global.downstream.active_packet->length, global.downstream.active_packet->data);
+        downstream_enqueue_packet(global.downstream.active_packet);
+    }
+    global.downstream.active_packet = packet;
+}
+
+// returns length of the longest prefix of values which ends on values boundary and fits into max_length
+int values_prefix_length(char *values, int values_length, int max_length) {
+    int i = 0;
+
+    if (values_length <= max_length) {
+        return values_length;
+    }
+    for (i = max_length - 1; i >= 0; i--) {
+        if (values[i] == ':') {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+// formats counter as "%.15g|c\n" would do, returns length of the string
+int format_counter(char *buffer, double value) {
+    char digits[COUNTER_BUF_SIZE];
+    char *ptr = buffer;
+    uint64_t number = 0;
+    int length = 0;
+
+    // integers are the most common case and don't need snprintf()
+    if (value > -MAX_EXACT_COUNTER && value < MAX_EXACT_COUNTER && value == (double)(int64_t)value && !(value == 0 && signbit(value))) {
+        if (value < 0) {
+            *(ptr++) = '-';
+            number = (uint64_t)(-value);
+        } else {
+            number = (uint64_t)value;
+        }
+        do {
+            digits[length++] = '0' + number % 10;
+            number /= 10;
+        } while (number > 0);
+        while (length > 0) {
+            *(ptr++) = digits[--length];
+        }
+        memcpy(ptr, "|c\n", 3);
+        return ptr - buffer + 3;
+    }
+    return snprintf(buffer, COUNTER_BUF_SIZE, "%.15g|c\n", value);
+}
+
+/* parses number which spans from start to end, returns 0 on success.
+ * Plain integers and decimals with up to 15 significant digits are parsed exactly without strtod()
+ */
+int parse_number(char *start, char *end, double *value) {
+    static const double powers_of_ten[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+    char *ptr = start;
+    char *endptr = NULL;
+    int negative = 0;
+    int digits = 0;
+    int fraction_digits = 0;
+    int seen_dot = 0;
+    uint64_t mantissa = 0;
+
+    if (ptr < end && (*ptr == '-' || *ptr == '+')) {
+        negative = (*ptr == '-');
+        ptr++;
+    }
+    for (; ptr < end && digits <= MAX_FAST_PARSE_DIGITS; ptr++) {
+        if (*ptr >= '0' && *ptr <= '9') {
+            mantissa = mantissa * 10 + (*ptr - '0');
+            digits++;
+            fraction_digits += seen_dot;
+        } else if (*ptr == '.' && ! seen_dot) {
+            seen_dot = 1;
+        } else {
+            break;
+        }
+    }
+    if (ptr == end && digits > 0 && digits <= MAX_FAST_PARSE_DIGITS) {
+        // both mantissa and power of ten are exact doubles so the division is correctly rounded like strtod()
+        *value = (double)mantissa / powers_of_ten[fraction_digits];
+        if (negative) {
+            *value = -*value;
+        }
+        return 0;
+    }
+    // exponents, long numbers, inf and so on
+    errno = 0;
+    *value = strtod(start, &endptr);
+    if (errno != 0 || endptr != end) {
+        return 1;
+    }
+    return 0;
+}
+
+// this function copies values into active packet, continuing the open line of the slot if possible
+void downstream_pack_values(struct arena_s *names, slot_s *slot, char *values, int values_length, int *line_open) {
+    struct packet_s *packet = NULL;
+    int chunk_length = 0;
+    char *target_ptr = NULL;
+
+    while (values_length > 0) {
+        packet = global.downstream.active_packet;
+        chunk_length = values_prefix_length(values, values_length,
+            global.downstream_buf_size - packet->length - (*line_open ? 0 : slot->name_length));
+        if (chunk_length == 0) {
+            // not even single value fits, let's continue in the next packet.
+            // process_data_packet() ensures that name with single value fits into empty packet
+            downstream_next_active_packet();
+            *line_open = 0;
+            continue;
+        }
+        target_ptr = packet->data + packet->length;
+        if (*line_open) {
+            // replace '\n' of the line with values separator
+            *(target_ptr - 1) = ':';
+        } else {
+            memcpy(target_ptr, ARENA_PTR(names, slot->name), slot->name_length);
+            target_ptr += slot->name_length;
+            packet->length += slot->name_length;
+            *line_open = 1;
+        }
+        memcpy(target_ptr, values, chunk_length);
+        *(target_ptr + chunk_length - 1) = '\n';
+        packet->length += chunk_length;
+        values += chunk_length;
+        values_length -= chunk_length;
+    }
+}
+
+// this function copies whole line into active packet
+void downstream_pack_line(char *line, int length) {
+    if (length > global.downstream_buf_size) {
+        log_msg(ERROR, "%s: line is too long \"%.*s\"", __func__, length - 1, line);
+        return;
+    }
+    if (global.downstream_buf_size - global.downstream.active_packet->length < length) {
+        downstream_next_active_packet();
+    }
+    memcpy(global.downstream.active_packet->data + global.downstream.active_packet->length, line, length);
+    global.downstream.active_packet->length += length;
+}
+
+// formats absolute gauge value. Negative value would be taken as delta, so gauge is set to 0 first
+int format_absolute_gauge(char *buffer, double value) {
+    if (value < 0) {
+        return sprintf(buffer, "0|g:%.15g|g\n", value);
+    }
+    return sprintf(buffer, "%.15g|g\n", value);
+}
+
+// formats gauge value. Absolute value is sent as is, sum of deltas is sent with sign
+int format_gauge(char *buffer, slot_s *slot) {
+    if (! (slot->flags & SLOT_GAUGE_ABSOLUTE)) {
+        return sprintf(buffer, "%+.15g|g\n", slot->counter);
+    }
+    return format_absolute_gauge(buffer, slot->counter);
+}
+
+// this function sends count, sum, min, max and percentiles of the timer instead of its values
+void downstream_pack_timer(struct aggregator_s *aggregator, slot_s *slot) {
+    timer_sketch_s *sketch = (timer_sketch_s *)ARENA_PTR(&(aggregator->arena), slot->values_head);
+    char line[global.downstream_buf_size + MAX_TIMER_SUMMARY_LENGTH];
+    // name without ':'
+    int name_length = slot->name_length - 1;
+    char *suffix = line + name_length;
+    char *ptr = NULL;
+    int length = 0;
+    int i = 0;
+
+    memcpy(line, ARENA_PTR(&(aggregator->names), slot->name), name_length);
+    timer_sketch_sort(sketch);
+    length = sprintf(suffix, ".count:%lu|c\n", (unsigned long)sketch->count);
+    downstream_pack_line(line, name_length + length);
+    length = sprintf(suffix, ".sum:%.15g|c\n", sketch->sum);
+    downstream_pack_line(line, name_length + length);
+    length = sprintf(suffix, ".min:");
+    length += format_absolute_gauge(suffix + length, sketch->min);
+    downstream_pack_line(line, name_length + length);
+    length = sprintf(suffix, ".max:");
+    length += format_absolute_gauge(suffix + length, sketch->max);
+    downstream_pack_line(line, name_length + length);
+    for (i = 0; i < global.timer_percentiles_num; i++) {
+        length = sprintf(suffix, ".p%g", global.timer_percentiles[i]);
+        // 99.9 is sent as p99_9
+        for (ptr = suffix + 2; ptr < suffix + length; ptr++) {
+            if (*ptr == '.') {
+                *ptr = '_';
+            }
+        }
+        length += sprintf(suffix + length, ":");
+        length += format_absolute_gauge(suffix + length, timer_sketch_percentile(sketch, global.timer_percentiles[i]));
+        downstream_pack_line(line, name_length + length);
+    }
+}
+
+// sets counted with HyperLogLog are sent as gauge with estimated number of distinct members
+void downstream_pack_set_cardinality(struct aggregator_s *aggregator, slot_s *slot) {
+    char line[global.downstream_buf_size + MAX_TIMER_SUMMARY_LENGTH];
+    int name_length = slot->name_length - 1;
+
+    memcpy(line, ARENA_PTR(&(aggregator->names), slot->name), name_length);
+    downstream_pack_line(line, name_length + sprintf(line + name_length, ".cardinality:%.0f|g\n",
+        hll_estimate((uint8_t *)ARENA_PTR(&(aggregator->arena), slot->members))));
+}
+
+// this function copies slot data into active packet, splitting it into several lines and packets if needed
+void downstream_pack_slot(struct aggregator_s *aggregator, slot_s *slot) {
+    struct arena_s *arena = &(aggregator->arena);
+    struct arena_s *names = &(aggregator->names);
+    uint32_t chunk_offset = 0;
+    values_chunk_s *chunk = NULL;
+    char counter_buffer[COUNTER_BUF_SIZE];
+    char gauge_buffer[COUNTER_BUF_SIZE * 2];
+    // set if the last line in active packet belongs to this slot and can be continued
+    int line_open = 0;
+
+    if (slot->type == TYPE_COUNTER) {
+        // counters are kept as numbers and formatted only once per flush
+        if (slot->values_length > 0) {
+            downstream_pack_values(names, slot, counter_buffer, format_counter(counter_buffer, slot->counter), &line_open);
+        }
+        return;
+    }
+    if (slot->type == TYPE_TIMER) {
+        if (slot->values_length > 0) {
+            downstream_pack_timer(aggregator, slot);
+        }
+        return;
+    }
+    if (slot->type == TYPE_GAUGE) {
+        if (slot->values_length > 0) {
+            downstream_pack_values(names, slot, gauge_buffer, format_gauge(gauge_buffer, slot), &line_open);
+        }
+        return;
+    }
+    if (slot->type == TYPE_SET && (slot->flags & SLOT_SET_HLL)) {
+        downstream_pack_set_cardinality(aggregator, slot);
+        return;
+    }
+    for (chunk_offset = slot->values_head; chunk_offset != ARENA_NULL; chunk_offset = chunk->next) {
+        chunk = (values_chunk_s *)ARENA_PTR(arena, chunk_offset);
+        downstream_pack_values(names, slot, chunk->data, chunk->length, &line_open);
+    }
+}
+
+// grows per slot buffers used for sharding, returns 1 if we are out of memory
+int downstream_reserve_slot_buffers(int slots) {
+    uint32_t *slot_hashes = NULL;
+    int *slot_hosts = NULL;
+    int *slot_order = NULL;
+
+    if (slots <= global.downstream.slot_buffers_size) {
+        return 0;
+    }
+    slot_hashes = (uint32_t *)realloc(global.downstream.slot_hashes, slots * sizeof(uint32_t));
+    if (slot_hashes != NULL) {
+        global.downstream.slot_hashes = slot_hashes;
+    }
+    slot_hosts = (int *)realloc(global.downstream.slot_hosts, slots * sizeof(int));
+    if (slot_hosts != NULL) {
+        global.downstream.slot_hosts = slot_hosts;
+    }
+    slot_order = (int *)realloc(global.downstream.slot_order, slots * sizeof(int));
+    if (slot_order != NULL) {
+        global.downstream.slot_order = slot_order;
+    }
+    if (slot_hashes == NULL || slot_hosts == NULL || slot_order == NULL) {
+        log_msg(ERROR, "%s: failed to allocate memory for %d slots", __func__, slots);
+        return 1;
+    }
+    global.downstream.slot_buffers_size = slots;
+    return 0;
+}
+
+/* this function packs slots of every host into its own packets, so every packet has metrics of
+ * single host. Slots are grouped by host with counting sort
+ */
+void downstream_pack_sharded(struct aggregator_s *aggregator) {
+    // the last group is for slots without healthy host
+    int group_start[MAX_DOWNSTREAM_NUM + 2];
+    uint32_t *slot_hashes = global.downstream.slot_hashes;
+    int *slot_hosts = global.downstream.slot_hosts;
+    int *slot_order = global.downstream.slot_order;
+    int host = 0;
+    int i = 0;
+
+    memset(group_start, 0, sizeof(group_start));
+    for (i = 0; i < aggregator->slots_used; i++) {
+        if (! slot_active(aggregator, i)) {
+            slot_hosts[i] = -1;
+            continue;
+        }
+        slot_hashes[i] = aggregator->slots[i].hash;
+        host = downstream_ring_lookup(slot_hashes[i]);
+        slot_hosts[i] = host < 0 ? MAX_DOWNSTREAM_NUM : host;
+        group_start[slot_hosts[i] + 1]++;
+    }
+    for (host = 1; host <= MAX_DOWNSTREAM_NUM + 1; host++) {
+        group_start[host] += group_start[host - 1];
+    }
+    for (i = 0; i < aggregator->slots_used; i++) {
+        if (slot_hosts[i] >= 0) {
+            slot_order[group_start[slot_hosts[i]]++] = i;
+        }
+    }
+    host = -1;
+    for (i = 0; i < aggregator->slots_active; i++) {
+        if (slot_hosts[slot_order[i]] != host) {
+            host = slot_hosts[slot_order[i]];
+            if (global.downstream.active_packet->length > 0) {
+                downstream_next_active_packet();
+            }
+            global.downstream.active_packet->hash = slot_hashes[slot_order[i]];
+        }
+        global.downstream.packet_hash = slot_hashes[slot_order[i]];
+        downstream_pack_slot(aggregator, aggregator->slots + slot_order[i]);
+    }
+}
+
+/* this function serializes slots into as many packets as needed, puts them into flush queue
+ * and sends them
+ */
+void downstream_schedule_flush(struct aggregator_s *aggregator) {
+    int i = 0;
+    struct ev_io *watcher = &(global.downstream.flush_watcher);
+    unsigned long packets_dropped = stat_get(STAT_PACKETS_DROPPED);
+    unsigned long bytes_dropped = stat_get(STAT_BYTES_DROPPED);
+
+    if (global.downstream_routing == ROUTING_CONSISTENT_HASH && downstream_reserve_slot_buffers(aggregator->slots_used) == 0) {
+        downstream_pack_sharded(aggregator);
+    } else {
+        for (i = 0; i < aggregator->slots_used; i++) {
+            if (slot_active(aggregator, i)) {
+                downstream_pack_slot(aggregator, aggregator->slots + i);
+            }
+        }
+    }
+    if (global.downstream.active_packet->length > 0) {
+        downstream_next_active_packet();
+    }
+    if (stat_get(STAT_PACKETS_DROPPED) > packets_dropped) {
+        log_msg(ERROR, "%s: flush queue is full, dropped %lu packets (%lu bytes), %lu packets (%lu bytes) dropped in total",
+            __func__, stat_get(STAT_PACKETS_DROPPED) - packets_dropped, stat_get(STAT_BYTES_DROPPED) - bytes_dropped,
+            stat_get(STAT_PACKETS_DROPPED), stat_get(STAT_BYTES_DROPPED));
+    }
+    // if watcher is active it would flush new buffers as soon as socket is writable
+    if (! ev_is_active(watcher)) {
+        downstream_flush(ev_default_loop(0));
+    }
+}
+
+// returns pointer to chunk of slot values with at least length bytes free or NULL if we are out of memory
+values_chunk_s *slot_reserve(struct aggregator_s *aggregator, slot_s *slot, uint32_t length) {
+    struct arena_s *arena = &(aggregator->arena);
+    values_chunk_s *chunk = NULL;
+    uint32_t size = VALUES_CHUNK_SIZE;
+    uint32_t offset = 0;
+
+    if (slot->values_tail != ARENA_NULL) {
+        chunk = (values_chunk_s *)ARENA_PTR(arena, slot->values_tail);
+        if (chunk->size - chunk->length >= length) {
+            return chunk;
+        }
+        // chunks grow with number of values to keep chunk list short
+        size = chunk->size < MAX_VALUES_CHUNK_SIZE ? chunk->size * 2 : MAX_VALUES_CHUNK_SIZE;
+    }
+    if (size < length) {
+        size = length;
+    }
+    offset = arena_alloc(arena, sizeof(values_chunk_s) + size);
+    if (offset == ARENA_NULL) {
+        return NULL;
+    }
+    chunk = (values_chunk_s *)ARENA_PTR(arena, offset);
+    chunk->next = ARENA_NULL;
+    chunk->length = 0;
+    chunk->size = size;
+    if (slot->values_tail == ARENA_NULL) {
+        slot->values_head = offset;
+    } else {
+        ((values_chunk_s *)ARENA_PTR(arena, slot->values_tail))->next = offset;
+    }
+    slot->values_tail = offset;
+    return chunk;
+}
+
+// returns arena offset of the member table of the set with room for one more member or ARENA_NULL if we are out of memory
+uint32_t set_table_reserve(struct arena_s *arena, slot_s *slot) {
+    set_table_s *table = NULL;
+    set_table_s *old_table = NULL;
+    set_member_s *member = NULL;
+    uint32_t size = SET_TABLE_SIZE;
+    uint32_t offset = 0;
+    uint32_t i = 0;
+    uint32_t j = 0;
+
+    if (slot->members != 0) {
+        table = (set_table_s *)ARENA_PTR(arena, slot->members);
+        // keep load factor below 0.5
+        if ((table->used + 1) * 2 <= table->mask + 1) {
+            return slot->members;
+        }
+        size = (table->mask + 1) * 2;
+    }
+    offset = arena_alloc(arena, sizeof(set_table_s) + size * sizeof(set_member_s));
+    if (offset == ARENA_NULL) {
+        return ARENA_NULL;
+    }
+    table = (set_table_s *)ARENA_PTR(arena, offset);
+    memset(table, 0, sizeof(set_table_s) + size * sizeof(set_member_s));
+    table->mask = size - 1;
+    if (slot->members != 0) {
+        old_table = (set_table_s *)ARENA_PTR(arena, slot->members);
+        table->used = old_table->used;
+        for (i = 0; i <= old_table->mask; i++) {
+            member = old_table->members + i;
+            if (member->offset == 0) {
+                continue;
+            }
+            for (j = member->hash & table->mask; table->members[j].offset != 0; j = (j + 1) & table->mask);
+            table->members[j] = *member;
+        }
+    }
+    slot->members = offset;
+    return offset;
+}
+
+// switches set from exact members to HyperLogLog, returns 1 if we are out of memory
+int set_convert_to_hll(struct aggregator_s *aggregator, slot_s *slot) {
+    struct arena_s *arena = &(aggregator->arena);
+    uint32_t offset = arena_alloc(arena, HLL_REGISTERS);
+    set_table_s *table = NULL;
+    uint8_t *registers = NULL;
+    uint32_t i = 0;
+
+    if (offset == ARENA_NULL) {
+        return 1;
+    }
+    registers = (uint8_t *)ARENA_PTR(arena, offset);
+    memset(registers, 0, HLL_REGISTERS);
+    if (slot->members != 0) {
+        table = (set_table_s *)ARENA_PTR(arena, slot->members);
+        for (i = 0; i <= table->mask; i++) {
+            if (table->members[i].offset != 0) {
+                hll_add(registers, table->members[i].hash);
+            }
+        }
+    }
+    log_msg(DEBUG, "%s: set \"%.*s\" is counted with HyperLogLog", __func__, slot->name_length, ARENA_PTR(&(aggregator->names), slot->name));
+    // values are not sent anymore, their memory is released with the arena on flush
+    slot->members = offset;
+    slot->flags |= SLOT_SET_HLL;
+    slot->values_head = ARENA_NULL;
+    slot->values_tail = ARENA_NULL;
+    slot->values_length = 1;
+    return 0;
+}
+
+// adds member to the set if it is not there yet, returns 1 if we are out of memory
+int set_add_member(struct aggregator_s *aggregator, slot_s *slot, char *value, int length) {
+    struct arena_s *arena = &(aggregator->arena);
+    uint32_t hash = hash_name(value, length);
+    set_table_s *table = NULL;
+    set_member_s *member = NULL;
+    values_chunk_s *chunk = NULL;
+    uint32_t offset = 0;
+    uint32_t i = 0;
+
+    if (slot->flags & SLOT_SET_HLL) {
+        hll_add((uint8_t *)ARENA_PTR(arena, slot->members), hash);
+        return 0;
+    }
+    // room for the member is reserved before lookup, arena_alloc() can move the table
+    chunk = slot_reserve(aggregator, slot, length + STRLEN("|s:"));
+    if (chunk == NULL) {
+        return 1;
+    }
+    offset = (char *)chunk->data + chunk->length - arena->buffer;
+    if (set_table_reserve(arena, slot) == ARENA_NULL) {
+        return 1;
+    }
+    table = (set_table_s *)ARENA_PTR(arena, slot->members);
+    for (i = hash & table->mask; table->members[i].offset != 0; i = (i + 1) & table->mask) {
+        member = table->members + i;
+        if (member->hash == hash && member->length == length && memcmp(ARENA_PTR(arena, member->offset), value, length) == 0) {
+            return 0;
+        }
+    }
+    // chunk could be moved by arena_alloc() in set_table_reserve()
+    chunk = (values_chunk_s *)ARENA_PTR(arena, slot->values_tail);
+    memcpy(chunk->data + chunk->length, value, length);
+    memcpy(chunk->data + chunk->length + length, "|s:", STRLEN("|s:"));
+    chunk->length += length + STRLEN("|s:");
+    slot->values_length += length + STRLEN("|s:");
+    table->members[i].hash = hash;
+    table->members[i].offset = offset;
+    table->members[i].length = length;
+    table->used++;
+    if (global.set_hll_threshold > 0 && table->used > global.set_hll_threshold) {
+        return set_convert_to_hll(aggregator, slot);
+    }
+    return 0;
+}
+
+// adds members of the source set to the target one
+void set_merge(struct aggregator_s *target, slot_s *target_slot, struct arena_s *source_arena, slot_s *source_slot) {
+    set_table_s *table = NULL;
+    uint32_t i = 0;
+
+    if (source_slot->flags & SLOT_SET_HLL) {
+        if (! (target_slot->flags & SLOT_SET_HLL) && set_convert_to_hll(target, target_slot) != 0) {
+            return;
+        }
+        hll_merge((uint8_t *)ARENA_PTR(&(target->arena), target_slot->members), (uint8_t *)ARENA_PTR(source_arena, source_slot->members));
+        return;
+    }
+    table = (set_table_s *)ARENA_PTR(source_arena, source_slot->members);
+    for (i = 0; i <= table->mask; i++) {
+        if (table->members[i].offset != 0 &&
+                set_add_member(target, target_slot, ARENA_PTR(source_arena, table->members[i].offset), table->members[i].length) != 0) {
+            return;
+        }
+    }
+}
+
+// doubles number of allocated slots, slot buffers are allocated on demand
+int slots_grow(struct aggregator_s *aggregator) {
+    int slots_allocated = aggregator->slots_allocated > 0 ? aggregator->slots_allocated * 2 : NUM_OF_SLOTS;
+    slot_s *slots = (slot_s *)realloc(aggregator->slots, slots_allocated * sizeof(slot_s));
+    uint32_t *slot_intervals = NULL;
+
+    if (slots == NULL) {
+        log_msg(ERROR, "%s: failed to allocate memory for slots", __func__);
+        return 1;
+    }
+    memset(slots + aggregator->slots_allocated, 0, (slots_allocated - aggregator->slots_allocated) * sizeof(slot_s));
+    aggregator->slots = slots;
+    slot_intervals = (uint32_t *)realloc(aggregator->slot_intervals, slots_allocated * sizeof(uint32_t));
+    if (slot_intervals == NULL) {
+        log_msg(ERROR, "%s: failed to allocate memory for slots", __func__);
+        return 1;
+    }
+    aggregator->slot_intervals = slot_intervals;
+    aggregator->slots_allocated = slots_allocated;
+    return 0;
+}
+
+// clears data of the previous interval when slot gets data in the current one
+static inline void slot_activate(struct aggregator_s *aggregator, int slot_idx) {
+    slot_s *slot = aggregator->slots + slot_idx;
+
+    if (slot_active(aggregator, slot_idx)) {
+        return;
+    }
+    aggregator->slot_intervals[slot_idx] = aggregator->interval;
+    aggregator->slots_active++;
+    slot->values_head = ARENA_NULL;
+    slot->values_tail = ARENA_NULL;
+    slot->values_length = 0;
+    slot->type = TYPE_UNKNOWN;
+    slot->counter = 0.0;
+    slot->flags = 0;
+}
+
+// returns index of the name_limit with the longest prefix of the name or -1 if the name isn't limited
+int name_limit_find(char *name, int name_length) {
+    struct name_limit_s *limit = NULL;
+    int found = -1;
+    int i = 0;
+
+    for (i = 0; i < global.name_limits_num; i++) {
+        limit = global.name_limits + i;
+        // overflow metric is limited by the prefix itself
+        if (name_length == limit->overflow_length && memcmp(name, limit->overflow_name, name_length) == 0) {
+            return -1;
+        }
+        if (limit->prefix_length < name_length && memcmp(name, limit->prefix, limit->prefix_length) == 0 &&
+                (found < 0 || limit->prefix_length > global.name_limits[found].prefix_length)) {
+            found = i;
+        }
+    }
+    return found;
+}
+
+/* checks if the name gets its own slot in the current interval, returns index of the name_limit which sheds it or -1.
+ * Names which had data in the previous interval are admitted first, so flood of new names can't push them out
+ */
+int name_limit_admit(struct aggregator_s *aggregator, char *name, int name_length, int returning) {
+    struct name_limit_usage_s *usage = NULL;
+    int idx = aggregator->self_metrics ? -1 : name_limit_find(name, name_length);
+
+    if (idx < 0) {
+        return -1;
+    }
+    usage = aggregator->name_limits + idx;
+    if (returning) {
+        usage->returned++;
+    } else if (usage->names + usage->reserved - usage->returned >= global.name_limits[idx].limit) {
+        return idx;
+    }
+    usage->names++;
+    return -1;
+}
+
+int find_slot(struct aggregator_s *aggregator, char *line, int name_length);
+
+// accounts metric shed by the name_limit, returns slot of the overflow metric or -1 if metric is dropped
+int name_limit_shed(struct aggregator_s *aggregator, int idx, uint32_t hash) {
+    struct name_limit_usage_s *usage = aggregator->name_limits + idx;
+
+    if (usage->shed_names == ARENA_NULL && (usage->shed_names = arena_alloc(&(aggregator->arena), HLL_REGISTERS)) != ARENA_NULL) {
+        memset(ARENA_PTR(&(aggregator->arena), usage->shed_names), 0, HLL_REGISTERS);
+    }
+    if (usage->shed_names != ARENA_NULL) {
+        hll_add((uint8_t *)ARENA_PTR(&(aggregator->arena), usage->shed_names), hash);
+    }
+    usage->shed++;
+    stat_add(STAT_METRICS_SHED, 1);
+    if (global.name_limit_policy == NAME_LIMIT_DROP) {
+        return -1;
+    }
+    return find_slot(aggregator, global.name_limits[idx].overflow_name, global.name_limits[idx].overflow_length);
+}
+
+// returns index of the new slot or -1 if we are out of memory
+int add_slot(struct aggregator_s *aggregator, char *line, int name_length, uint32_t hash, uint32_t position) {
+    int slot_idx = aggregator->slots_used;
+    slot_s *slot = NULL;
+
+    if (slot_idx == aggregator->slots_allocated && slots_grow(aggregator) != 0) {
+        return -1;
+    }
+    slot = aggregator->slots + slot_idx;
+    slot->name = arena_alloc(&(aggregator->names), name_length);
+    if (slot->name == ARENA_NULL) {
+        return -1;
+    }
+    slot->hash = hash;
+    slot->name_length = name_length;
+    // slot is activated by find_slot()
+    aggregator->slot_intervals[slot_idx] = aggregator->interval - 1;
+    memcpy(ARENA_PTR(&(aggregator->names), slot->name), line, name_length);
+    slot_index_insert(&(aggregator->slot_index), position, hash, slot_idx);
+    log_msg(TRACE, "%s: created %.*s at slot %d", __func__, name_length, line, slot_idx);
+    return aggregator->slots_used++;
+}
+
+/* returns index of the slot for given name or -1 if we are out of memory or name is dropped by name_limit.
+ * Slot is ready to get data of the current interval, it is the overflow slot if name_limit rolls the name up
+ */
+int find_slot(struct aggregator_s *aggregator, char *line, int name_length) {
+    uint32_t hash = hash_name(line, name_length);
+    uint32_t position = 0;
+    struct slot_index_s *index = &(aggregator->slot_index);
+    int slot_idx = slot_index_lookup(index, aggregator->slots, aggregator->names.buffer, hash, line, name_length, &position);
+    int limit_idx = -1;
+
+    if (slot_idx >= 0) {
+        log_msg(TRACE, "%s: found %.*s at slot %d", __func__, name_length, line, slot_idx);
+        // limits are checked once per interval, when slot gets its first data
+        if (global.name_limits_num > 0 && ! slot_active(aggregator, slot_idx) && (limit_idx = name_limit_admit(aggregator,
+                line, name_length, aggregator->slot_intervals[slot_idx] == aggregator->interval - 1)) >= 0) {
+            return name_limit_shed(aggregator, limit_idx, hash);
+        }
+        slot_activate(aggregator, slot_idx);
+        return slot_idx;
+    }
+    // names over the limit are not interned
+    if (global.name_limits_num > 0 && (limit_idx = name_limit_admit(aggregator, line, name_length, 0)) >= 0) {
+        return name_limit_shed(aggregator, limit_idx, hash);
+    }
+    // keep load factor of the index below 0.5
+    if ((aggregator->slots_used + 1) * 2 > index->mask + 1) {
+        log_msg(DEBUG, "%s: growing slot index to %d entries", __func__, (index->mask + 1) * 2);
+        if (slot_index_grow(index, aggregator->slots, aggregator->names.buffer, aggregator->slots_used) != 0) {
+            return -1;
+        }
+        slot_index_lookup(index, aggregator->slots, aggregator->names.buffer, hash, line, name_length, &position);
+    }
+    slot_idx = add_slot(aggregator, line, name_length, hash, position);
+    if (slot_idx >= 0) {
+        slot_activate(aggregator, slot_idx);
+    }
+    return slot_idx;
+}
+
+int aggregator_init(struct aggregator_s *aggregator) {
+    int i = 0;
+
+    aggregator->slots = NULL;
+    aggregator->slot_intervals = NULL;
+    aggregator->slots_allocated = 0;
+    aggregator->slots_used = 0;
+    aggregator->slots_active = 0;
+    aggregator->interval = 1;
+    aggregator->self_metrics = 0;
+    memset(aggregator->name_limits, 0, sizeof(aggregator->name_limits));
+    for (i = 0; i < MAX_NAME_LIMITS; i++) {
+        aggregator->name_limits[i].shed_names = ARENA_NULL;
+    }
+    if (slots_grow(aggregator) != 0 || arena_init(&(aggregator->arena), ARENA_SIZE) != 0 ||
+            arena_init(&(aggregator->names), ARENA_SIZE) != 0) {
+        return 1;
+    }
+    return slot_index_init(&(aggregator->slot_index), SLOT_INDEX_SIZE);
+}
+
+/* removes names which got no data during name_idle_intervals. Remaining slots and their names are moved
+ * down keeping their order, so names never overlap while moved, and the index is rebuilt
+ */
+void aggregator_evict(struct aggregator_s *aggregator) {
+    struct arena_s *names = &(aggregator->names);
+    uint32_t position = 0;
+    uint32_t used = 0;
+    int evicted = 0;
+    int i = 0;
+    int j = 0;
+
+    for (i = 0; i < aggregator->slots_used; i++) {
+        evicted += aggregator->interval - aggregator->slot_intervals[i] >= (uint32_t)global.name_idle_intervals;
+    }
+    if (evicted == 0) {
+        return;
+    }
+    slot_index_clear(&(aggregator->slot_index));
+    for (i = 0; i < aggregator->slots_used; i++) {
+        if (aggregator->interval - aggregator->slot_intervals[i] >= (uint32_t)global.name_idle_intervals) {
+            continue;
+        }
+        memmove(ARENA_PTR(names, used), ARENA_PTR(names, aggregator->slots[i].name), aggregator->slots[i].name_length);
+        aggregator->slots[j] = aggregator->slots[i];
+        aggregator->slots[j].name = used;
+        aggregator->slot_intervals[j] = aggregator->slot_intervals[i];
+        // arena_alloc() keeps allocations aligned, so do we
+        used += (aggregator->slots[j].name_length + 7) & ~7u;
+        slot_index_lookup(&(aggregator->slot_index), aggregator->slots, names->buffer, aggregator->slots[j].hash,
+            ARENA_PTR(names, aggregator->slots[j].name), aggregator->slots[j].name_length, &position);
+        slot_index_insert(&(aggregator->slot_index), position, aggregator->slots[j].hash, j);
+        j++;
+    }
+    names->used = used;
+    aggregator->slots_used = j;
+    log_msg(DEBUG, "%s: evicted %d idle names, %d names left", __func__, evicted, j);
+}
+
+/* drops all accumulated data, memory is kept for the next flush interval. Slots are cleared
+ * when they get data again, so only names idle for too long are touched here
+ */
+void aggregator_reset(struct aggregator_s *aggregator) {
+    struct name_limit_usage_s *usage = NULL;
+    int i = 0;
+
+    aggregator_evict(aggregator);
+    aggregator->interval++;
+    aggregator->slots_active = 0;
+    arena_reset(&(aggregator->arena));
+    for (i = 0; i < global.name_limits_num; i++) {
+        usage = aggregator->name_limits + i;
+        usage->reserved = usage->names;
+        usage->names = 0;
+        usage->returned = 0;
+        usage->shed = 0;
+        usage->shed_names = ARENA_NULL;
+    }
+}
+
+// adds buckets of the source sketch to the sketch of target slot
+void timer_sketch_merge(struct aggregator_s *target, slot_s *target_slot, timer_sketch_s *source_sketch) {
+    timer_sketch_s *target_sketch = NULL;
+    uint32_t offset = 0;
+    uint32_t i = 0;
+
+    for (i = 0; i <= source_sketch->mask; i++) {
+        if (source_sketch->buckets[i].key == 0) {
+            continue;
+        }
+        offset = timer_sketch_reserve(&(target->arena), target_slot);
+        if (offset == ARENA_NULL) {
+            return;
+        }
+        target_sketch = (timer_sketch_s *)ARENA_PTR(&(target->arena), offset);
+        timer_sketch_add_bucket(target_sketch, source_sketch->buckets[i].key, source_sketch->buckets[i].count);
+    }
+    offset = timer_sketch_reserve(&(target->arena), target_slot);
+    if (offset == ARENA_NULL) {
+        return;
+    }
+    target_sketch = (timer_sketch_s *)ARENA_PTR(&(target->arena), offset);
+    target_sketch->sum += source_sketch->sum;
+    target_sketch->count += source_sketch->count;
+    target_sketch->zero_count += source_sketch->zero_count;
+    if (source_sketch->min < target_sketch->min) {
+        target_sketch->min = source_sketch->min;
+    }
+    if (source_sketch->max > target_sketch->max) {
+        target_sketch->max = source_sketch->max;
+    }
+}
+
+// adds data accumulated in source aggregator to the target one
+void aggregator_merge(struct aggregator_s *target, struct aggregator_s *source) {
+    slot_s *source_slot = NULL;
+    slot_s *target_slot = NULL;
+    values_chunk_s *source_chunk = NULL;
+    values_chunk_s *target_chunk = NULL;
+    struct name_limit_usage_s *source_usage = NULL;
+    struct name_limit_usage_s *target_usage = NULL;
+    uint32_t chunk_offset = 0;
+    int slot_idx = 0;
+    int i = 0;
+
+    // names shed by the source are reported with the target ones, names it admitted are checked against target limits
+    for (i = 0; i < global.name_limits_num; i++) {
+        source_usage = source->name_limits + i;
+        target_usage = target->name_limits + i;
+        target_usage->shed += source_usage->shed;
+        if (source_usage->shed_names == ARENA_NULL) {
+            continue;
+        }
+        if (target_usage->shed_names == ARENA_NULL && (target_usage->shed_names = arena_alloc(&(target->arena), HLL_REGISTERS)) != ARENA_NULL) {
+            memset(ARENA_PTR(&(target->arena), target_usage->shed_names), 0, HLL_REGISTERS);
+        }
+        if (target_usage->shed_names != ARENA_NULL) {
+            hll_merge((uint8_t *)ARENA_PTR(&(target->arena), target_usage->shed_names), (uint8_t *)ARENA_PTR(&(source->arena), source_usage->shed_names));
+        }
+    }
+    for (i = 0; i < source->slots_used; i++) {
+        source_slot = source->slots + i;
+        if (! slot_active(source, i) || source_slot->values_length == 0) {
+            continue;
+        }
+        slot_idx = find_slot(target, ARENA_PTR(&(source->names), source_slot->name), source_slot->name_length);
+        if (slot_idx < 0) {
+            continue;
+        }
+        target_slot = target->slots + slot_idx;
+        if (target_slot->type == TYPE_UNKNOWN) {
+            target_slot->type = source_slot->type;
+        } else if (target_slot->type != source_slot->type) {
+            log_msg(ERROR, "%s: got improper metric type for \"%.*s\"", __func__, source_slot->name_length, ARENA_PTR(&(source->names), source_slot->name));
+            continue;
+        }
+        if (source_slot->type == TYPE_COUNTER) {
+            target_slot->counter += source_slot->counter;
+            target_slot->values_length += source_slot->values_length;
+            continue;
+        }
+        if (source_slot->type == TYPE_GAUGE) {
+            // there is no order between packets of different workers, absolute value of the source wins
+            if (source_slot->flags & SLOT_GAUGE_ABSOLUTE) {
+                target_slot->counter = source_slot->counter;
+                target_slot->flags |= SLOT_GAUGE_ABSOLUTE;
+            } else {
+                target_slot->counter += source_slot->counter;
+            }
+            target_slot->values_length += source_slot->values_length;
+            continue;
+        }
+        if (source_slot->type == TYPE_SET) {
+            set_merge(target, target_slot, &(source->arena), source_slot);
+            continue;
+        }
+        if (source_slot->type == TYPE_TIMER) {
+            timer_sketch_merge(target, target_slot, (timer_sketch_s *)ARENA_PTR(&(source->arena), source_slot->values_head));
+            target_slot->values_length += source_slot->values_length;
+            continue;
+        }
+        for (chunk_offset = source_slot->values_head; chunk_offset != ARENA_NULL; chunk_offset = source_chunk->next) {
+            source_chunk = (values_chunk_s *)ARENA_PTR(&(source->arena), chunk_offset);
+            if (source_chunk->length == 0) {
+                continue;
+            }
+            target_chunk = slot_reserve(target, target_slot, source_chunk->length);
+            if (target_chunk == NULL) {
+                break;
+            }
+            memcpy(target_chunk->data + target_chunk->length, source_chunk->data, source_chunk->length);
+            target_chunk->length += source_chunk->length;
+            target_slot->values_length += source_chunk->length;
+        }
+    }
+}
+
+// portable tokenizer, also handles tails shorter than SIMD register
+void tokenize_scalar_from(char *buffer, int start, int length, struct packet_index_s *index) {
+    int i = 0;
+
+    for (i = start; i < length; i++) {
+        if (buffer[i] == ':' || buffer[i] == '|' || buffer[i] == '\n') {
+            index->lines[index->lines_num] = index->delimiters_num;
+            index->lines_num += (buffer[i] == '\n');
+            index->delimiters[index->delimiters_num++] = i;
+        }
+    }
+}
+
+void tokenize_scalar(char *buffer, int length, struct packet_index_s *index) {
+    index->delimiters_num = 0;
+    index->lines_num = 0;
+    tokenize_scalar_from(buffer, 0, length, index);
+}
+
+/* appends delimiters found in the block starting at offset, bits of mask and newlines correspond to bytes of the block.
+ * Delimiters are written by four to avoid mispredicted loop exits, entries past the last one are overwritten later
+ */
+static inline void tokenize_add_mask(struct packet_index_s *index, int *delimiters_num, int *lines_num, int offset, uint32_t mask, uint32_t newlines) {
+    uint16_t *delimiter = index->delimiters + *delimiters_num;
+    uint64_t bits = mask;
+    int bit = 0;
+
+    // newlines are rare, their indexes in delimiters are counted from the mask
+    while (newlines != 0) {
+        bit = __builtin_ctz(newlines);
+        index->lines[(*lines_num)++] = *delimiters_num + __builtin_popcount(mask & ((1u << bit) - 1));
+        newlines &= newlines - 1;
+    }
+    *delimiters_num += __builtin_popcount(mask);
+    // sentinel bit makes trailing zeros count of the empty mask defined
+    while (bits != 0) {
+        delimiter[0] = offset + __builtin_ctzll(bits | (1ull << 32));
+        bits &= bits - 1;
+        delimiter[1] = offset + __builtin_ctzll(bits | (1ull << 32));
+        bits &= bits - 1;
+        delimiter[2] = offset + __builtin_ctzll(bits | (1ull << 32));
+        bits &= bits - 1;
+        delimiter[3] = offset + __builtin_ctzll(bits | (1ull << 32));
+        bits &= bits - 1;
+        delimiter += 4;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+void tokenize_sse2(char *buffer, int length, struct packet_index_s *index) {
+    __m128i newline = _mm_set1_epi8('\n');
+    __m128i colon = _mm_set1_epi8(':');
+    __m128i pipe = _mm_set1_epi8('|');
+    __m128i block;
+    uint32_t newlines = 0;
+    // counters are kept in registers during the scan
+    int delimiters_num = 0;
+    int lines_num = 0;
+    int i = 0;
+
+    for (i = 0; i + 16 <= length; i += 16) {
+        block = _mm_loadu_si128((__m128i *)(buffer + i));
+        newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        tokenize_add_mask(index, &delimiters_num, &lines_num, i, newlines | _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(block, colon), _mm_cmpeq_epi8(block, pipe))), newlines);
+    }
+    index->delimiters_num = delimiters_num;
+    index->lines_num = lines_num;
+    tokenize_scalar_from(buffer, i, length, index);
+}
+
+__attribute__((target("avx2")))
+void tokenize_avx2(char *buffer, int length, struct packet_index_s *index) {
+    __m256i newline = _mm256_set1_epi8('\n');
+    __m256i colon = _mm256_set1_epi8(':');
+    __m256i pipe = _mm256_set1_epi8('|');
+    __m256i block;
+    uint32_t newlines = 0;
+    // counters are kept in registers during the scan
+    int delimiters_num = 0;
+    int lines_num = 0;
+    int i = 0;
+
+    for (i = 0; i + 32 <= length; i += 32) {
+        block = _mm256_loadu_si256((__m256i *)(buffer + i));
+        newlines = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+        tokenize_add_mask(index, &delimiters_num, &lines_num, i, newlines | _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(block, colon), _mm256_cmpeq_epi8(block, pipe))), newlines);
+    }
+    index->delimiters_num = delimiters_num;
+    index->lines_num = lines_num;
+    tokenize_scalar_from(buffer, i, length, index);
+}
+#endif
+
+// allocates delimiters of packet up to data_buf_size bytes
+int init_packet_index(struct packet_index_s *index) {
+    index->delimiters = (uint16_t *)malloc((global.data_buf_size + 4) * sizeof(uint16_t));
+    index->lines = (uint16_t *)malloc((global.data_buf_size + 1) * sizeof(uint16_t));
+    if (index->delimiters == NULL || index->lines == NULL) {
+        log_msg(ERROR, "%s: failed to allocate memory for packet index", __func__);
+        return 1;
+    }
+    return 0;
+}
+
+// returns the fastest tokenizer supported by the cpu we are running on
+tokenizer_f tokenizer_select() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        log_msg(INFO, "%s: using avx2 tokenizer", __func__);
+        return tokenize_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        log_msg(INFO, "%s: using sse2 tokenizer", __func__);
+        return tokenize_sse2;
+    }
+#endif
+    log_msg(INFO, "%s: using scalar tokenizer", __func__);
+    return tokenize_scalar;
+}
+
+// returns 1 if type of the value is exactly given type, end points to the values separator
+int is_metric_type(char *type_ptr, char *end, char *type) {
+    int length = strlen(type);
+
+    return end - type_ptr - 1 >= length && memcmp(type_ptr + 1, type, length) == 0 &&
+        (type_ptr + 1 + length == end || *(type_ptr + 1 + length) == '|');
+}
+
+/* values of the line start after colon_ptr, delimiter points to the first delimiter after it
+ * and the last delimiter of the line is the terminating '\n'
+ */
+void insert_values_into_slot(struct aggregator_s *aggregator, int slot_idx, char *packet, char *colon_ptr, uint16_t *delimiter) {
+    slot_s *slot = aggregator->slots + slot_idx;
+    values_chunk_s *chunk = NULL;
+    char *buffer_ptr = colon_ptr + 1;
+    char *delimiter_ptr = colon_ptr;
+    char *target_ptr = NULL;
+    int data_length = 0;
+    char *type_ptr = NULL;
+    int metric_type = 0;
+    double counter = 0;
+    char *rate_ptr = NULL;
+    double rate = 1;
+    uint32_t sketch_offset = 0;
+
+    while (*delimiter_ptr != '\n') {
+        // value ends with ':' or '\n', the first '|' in it starts type and the second one starts rate
+        type_ptr = NULL;
+        rate_ptr = NULL;
+        for (delimiter_ptr = packet + *delimiter; *delimiter_ptr == '|'; delimiter_ptr = packet + *(++delimiter)) {
+            if (type_ptr == NULL) {
+                type_ptr = delimiter_ptr;
+            } else if (rate_ptr == NULL) {
+                rate_ptr = delimiter_ptr;
+            }
+        }
+        delimiter++;
+        data_length = delimiter_ptr - buffer_ptr + 1;
+        if (type_ptr == NULL) {
+            log_msg(ERROR, "%s: invalid metric data \"%.*s\"", __func__, data_length, buffer_ptr);
+            stat_add(STAT_INVALID_METRICS, 1);
+            buffer_ptr += data_length;
+            continue;
+        }
+        metric_type = TYPE_OTHER;
+        if (*(type_ptr + 1) == 'c') {
+            metric_type = TYPE_COUNTER;
+        } else if (is_metric_type(type_ptr, buffer_ptr + data_length - 1, "g")) {
+            metric_type = TYPE_GAUGE;
+        } else if (is_metric_type(type_ptr, buffer_ptr + data_length - 1, "s")) {
+            metric_type = TYPE_SET;
+        } else if (global.timer_aggregation == TIMER_AGGREGATION_SUMMARY && is_metric_type(type_ptr, buffer_ptr + data_length - 1, "ms")) {
+            metric_type = TYPE_TIMER;
+        }
+        if (slot->type == TYPE_UNKNOWN) {
+            slot->type = metric_type;
+        } else {
+            if (slot->type != metric_type) {
+                log_msg(ERROR, "%s: got improper metric type for \"%.*s\"", __func__, slot->name_length, ARENA_PTR(&(aggregator->names), slot->name));
+                stat_add(STAT_INVALID_METRICS, 1);
+                buffer_ptr += data_length;
+                continue;
+            }
+        }
+        log_msg(TRACE, "%s: adding \"%.*s\"", __func__, data_length, buffer_ptr);
+        if (metric_type == TYPE_COUNTER || metric_type == TYPE_TIMER) {
+            rate = 1;
+            if (rate_ptr != NULL && *(rate_ptr + 1) == '@') {
+                // rate ends right before values separator or newline
+                if (parse_number(rate_ptr + 2, buffer_ptr + data_length - 1, &rate) != 0) {
+                    log_msg(TRACE, "%s: invalid rate in counter data \"%.*s\"", __func__, data_length - 1, buffer_ptr);
+                    rate = 1;
+                }
+            }
+        }
+        if (metric_type == TYPE_GAUGE) {
+            // value with sign changes gauge, value without sign sets it
+            if (parse_number(buffer_ptr, type_ptr, &counter) != 0) {
+                log_msg(ERROR, "%s: invalid value in gauge data \"%.*s\"", __func__, data_length - 1, buffer_ptr);
+                stat_add(STAT_INVALID_METRICS, 1);
+            } else if (*buffer_ptr == '+' || *buffer_ptr == '-') {
+                slot->counter += counter;
+                slot->values_length++;
+            } else {
+                slot->counter = counter;
+                slot->flags |= SLOT_GAUGE_ABSOLUTE;
+                slot->values_length++;
+            }
+        } else if (metric_type == TYPE_SET) {
+            // sample rate doesn't matter for sets, only distinct members are kept
+            set_add_member(aggregator, slot, buffer_ptr, type_ptr - buffer_ptr);
+        } else if (metric_type == TYPE_TIMER) {
+            // timer value is added to the sketch, sampled value counts as 1 / rate values
+            if (parse_number(buffer_ptr, type_ptr, &counter) != 0) {
+                log_msg(ERROR, "%s: invalid value in timer data \"%.*s\"", __func__, data_length - 1, buffer_ptr);
+                stat_add(STAT_INVALID_METRICS, 1);
+            } else if ((sketch_offset = timer_sketch_reserve(&(aggregator->arena), slot)) != ARENA_NULL) {
+                timer_sketch_add((timer_sketch_s *)ARENA_PTR(&(aggregator->arena), sketch_offset), counter,
+                    rate > 0 && rate < 1 ? (uint32_t)(1 / rate + 0.5) : 1);
+                slot->values_length++;
+            }
+        } else if (metric_type == TYPE_COUNTER) {
+            // counter is kept as number in the slot, it is formatted on flush
+            if (parse_number(buffer_ptr, type_ptr, &counter) != 0) {
+                log_msg(ERROR, "%s: invalid value in counter data \"%.*s\"", __func__, data_length - 1, buffer_ptr);
+                stat_add(STAT_INVALID_METRICS, 1);
+            } else {
+                counter /= rate;
+                slot->counter += counter;
+                slot->values_length++;
+                log_msg(TRACE, "%s: counter delta = %.15g, counter value = %.15g", __func__, counter, slot->counter);
+            }
+        } else {
+            chunk = slot_reserve(aggregator, slot, data_length);
+            if (chunk == NULL) {
+                buffer_ptr += data_length;
+                continue;
+            }
+            target_ptr = chunk->data + chunk->length;
+            memcpy(target_ptr, buffer_ptr, data_length);
+            target_ptr += data_length;
+            *(target_ptr - 1) = ':';
+            chunk->length += data_length;
+            slot->values_length += data_length;
+        }
+        buffer_ptr += data_length;
+    }
+    log_msg(TRACE, "%s: %u bytes of values for \"%.*s\"", __func__, slot->values_length, slot->name_length, ARENA_PTR(&(aggregator->names), slot->name));
+}
+
+// function to process single metrics line, delimiter points to the first delimiter of the line in the packet index
+int process_data_line(struct aggregator_s *aggregator, char *packet, char *line, int length, uint16_t *delimiter) {
+    int slot_idx = -1;
+    char *colon_ptr = NULL;
+
+    // name ends with the first ':', it can contain '|' though
+    for (colon_ptr = packet + *delimiter; *colon_ptr == '|'; colon_ptr = packet + *(++delimiter));
+    // if ':' wasn't found this is not valid statsd metric
+    if (*colon_ptr != ':') {
+        *(line + length - 1) = 0;
+        log_msg(ERROR, "%s: invalid metric %s", __func__, line);
+        stat_add(STAT_INVALID_METRICS, 1);
+        return 1;
+    }
+    slot_idx = find_slot(aggregator, line, colon_ptr - line + 1);
+    if (slot_idx < 0) {
+        return 1;
+    }
+    log_msg(TRACE, "%s: metrics data \"%.*s\"", __func__, (int)(length - (colon_ptr - line) - 1), colon_ptr);
+    insert_values_into_slot(aggregator, slot_idx, packet, colon_ptr, delimiter + 1);
+    return 0;
+}
+
+/* function to process single packet from data socket, buffer should have one spare byte at the end.
+ * Delimiters of the whole packet are found first, line processing walks them instead of searching the lines again
+ */
+void process_data_packet(struct aggregator_s *aggregator, struct packet_index_s *index, char *buffer, ssize_t bytes_in_buffer) {
+    char *buffer_ptr = buffer;
+    char *delimiter_ptr = buffer;
+    int line_length = 0;
+    int line = 0;
+    int first_delimiter = 0;
+
+    if (buffer[bytes_in_buffer - 1] != '\n') {
+        buffer[bytes_in_buffer++] = '\n';
+    }
+    log_msg(TRACE, "%s: got packet %.*s", __func__, bytes_in_buffer, buffer);
+    global.tokenizer(buffer, bytes_in_buffer, index);
+    for (line = 0; line < index->lines_num; line++) {
+        delimiter_ptr = buffer + index->delimiters[index->lines[line]] + 1;
+        line_length = delimiter_ptr - buffer_ptr;
+        // minimum metrics line should look like X:1|c\n
+        // so lines with length less than 6 can be ignored
+        // if we've got counter like 1|c|@0.3 it would expand to 3.33333333333|c
+        // so to be on safe side let's limit maximum line length so that we would be able to fit counter in any case
+        if (line_length > 6 && line_length < (global.downstream_buf_size - MAX_COUNTER_LENGTH)) {
+            // if line has valid length let's process it
+            process_data_line(aggregator, buffer, buffer_ptr, line_length, index->delimiters + first_delimiter);
+        } else {
+            log_msg(ERROR, "%s: invalid length %d of metric %.*s", __func__, line_length - 1, line_length - 1, buffer_ptr);
+            stat_add(STAT_INVALID_METRICS, 1);
+        }
+        // this is not last metric, let's advance line start pointer
+        buffer_ptr = delimiter_ptr;
+        first_delimiter = index->lines[line] + 1;
+    }
+    stat_add(STAT_LINES_RECEIVED, index->lines_num);
+}
+
+// this function drains up to data_recv_batch_size datagrams from udp or unix socket with single recvmmsg() call
+void ingest_datagrams(struct worker_s *worker, int fd) {
+    struct ingest_s *ingest = &(worker->ingest);
+    uint64_t start = 0;
+    int packets = 0;
+    int i = 0;
+
+    // recvmmsg() overwrites msg_len only, iovecs are set up once in init_worker()
+    packets = recvmmsg(fd, ingest->msgs, global.data_recv_batch_size, MSG_DONTWAIT, NULL);
+
+    if (packets < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_msg(ERROR, "%s: recvmmsg() failed %s", __func__, strerror(errno));
+        }
+        return;
+    }
+
+    log_msg(TRACE, "%s: worker %d got %d packets", __func__, worker->id, packets);
+    // lock is contended only when aggregator is merged on flush
+    stat_add(STAT_WAKEUPS, 1);
+    stat_add(STAT_PACKETS_RECEIVED, packets);
+    pthread_mutex_lock(&(worker->lock));
+    for (i = 0; i < packets; i++) {
+        if (ingest->msgs[i].msg_len > 0) {
+            stat_add(STAT_BYTES_RECEIVED, ingest->msgs[i].msg_len);
+            start = now_ns();
+            process_data_packet(&(worker->aggregator), &(ingest->index), ingest->buffer + i * global.data_buf_size, ingest->msgs[i].msg_len);
+            histogram_add(HISTOGRAM_PARSE, now_ns() - start);
+        }
+    }
+    pthread_mutex_unlock(&(worker->lock));
+}
+
+void udp_read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    if (EV_ERROR & revents) {
+        log_msg(ERROR, "%s: invalid event %s", __func__, strerror(errno));
+        return;
+    }
+    ingest_datagrams((struct worker_s *)watcher, watcher->fd);
+}
+
+#ifdef HAVE_IO_URING
+// arms multishot receive of the data socket, it completes once for every datagram till it runs out of buffers
+void uring_arm_recv(struct worker_s *worker) {
+    struct uring_s *uring = &(worker->uring);
+    struct io_uring_sqe *sqe = uring_get_sqe(uring, ((uint64_t)uring->recv_generation << 8) | URING_OP_RECV);
+
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = worker->socket_watcher.fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    uring->recv_armed = 1;
+}
+
+// processes datagram received into the buffer and returns the buffer to the kernel
+void uring_recv_datagram(struct worker_s *worker, int bid, int length) {
+    uint64_t start = 0;
+
+    if (length > 0) {
+        stat_add(STAT_PACKETS_RECEIVED, 1);
+        stat_add(STAT_BYTES_RECEIVED, length);
+        start = now_ns();
+        process_data_packet(&(worker->aggregator), &(worker->ingest.index), worker->uring.buffers + bid * global.data_buf_size, length);
+        histogram_add(HISTOGRAM_PARSE, now_ns() - start);
+    }
+    uring_provide_buffer(&(worker->uring), bid);
+}
+
+/* processes received datagram or keeps it in its buffer if defer is set, receive is rearmed by the caller
+ * if it is over
+ */
+void uring_recv_complete(struct worker_s *worker, struct io_uring_cqe *cqe, int defer) {
+    struct uring_s *uring = &(worker->uring);
+    int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+    if ((cqe->flags & IORING_CQE_F_BUFFER) && cqe->res > 0 && defer) {
+        uring->deferred_bids[uring->deferred_num] = bid;
+        uring->deferred_lengths[uring->deferred_num++] = cqe->res;
+    } else if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uring_recv_datagram(worker, bid, cqe->res);
+    }
+    if ((cqe->flags & IORING_CQE_F_MORE) || (cqe->user_data >> 8) != uring->recv_generation) {
+        return;
+    }
+    uring->recv_armed = 0;
+    // receive stops when buffers run out or completion queue overflows, other errors are reported
+    if (cqe->res == -EINVAL) {
+        log_msg(WARN, "%s: multishot receive is not supported, worker %d reads data socket with recvmmsg()", __func__, worker->id);
+        uring->recv_disabled = 1;
+        ev_io_start(worker->loop, &(worker->socket_watcher));
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        log_msg(ERROR, "%s: recv() failed %s", __func__, strerror(-cqe->res));
+    }
+}
+
+/* reaps io_uring completions of the worker thread, returns number of completed sends. Datagrams of all reaped
+ * receives are processed under single lock, as recvmmsg() batch is. Flush sets defer while it packs the aggregator,
+ * datagrams are processed right after the flush then
+ */
+int uring_reap(struct worker_s *worker, int defer) {
+    struct uring_s *uring = &(worker->uring);
+    struct io_uring_cqe *cqe = NULL;
+    unsigned head = *(uring->cq_head);
+    unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+    int locked = 0;
+    int sends = 0;
+    int i = 0;
+
+    if (! defer && uring->deferred_num > 0) {
+        stat_add(STAT_WAKEUPS, 1);
+        pthread_mutex_lock(&(worker->lock));
+        locked = 1;
+        for (i = 0; i < uring->deferred_num; i++) {
+            uring_recv_datagram(worker, uring->deferred_bids[i], uring->deferred_lengths[i]);
+        }
+        uring->deferred_num = 0;
+    }
+    for (; head != tail; head++) {
+        cqe = uring->cqes + (head & uring->cq_mask);
+        switch (cqe->user_data & 0xff) {
+        case URING_OP_RECV:
+            // lock is contended only when aggregator is merged on flush
+            if (! locked) {
+                stat_add(STAT_WAKEUPS, 1);
+                pthread_mutex_lock(&(worker->lock));
+                locked = 1;
+            }
+            uring_recv_complete(worker, cqe, defer);
+            break;
+        case URING_OP_SEND:
+            uring_send_complete(uring, cqe);
+            sends++;
+            break;
+        }
+    }
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+    if (locked) {
+        pthread_mutex_unlock(&(worker->lock));
+    }
+    // receive would stop at once if all buffers are deferred
+    if (! uring->recv_armed && ! uring->recv_disabled && uring->deferred_num < uring->buffers_num) {
+        uring_arm_recv(worker);
+    }
+    if (uring->deferred_num > 0) {
+        ev_feed_event(worker->loop, &(uring->watcher), EV_READ);
+    }
+    return sends;
+}
+
+// flush queue gets more sends when sends complete
+void uring_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    struct worker_s *worker = (struct worker_s *)((char *)watcher - offsetof(struct worker_s, uring));
+
+    if (EV_ERROR & revents) {
+        log_msg(ERROR, "%s: invalid event %s", __func__, strerror(errno));
+        return;
+    }
+    if (uring_reap(worker, 0) > 0 && global.downstream.queue_head != NULL) {
+        downstream_flush(loop);
+    }
+    uring_submit(&(worker->uring));
+}
+
+/* called when flush queue is full. Packets of sends in flight return to the pool when sends complete, so it
+ * waits for completions as sendmmsg() would block. Returns 0 if there is nothing to wait for
+ */
+int uring_wait_sends() {
+    struct uring_s *uring = global.workers != NULL ? &(global.workers->uring) : NULL;
+
+    if (global.io_backend != IO_BACKEND_IO_URING || uring == NULL || uring->fd < 0 || uring->send_free_num == URING_SEND_SLOTS) {
+        return 0;
+    }
+    __atomic_store_n(uring->sq_tail, uring->sq_pending_tail, __ATOMIC_RELEASE);
+    if (syscall(__NR_io_uring_enter, uring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+        log_msg(ERROR, "%s: io_uring_enter() failed %s", __func__, strerror(errno));
+        return 0;
+    }
+    if (uring_reap(global.workers, 1) > 0) {
+        downstream_flush(ev_default_loop(0));
+    }
+    return 1;
+}
+
+// called in the worker thread, so that receive completions are delivered to it
+void uring_start(struct worker_s *worker) {
+    ev_io_init(&(worker->uring.watcher), uring_cb, worker->uring.fd, EV_READ);
+    ev_io_start(worker->loop, &(worker->uring.watcher));
+    uring_arm_recv(worker);
+    uring_submit(&(worker->uring));
+}
+#endif
+
+// starts reading data socket of the worker with configured io backend
+void worker_start_ingest(struct worker_s *worker) {
+#ifdef HAVE_IO_URING
+    if (worker->uring.fd >= 0) {
+        uring_start(worker);
+        return;
+    }
+#endif
+    ev_io_start(worker->loop, &(worker->socket_watcher));
+}
+
+// unix datagram socket is read by the main thread, so its data goes to worker 0
+void unix_dgram_read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    if (EV_ERROR & revents) {
+        log_msg(ERROR, "%s: invalid event %s", __func__, strerror(errno));
+        return;
+    }
+    ingest_datagrams(global.workers, watcher->fd);
+}
+
+/* creates socket of given type bound to the port on all addresses. Dual-stack socket gets both IPv6 and IPv4 data,
+ * IPv4 only is used if IPv6 is disabled. Returns -1 on error
+ */
+int bind_inet_socket(int type, int port, int reuse_port) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = 0;
+    int reuse_addr = 1;
+    int fd = -1;
+
+    bzero(&addr, sizeof(addr));
+    if ((fd = dual_stack_socket(AF_INET6, type)) >= 0) {
+        ((struct sockaddr_in6 *)&addr)->sin6_family = AF_INET6;
+        ((struct sockaddr_in6 *)&addr)->sin6_port = htons(port);
+        ((struct sockaddr_in6 *)&addr)->sin6_addr = in6addr_any;
+        addr_len = sizeof(struct sockaddr_in6);
+    } else if ((fd = dual_stack_socket(AF_INET, type)) >= 0) {
+        ((struct sockaddr_in *)&addr)->sin_family = AF_INET;
+        ((struct sockaddr_in *)&addr)->sin_port = htons(port);
+        ((struct sockaddr_in *)&addr)->sin_addr.s_addr = INADDR_ANY;
+        addr_len = sizeof(struct sockaddr_in);
+    } else {
+        log_msg(ERROR, "%s: socket() error %s", __func__, strerror(errno));
+        return -1;
+    }
+    // listening socket can be bound again while connections of previous run are in TIME_WAIT
+    if ((type & ~SOCK_NONBLOCK) == SOCK_STREAM) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(reuse_addr));
+    }
+    if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse_port, sizeof(reuse_port)) != 0) {
+        log_msg(ERROR, "%s: setsockopt() failed %s", __func__, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr*) &addr, addr_len) != 0) {
+        log_msg(ERROR, "%s: bind() to port %d failed %s", __func__, port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// this function creates data socket and allocates buffers and aggregator of the worker
+int init_worker(struct worker_s *worker, int id) {
+    struct ingest_s *ingest = &(worker->ingest);
+    int data_socket = 0;
+    int i = 0;
+
+    worker->id = id;
+    ingest->buffer = (char *)malloc(global.data_recv_batch_size * global.data_buf_size);
+    ingest->msgs = (struct mmsghdr *)calloc(global.data_recv_batch_size, sizeof(struct mmsghdr));
+    ingest->iovecs = (struct iovec *)calloc(global.data_recv_batch_size, sizeof(struct iovec));
+    if (ingest->buffer == NULL || ingest->msgs == NULL || ingest->iovecs == NULL) {
+        log_msg(ERROR, "%s: failed to allocate memory for ingest buffers", __func__);
+        return 1;
+    }
+    if (init_packet_index(&(ingest->index)) != 0) {
+        return 1;
+    }
+    for (i = 0; i < global.data_recv_batch_size; i++) {
+        // leave one byte to append '\n' if packet doesn't end with it
+        ingest->iovecs[i].iov_base = ingest->buffer + i * global.data_buf_size;
+        ingest->iovecs[i].iov_len = global.data_buf_size - 1;
+        ingest->msgs[i].msg_hdr.msg_iov = ingest->iovecs + i;
+        ingest->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    if (aggregator_init(&(worker->aggregator)) != 0) {
+        return 1;
+    }
+    if (pthread_mutex_init(&(worker->lock), NULL) != 0) {
+        log_msg(ERROR, "%s: pthread_mutex_init() failed", __func__);
+        return 1;
+    }
+    worker->uring.fd = -1;
+    if (global.io_backend == IO_BACKEND_IO_URING) {
+#ifdef HAVE_IO_URING
+        // buffers of two recvmmsg() batches, so receive doesn't stop while one batch is processed
+        for (i = 1; i < global.data_recv_batch_size * 2; i *= 2);
+        if (uring_init(&(worker->uring), i, id == 0 ? URING_SEND_SLOTS : 0) != 0) {
+            log_msg(WARN, "%s: io_uring is not available, worker %d uses libev", __func__, id);
+        }
+#else
+        log_msg(WARN, "%s: built without io_uring support, worker %d uses libev", __func__, id);
+#endif
+    }
+
+    // every worker has its own socket bound to the same port, kernel spreads packets between them
+    data_socket = bind_inet_socket(SOCK_DGRAM, global.data_port, global.workers_num > 1);
+    if (data_socket < 0) {
+        return 1;
+    }
+    ev_io_init(&(worker->socket_watcher), udp_read_cb, data_socket, EV_READ);
+    return 0;
+}
+
+// called in the worker thread when data port was changed by config reload
+void worker_new_socket_cb(struct ev_loop *loop, struct ev_async *watcher, int revents) {
+    struct worker_s *worker = (struct worker_s *)((char *)watcher - offsetof(struct worker_s, new_socket_watcher));
+    int fd = __atomic_exchange_n(&(worker->new_socket), -1, __ATOMIC_ACQ_REL);
+
+    if (fd < 0) {
+        return;
+    }
+#ifdef HAVE_IO_URING
+    if (worker->uring.fd >= 0 && ! worker->uring.recv_disabled) {
+        struct io_uring_sqe *sqe = NULL;
+
+        // completions of the old receive are not rearmed, it is cancelled before its socket is closed
+        if (worker->uring.recv_armed && (sqe = uring_get_sqe(&(worker->uring), URING_OP_CANCEL)) != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = ((uint64_t)worker->uring.recv_generation << 8) | URING_OP_RECV;
+        }
+        worker->uring.recv_generation++;
+        close(worker->socket_watcher.fd);
+        worker->socket_watcher.fd = fd;
+        uring_arm_recv(worker);
+        uring_submit(&(worker->uring));
+        return;
+    }
+#endif
+    ev_io_stop(loop, &(worker->socket_watcher));
+    close(worker->socket_watcher.fd);
+    ev_io_set(&(worker->socket_watcher), fd, EV_READ);
+    ev_io_start(loop, &(worker->socket_watcher));
+}
+
+void *worker_run(void *args) {
+    struct worker_s *worker = (struct worker_s *)args;
+
+    thread_stats = &(worker->stats);
+    worker_start_ingest(worker);
+    ev_loop(worker->loop, 0);
+    log_msg(ERROR, "%s: ev_loop() of worker %d exited", __func__, worker->id);
+    return NULL;
+}
+
+// worker 0 runs in the main thread, others get their own threads and loops
+int start_workers(struct ev_loop *loop) {
+    struct worker_s *worker = NULL;
+    int i = 0;
+
+    for (i = 0; i < global.workers_num; i++) {
+        worker = global.workers + i;
+        worker->new_socket = -1;
+        ev_async_init(&(worker->new_socket_watcher), worker_new_socket_cb);
+        if (i == 0) {
+            worker->loop = loop;
+            ev_async_start(loop, &(worker->new_socket_watcher));
+            worker_start_ingest(worker);
+            continue;
+        }
+        worker->loop = ev_loop_new(EVFLAG_AUTO);
+        if (worker->loop == NULL) {
+            log_msg(ERROR, "%s: ev_loop_new() failed", __func__);
+            return 1;
+        }
+        ev_async_start(worker->loop, &(worker->new_socket_watcher));
+        if (pthread_create(&(worker->thread), NULL, worker_run, worker) != 0) {
+            log_msg(ERROR, "%s: pthread_create() failed", __func__);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// returns stream client from the pool or newly allocated one, NULL if too many connections are open
+struct stream_client_s *stream_client_get() {
+    struct stream_client_s *client = global.free_stream_clients;
+
+    if (global.stream_clients_num == MAX_STREAM_CLIENTS) {
+        return NULL;
+    }
+    if (client != NULL) {
+        global.free_stream_clients = client->next;
+    } else {
+        client = (struct stream_client_s *)malloc(sizeof(struct stream_client_s) + global.data_buf_size);
+        if (client == NULL) {
+            log_msg(ERROR, "%s: failed to allocate memory for stream client", __func__);
+            return NULL;
+        }
+    }
+    global.stream_clients_num++;
+    client->next = NULL;
+    client->length = 0;
+    client->skip_line = 0;
+    return client;
+}
+
+void stream_client_close(struct ev_loop *loop, struct stream_client_s *client) {
+    ev_io_stop(loop, &(client->watcher));
+    close(client->watcher.fd);
+    global.stream_clients_num--;
+    client->next = global.free_stream_clients;
+    global.free_stream_clients = client;
+}
+
+// complete lines are processed as single packet, incomplete one is moved to the start of the buffer
+void stream_read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    struct stream_client_s *client = (struct stream_client_s *)watcher;
+    struct worker_s *worker = global.workers;
+    char *data = client->buffer;
+    char *end = NULL;
+    char *eol = NULL;
+    uint64_t start = 0;
+    int remaining = 0;
+    // one byte is left to append '\n' to the last line on close
+    ssize_t n = read(watcher->fd, client->buffer + client->length, global.data_buf_size - 1 - client->length);
+
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return;
+        }
+        log_msg(WARN, "%s: read() failed %s", __func__, strerror(errno));
+        stream_client_close(loop, client);
+        return;
+    }
+    if (n == 0) {
+        // last line may come without '\n'
+        if (client->length > 0 && ! client->skip_line) {
+            pthread_mutex_lock(&(worker->lock));
+            process_data_packet(&(worker->aggregator), &(worker->ingest.index), client->buffer, client->length);
+            pthread_mutex_unlock(&(worker->lock));
+        }
+        stream_client_close(loop, client);
+        return;
+    }
+    stat_add(STAT_BYTES_RECEIVED, n);
+    client->length += n;
+    end = client->buffer + client->length;
+    if (client->skip_line) {
+        eol = memchr(data, '\n', client->length);
+        if (eol == NULL) {
+            client->length = 0;
+            return;
+        }
+        data = eol + 1;
+        client->skip_line = 0;
+    }
+    eol = memrchr(data, '\n', end - data);
+    if (eol != NULL) {
+        start = now_ns();
+        pthread_mutex_lock(&(worker->lock));
+        process_data_packet(&(worker->aggregator), &(worker->ingest.index), data, eol - data + 1);
+        pthread_mutex_unlock(&(worker->lock));
+        histogram_add(HISTOGRAM_PARSE, now_ns() - start);
+        data = eol + 1;
+    }
+    remaining = end - data;
+    if (remaining == global.data_buf_size - 1) {
+        log_msg(ERROR, "%s: metric is longer than %d bytes %.32s", __func__, global.data_buf_size - 1, data);
+        stat_add(STAT_INVALID_METRICS, 1);
+        client->skip_line = 1;
+        remaining = 0;
+    }
+    memmove(client->buffer, data, remaining);
+    client->length = remaining;
+}
+
+// the same callback accepts tcp and unix stream connections
+void stream_accept_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    struct stream_client_s *client = NULL;
+    int client_fd = accept4(watcher->fd, NULL, NULL, SOCK_NONBLOCK);
+
+    if (client_fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            log_msg(WARN, "%s: accept() failed %s", __func__, strerror(errno));
+        }
+        return;
+    }
+    client = stream_client_get();
+    if (client == NULL) {
+        log_msg(WARN, "%s: more than %d connections, closing new one", __func__, MAX_STREAM_CLIENTS);
+        close(client_fd);
+        return;
+    }
+    ev_io_init(&(client->watcher), stream_read_cb, client_fd, EV_READ);
+    ev_io_start(loop, &(client->watcher));
+}
+
+// creates unix socket of given type, stale socket file left by previous run is removed. Returns -1 on error
+int bind_unix_socket(int type, char *path) {
+    struct sockaddr_un addr;
+    int fd = -1;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_msg(ERROR, "%s: socket path %s is too long", __func__, path);
+        return -1;
+    }
+    fd = socket(AF_UNIX, type | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        log_msg(ERROR, "%s: socket() failed %s", __func__, strerror(errno));
+        return -1;
+    }
+    bzero(&addr, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        log_msg(ERROR, "%s: bind() to %s failed %s", __func__, path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// starts accepting connections on the socket, it is closed on error
+int start_stream_listener(struct ev_loop *loop, struct ev_io *watcher, int fd) {
+    if (listen(fd, SOMAXCONN) != 0) {
+        log_msg(ERROR, "%s: listen() failed %s", __func__, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    ev_io_init(watcher, stream_accept_cb, fd, EV_READ);
+    ev_io_start(loop, watcher);
+    return 0;
+}
+
+// stops listener and closes its socket, open connections are not affected
+void stop_listener(struct ev_loop *loop, struct ev_io *watcher) {
+    if (ev_is_active(watcher)) {
+        ev_io_stop(loop, watcher);
+        close(watcher->fd);
+    }
+}
+
+int init_tcp_listener(struct ev_loop *loop) {
+    int fd = -1;
+
+    if (global.tcp_port == 0) {
+        return 0;
+    }
+    if ((fd = bind_inet_socket(SOCK_STREAM | SOCK_NONBLOCK, global.tcp_port, 0)) < 0) {
+        return 1;
+    }
+    return start_stream_listener(loop, &(global.tcp_watcher), fd);
+}
+
+int init_unix_stream_listener(struct ev_loop *loop) {
+    int fd = -1;
+
+    if (global.unix_stream_socket == NULL) {
+        return 0;
+    }
+    if ((fd = bind_unix_socket(SOCK_STREAM, global.unix_stream_socket)) < 0) {
+        return 1;
+    }
+    return start_stream_listener(loop, &(global.unix_stream_watcher), fd);
+}
+
+int init_unix_dgram_listener(struct ev_loop *loop) {
+    int fd = -1;
+
+    if (global.unix_dgram_socket == NULL) {
+        return 0;
+    }
+    if ((fd = bind_unix_socket(SOCK_DGRAM, global.unix_dgram_socket)) < 0) {
+        return 1;
+    }
+    ev_io_init(&(global.unix_dgram_watcher), unix_dgram_read_cb, fd, EV_READ);
+    ev_io_start(loop, &(global.unix_dgram_watcher));
+    return 0;
+}
+
+// this function starts tcp and unix socket listeners which are enabled in config
+int init_listeners(struct ev_loop *loop) {
+    return init_tcp_listener(loop) || init_unix_stream_listener(loop) || init_unix_dgram_listener(loop);
+}
+
+// this function logs how many packets were processed per udp_read_cb() call since last flush
+void log_ingest_stats(struct stats_s *stats) {
+    unsigned long wakeups = stats->counters[STAT_WAKEUPS] - global.stats_flushed.counters[STAT_WAKEUPS];
+    unsigned long packets = stats->counters[STAT_PACKETS_RECEIVED] - global.stats_flushed.counters[STAT_PACKETS_RECEIVED];
+
+    if (wakeups == 0) {
+        return;
+    }
+    log_msg(DEBUG, "%s: %lu packets in %lu wakeups, %.2f packets per wakeup",
+        __func__, packets, wakeups, (double)packets / wakeups);
+}
+
+// returns number of healthy downstream hosts
+int downstream_hosts_alive() {
+    struct downstream_host_s *host = NULL;
+    int alive = 0;
+
+    for (host = global.downstream.downstream_hosts; host != NULL; host = host->next) {
+        alive += host->health_client.alive;
+    }
+    return alive;
+}
+
+// logs how many metrics every name_limit prefix shed during the interval
+void log_name_limits(struct aggregator_s *aggregator) {
+    struct name_limit_usage_s *usage = NULL;
+    int i = 0;
+
+    for (i = 0; i < global.name_limits_num; i++) {
+        usage = aggregator->name_limits + i;
+        if (usage->shed == 0) {
+            continue;
+        }
+        log_msg(WARN, "%s: %lu metrics of about %.0f names over limit %d of prefix \"%.*s\" were %s", __func__, usage->shed,
+            usage->shed_names != ARENA_NULL ? hll_estimate((uint8_t *)ARENA_PTR(&(aggregator->arena), usage->shed_names)) : 0.0,
+            global.name_limits[i].limit, global.name_limits[i].prefix_length, global.name_limits[i].prefix,
+            global.name_limit_policy == NAME_LIMIT_DROP ? "dropped" : "rolled up");
+    }
+}
 
-    if (EV_ERROR & revents) {
-        log_msg(ERROR, "%s: invalid event %s", __func__, strerror(errno));
+// adds single self-metric line to the aggregator
+void add_self_metric_line(struct aggregator_s *aggregator, struct packet_index_s *index, char *line, int length) {
+    // index is sized for data packets, so is the line
+    if (length >= global.data_buf_size) {
+        log_msg(ERROR, "%s: self-metric is longer than %d bytes %.32s", __func__, global.data_buf_size - 1, line);
         return;
     }
+    global.tokenizer(line, length, index);
+    process_data_line(aggregator, line, line, length, index->delimiters);
+}
 
-    bytes_in_buffer = recv(watcher->fd, buffer, DATA_BUF_SIZE - 1, 0);
+// adds self-metrics collected since the last flush to the aggregator
+void add_self_metrics(struct aggregator_s *aggregator, struct packet_index_s *index, struct stats_s *stats) {
+    char line[DATA_BUF_SIZE];
+    unsigned long histogram[HISTOGRAM_BUCKETS];
+    int length = 0;
+    int i = 0;
+    int j = 0;
 
-    if (bytes_in_buffer < 0) {
-        log_msg(ERROR, "%s: read() failed %s", __func__, strerror(errno));
-        return;
+    for (i = 0; i < STATS_NUM; i++) {
+        if (stats->counters[i] == global.stats_flushed.counters[i]) {
+            continue;
+        }
+        length = snprintf(line, DATA_BUF_SIZE, "%s%s:%lu|c\n", global.self_metrics_prefix, stat_name(i),
+            stats->counters[i] - global.stats_flushed.counters[i]);
+        add_self_metric_line(aggregator, index, line, length);
     }
-
-    if (bytes_in_buffer > 0) {
-        if (buffer[bytes_in_buffer - 1] != '\n') {
-            buffer[bytes_in_buffer++] = '\n';
+    for (i = 0; i < HISTOGRAMS_NUM; i++) {
+        for (j = 0; j < HISTOGRAM_BUCKETS; j++) {
+            histogram[j] = stats->histograms[i][j] - global.stats_flushed.histograms[i][j];
         }
-        log_msg(TRACE, "%s: got packet %.*s", __func__, bytes_in_buffer, buffer);
-        while ((delimiter_ptr = memchr(buffer_ptr, '\n', bytes_in_buffer)) != NULL) {
-            delimiter_ptr++;
-            line_length = delimiter_ptr - buffer_ptr;
-            // minimum metrics line should look like X:1|c\n
-            // so lines with length less than 6 can be ignored
-            // if we've got counter like 1|c|@0.3 it would expand to 3.33333333333|c
-            // so to be on safe side let's limit maximum line length so that we would be able to fit counter in any case
-            if (line_length > 6 && line_length < (DOWNSTREAM_BUF_SIZE - MAX_COUNTER_LENGTH)) {
-                // if line has valid length let's process it
-                process_data_line(buffer_ptr, line_length);
-            } else {
-                log_msg(ERROR, "%s: invalid length %d of metric %.*s", __func__, line_length - 1, line_length - 1, buffer_ptr);
-            }
-            // this is not last metric, let's advance line start pointer
-            buffer_ptr = delimiter_ptr;
-            bytes_in_buffer -= line_length;
+        if (histogram_count(histogram) == 0) {
+            continue;
         }
+        length = snprintf(line, DATA_BUF_SIZE, "%s%s_p50_us:%g|g\n", global.self_metrics_prefix, histogram_name(i), histogram_percentile(histogram, 50));
+        add_self_metric_line(aggregator, index, line, length);
+        length = snprintf(line, DATA_BUF_SIZE, "%s%s_p99_us:%g|g\n", global.self_metrics_prefix, histogram_name(i), histogram_percentile(histogram, 99));
+        add_self_metric_line(aggregator, index, line, length);
+    }
+    length = snprintf(line, DATA_BUF_SIZE, "%sslots_used:%d|g\n", global.self_metrics_prefix, global.slots_used);
+    add_self_metric_line(aggregator, index, line, length);
+    length = snprintf(line, DATA_BUF_SIZE, "%sflush_queue_length:%d|g\n", global.self_metrics_prefix, global.downstream.queue_length);
+    add_self_metric_line(aggregator, index, line, length);
+    length = snprintf(line, DATA_BUF_SIZE, "%sdownstream_hosts_alive:%d|g\n", global.self_metrics_prefix, downstream_hosts_alive());
+    add_self_metric_line(aggregator, index, line, length);
+    if (global.spool.map != NULL) {
+        length = snprintf(line, DATA_BUF_SIZE, "%sspool_bytes:%lu|g\n", global.self_metrics_prefix, spool_bytes());
+        add_self_metric_line(aggregator, index, line, length);
     }
 }
 
-// this function cycles through downstreams and flushes them on scheduled basis
+// this function collects data from all workers and flushes it on scheduled basis
 void downstream_flush_timer_cb(struct ev_loop *loop, struct ev_periodic *p, int revents) {
-    if (global.downstream.active_buffer_length > 0) {
-        downstream_schedule_flush();
+    uint64_t start = now_ns();
+    struct aggregator_s *aggregator = &(global.workers->aggregator);
+    struct worker_s *worker = NULL;
+    struct stats_s stats;
+    int i = 0;
+
+    /* data of other workers is merged into the aggregator of worker 0, so that each name is sent once.
+     * Worker 0 runs in this thread, other workers wait only while their own data is merged
+     */
+    for (i = 1; i < global.workers_num; i++) {
+        worker = global.workers + i;
+        pthread_mutex_lock(&(worker->lock));
+        aggregator_merge(aggregator, &(worker->aggregator));
+        aggregator_reset(&(worker->aggregator));
+        pthread_mutex_unlock(&(worker->lock));
+    }
+    global.slots_used = aggregator->slots_active;
+    stats_collect(&stats);
+    log_ingest_stats(&stats);
+    log_name_limits(aggregator);
+    if (global.self_metrics_prefix != NULL) {
+        aggregator->self_metrics = 1;
+        add_self_metrics(aggregator, &(global.workers->ingest.index), &stats);
+        aggregator->self_metrics = 0;
+    }
+    memcpy(&(global.stats_flushed), &stats, sizeof(stats));
+    if (aggregator->slots_active > 0) {
+        downstream_schedule_flush(aggregator);
     }
+    aggregator_reset(aggregator);
+    global.slots_interned = aggregator->slots_used;
+    stat_add(STAT_FLUSHES, 1);
+    histogram_add(HISTOGRAM_FLUSH, now_ns() - start);
 }
 
-void get_dns_data() {
+// resolves downstream host name, returns NULL if it failed. Function is called by resolver thread
+struct dns_result_s *dns_resolve(char *name) {
+    struct dns_result_s *result = NULL;
+    struct addrinfo hints;
+    struct addrinfo *addrs = NULL;
+    struct addrinfo *addr = NULL;
+    struct sockaddr_storage *sa = NULL;
+    int error = 0;
     int i = 0;
-    struct in_addr *addr = NULL;
-    struct hostent *he = gethostbyname(global.downstream.data_host);
 
-    if (he == NULL || he->h_addr_list == NULL || (he->h_addr_list)[0] == NULL ) {
-        log_msg(ERROR, "%s: gethostbyname() failed %s", __func__, strerror(errno));
-        return;
+    // both A and AAAA records are used, addresses which can't be reached are marked down by health checks
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    error = getaddrinfo(name, NULL, &hints, &addrs);
+    if (error != 0) {
+        log_msg(ERROR, "%s: getaddrinfo() failed %s", __func__, gai_strerror(error));
+        return NULL;
+    }
+    result = (struct dns_result_s *)calloc(1, sizeof(struct dns_result_s));
+    if (result == NULL) {
+        log_msg(ERROR, "%s: failed to allocate memory for dns result", __func__);
+        freeaddrinfo(addrs);
+        return NULL;
     }
-    for (i = 0; i < MAX_DOWNSTREAM_NUM && he->h_addr_list[i] != NULL; i++) {
-        addr = global.downstream.in_addr_new + i;
-        memcpy(addr, he->h_addr_list[i], he->h_length);
-        log_msg(DEBUG, "%s: %s", __func__, inet_ntoa(*(struct in_addr *)(he->h_addr_list[i])));
+    for (addr = addrs; addr != NULL && result->addrs_num < MAX_DOWNSTREAM_NUM; addr = addr->ai_next) {
+        if (addr->ai_family != AF_INET && addr->ai_family != AF_INET6) {
+            continue;
+        }
+        sa = result->addrs + result->addrs_num;
+        memcpy(sa, addr->ai_addr, addr->ai_addrlen);
+        for (i = 0; i < result->addrs_num && ! address_equal(result->addrs + i, sa); i++);
+        if (i == result->addrs_num) {
+            result->addrs_num++;
+            log_msg(DEBUG, "%s: %s", __func__, address_string(sa));
+        }
     }
-    global.downstream.downstream_host_num = i;
-    global.downstream.in_addr_new_ready = 1;
+    freeaddrinfo(addrs);
+    return result;
 }
 
-// function to init downstream from config file line
-int init_downstream(char *hosts) {
+// returns the smallest TTL of records of given type or 0 if it is not known, e.g. name comes from /etc/hosts
+unsigned int dns_record_ttl(char *name, int type) {
+    unsigned char answer[DNS_ANSWER_BUF_SIZE];
+    unsigned int ttl = 0;
+    ns_msg msg;
+    ns_rr rr;
+    int length = res_query(name, ns_c_in, type, answer, sizeof(answer));
     int i = 0;
-    char *host = hosts;
+
+    if (length < 0 || ns_initparse(answer, length, &msg) != 0) {
+        return 0;
+    }
+    for (i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+        if (ns_parserr(&msg, ns_s_an, i, &rr) == 0 && ns_rr_type(rr) == type && (ttl == 0 || ns_rr_ttl(rr) < ttl)) {
+            ttl = ns_rr_ttl(rr);
+        }
+    }
+    return ttl;
+}
+
+// returns the smallest TTL of A and AAAA records of the name or 0 if it is not known
+unsigned int dns_ttl(char *name) {
+    unsigned int ttl = dns_record_ttl(name, ns_t_a);
+    unsigned int ttl6 = dns_record_ttl(name, ns_t_aaaa);
+
+    return ttl == 0 || (ttl6 > 0 && ttl6 < ttl) ? ttl6 : ttl;
+}
+
+// puts new result into the handoff slot, result the loop didn't pick up yet is replaced
+void dns_result_put(struct dns_result_s *result) {
+    struct dns_result_s *old = __atomic_exchange_n(&(global.downstream.dns_result), result, __ATOMIC_ACQ_REL);
+
+    free(old);
+}
+
+// takes result from the handoff slot, returns NULL if there is no new one
+struct dns_result_s *dns_result_take() {
+    return __atomic_exchange_n(&(global.downstream.dns_result), NULL, __ATOMIC_ACQ_REL);
+}
+
+/* parses downstream config line of host:data_port:health_port format, line isn't modified.
+ * Host is returned in newly allocated string
+ */
+int parse_downstream(char *line, char **host, int *data_port, int *health_port) {
+    char *name = strdup(line);
     char *data_port_s = NULL;
     char *health_port_s = NULL;
-    int host_len = 0;
 
-    // argument line has the following format: host:data_port
+    // ports are looked up from the end since IPv6 address has colons too
+    health_port_s = strrchr(name, ':');
+    if (health_port_s == NULL) {
+        log_msg(ERROR, "%s: no data port for %s", __func__, name);
+        free(name);
+        return 1;
+    }
+    *health_port_s++ = 0;
+    data_port_s = strrchr(name, ':');
+    if (data_port_s == NULL) {
+        log_msg(ERROR, "%s: no health port for %s", __func__, name);
+        free(name);
+        return 1;
+    }
+    *data_port_s++ = 0;
+    // IPv6 address can be in brackets, e.g. [::1]:8125:8126
+    if (*name == '[' && *(data_port_s - 2) == ']') {
+        *(data_port_s - 2) = 0;
+        *host = strdup(name + 1);
+    } else {
+        *host = strdup(name);
+    }
+    *data_port = atoi(data_port_s);
+    *health_port = atoi(health_port_s);
+    free(name);
+    return 0;
+}
+
+// function to init downstream from config file line
+int init_downstream(char *hosts) {
     // now let's initialize downstreams
     global.downstream.packets_sent = 0;
-    global.downstream.slots_used = 0;
     global.downstream.downstream_host_num = 0;
     global.downstream.downstream_hosts = NULL;
     global.downstream.current_downstream_host = NULL;
-    global.downstream.active_buffer_idx = 0;
-    global.downstream.active_buffer = global.downstream.buffer;
-    global.downstream.active_buffer_length = 0;
-    global.downstream.flush_buffer_idx = 0;
-    global.downstream.flush_watcher.fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);;
-    if (global.downstream.flush_watcher.fd < 0) {
-        log_msg(ERROR, "%s: socket() failed %s", __func__, strerror(errno));
+    global.downstream.ring_size = 0;
+    global.downstream.packet_hash = 0;
+    global.downstream.slot_hashes = NULL;
+    global.downstream.slot_hosts = NULL;
+    global.downstream.slot_order = NULL;
+    global.downstream.slot_buffers_size = 0;
+    global.downstream.queue_head = NULL;
+    global.downstream.queue_tail = NULL;
+    global.downstream.queue_length = 0;
+    global.downstream.free_packets = NULL;
+    global.downstream.packets_allocated = 0;
+    global.downstream.active_packet = downstream_get_packet();
+    if (global.downstream.active_packet == NULL) {
         return 1;
     }
-    for (i = 0; i < DOWNSTREAM_BUF_NUM; i++) {
-        global.downstream.buffer_length[i] = 0;
+    // dual-stack socket can send to both IPv6 and IPv4 hosts
+    global.downstream.flush_family = AF_INET6;
+    global.downstream.flush_watcher.fd = dual_stack_socket(AF_INET6, SOCK_DGRAM);
+    if (global.downstream.flush_watcher.fd < 0) {
+        global.downstream.flush_family = AF_INET;
+        global.downstream.flush_watcher.fd = dual_stack_socket(AF_INET, SOCK_DGRAM);
     }
-    data_port_s = strchr(host, ':');
-    if (data_port_s == NULL) {
-        log_msg(ERROR, "%s: no data port for %s", __func__, host);
+    if (global.downstream.flush_watcher.fd < 0) {
+        log_msg(ERROR, "%s: socket() failed %s", __func__, strerror(errno));
         return 1;
     }
-    *data_port_s++ = 0;
-    host_len = data_port_s - host;
-    global.downstream.data_host = (char *)malloc(host_len);
-    memcpy(global.downstream.data_host, host, host_len);
-    health_port_s = strchr(data_port_s, ':');
-    if (health_port_s == NULL) {
-        log_msg(ERROR, "%s: no health port for %s", __func__, host);
+    if (parse_downstream(hosts, &(global.downstream.data_host), &(global.downstream.data_port), &(global.downstream.health_port)) != 0) {
         return 1;
     }
-    *health_port_s++ = 0;
-    global.downstream.data_port = atoi(data_port_s);
-    global.downstream.health_port = atoi(health_port_s);
-    global.downstream.in_addr_new_ready = 0;
-    get_dns_data();
-    if (global.downstream.in_addr_new_ready != 1) {
+    // the first result is picked up by update_downstreams() once the loop is running
+    global.downstream.dns_result = dns_resolve(global.downstream.data_host);
+    if (global.downstream.dns_result == NULL) {
         log_msg(ERROR, "%s: failed to retrieve downstream hosts", __func__);
         return 1;
     }
     return 0;
 }
 
+// parses comma separated list of percentiles e.g. "50,90,99.9"
+int parse_timer_percentiles(struct global_s *config, char *list) {
+    char *ptr = list;
+    char *endptr = NULL;
+    double percentile = 0;
+
+    config->timer_percentiles_num = 0;
+    while (*ptr != 0) {
+        percentile = strtod(ptr, &endptr);
+        if (endptr == ptr || (*endptr != ',' && *endptr != 0) || percentile <= 0 || percentile > 100) {
+            log_msg(ERROR, "%s: invalid percentile in \"%s\"", __func__, list);
+            return 1;
+        }
+        if (config->timer_percentiles_num == MAX_TIMER_PERCENTILES) {
+            log_msg(ERROR, "%s: more than %d percentiles in \"%s\"", __func__, MAX_TIMER_PERCENTILES, list);
+            return 1;
+        }
+        config->timer_percentiles[config->timer_percentiles_num++] = percentile;
+        ptr = (*endptr == ',') ? endptr + 1 : endptr;
+    }
+    return 0;
+}
+
+// parses comma separated list of prefix:limit pairs e.g. "api.:1000,:20000", empty prefix matches every name
+int parse_name_limits(struct global_s *config, char *list) {
+    struct name_limit_s *limit = NULL;
+    char *ptr = list;
+    char *colon_ptr = NULL;
+    char *endptr = NULL;
+
+    memset(config->name_limits, 0, sizeof(config->name_limits));
+    config->name_limits_num = 0;
+    while (*ptr != 0) {
+        colon_ptr = strchr(ptr, ':');
+        if (colon_ptr == NULL) {
+            log_msg(ERROR, "%s: name_limit should be prefix:limit in \"%s\"", __func__, list);
+            return 1;
+        }
+        if (config->name_limits_num == MAX_NAME_LIMITS) {
+            log_msg(ERROR, "%s: more than %d prefixes in \"%s\"", __func__, MAX_NAME_LIMITS, list);
+            return 1;
+        }
+        limit = config->name_limits + config->name_limits_num;
+        limit->prefix_length = colon_ptr - ptr;
+        if (limit->prefix_length >= MAX_NAME_LIMIT_PREFIX_LENGTH || memchr(ptr, ',', limit->prefix_length) != NULL) {
+            log_msg(ERROR, "%s: invalid prefix in \"%s\"", __func__, list);
+            return 1;
+        }
+        limit->limit = strtol(colon_ptr + 1, &endptr, 10);
+        if (endptr == colon_ptr + 1 || (*endptr != ',' && *endptr != 0) || limit->limit < 1) {
+            log_msg(ERROR, "%s: invalid limit in \"%s\"", __func__, list);
+            return 1;
+        }
+        memcpy(limit->prefix, ptr, limit->prefix_length);
+        memcpy(limit->overflow_name, ptr, limit->prefix_length);
+        memcpy(limit->overflow_name + limit->prefix_length, NAME_LIMIT_OVERFLOW_SUFFIX, sizeof(NAME_LIMIT_OVERFLOW_SUFFIX));
+        limit->overflow_length = limit->prefix_length + sizeof(NAME_LIMIT_OVERFLOW_SUFFIX) - 1;
+        config->name_limits_num++;
+        ptr = (*endptr == ',') ? endptr + 1 : endptr;
+    }
+    return 0;
+}
+
 // function to parse single line from config file
-int process_config_line(char *line) {
+// config fields of global structure are used as config object, so reloaded config can be compared with current one
+int process_config_line(struct global_s *config, char *line) {
     // valid line should contain '=' symbol
     char *value_ptr = strchr(line, '=');
     if (value_ptr == NULL) {
@@ -549,17 +4380,138 @@ int process_config_line(char *line) {
     }
     *value_ptr++ = 0;
     if (strcmp("data_port", line) == 0) {
-        global.data_port = atoi(value_ptr);
+        config->data_port = atoi(value_ptr);
     } else if (strcmp("downstream_flush_interval", line) == 0) {
-        global.downstream_flush_interval = atof(value_ptr);
+        config->downstream_flush_interval = atof(value_ptr);
     } else if (strcmp("log_level", line) == 0) {
-        global.log_level = atoi(value_ptr);
+        config->log_level = atoi(value_ptr);
+    } else if (strcmp("tcp_port", line) == 0) {
+        config->tcp_port = atoi(value_ptr);
+    } else if (strcmp("unix_dgram_socket", line) == 0) {
+        config->unix_dgram_socket = strdup(value_ptr);
+    } else if (strcmp("unix_stream_socket", line) == 0) {
+        config->unix_stream_socket = strdup(value_ptr);
+    } else if (strcmp("admin_port", line) == 0) {
+        config->admin_port = atoi(value_ptr);
+    } else if (strcmp("self_metrics_prefix", line) == 0) {
+        config->self_metrics_prefix = strdup(value_ptr);
+    } else if (strcmp("timer_aggregation", line) == 0) {
+        if (strcmp("raw", value_ptr) == 0) {
+            config->timer_aggregation = TIMER_AGGREGATION_RAW;
+        } else if (strcmp("summary", value_ptr) == 0) {
+            config->timer_aggregation = TIMER_AGGREGATION_SUMMARY;
+        } else {
+            log_msg(ERROR, "%s: timer_aggregation should be raw or summary", __func__);
+            return 1;
+        }
+    } else if (strcmp("downstream_routing", line) == 0) {
+        if (strcmp("round_robin", value_ptr) == 0) {
+            config->downstream_routing = ROUTING_ROUND_ROBIN;
+        } else if (strcmp("consistent_hash", value_ptr) == 0) {
+            config->downstream_routing = ROUTING_CONSISTENT_HASH;
+        } else {
+            log_msg(ERROR, "%s: downstream_routing should be round_robin or consistent_hash", __func__);
+            return 1;
+        }
+    } else if (strcmp("downstream_protocol", line) == 0) {
+        if (strcmp("udp", value_ptr) == 0) {
+            config->downstream_protocol = PROTOCOL_UDP;
+        } else if (strcmp("tcp", value_ptr) == 0) {
+            config->downstream_protocol = PROTOCOL_TCP;
+        } else {
+            log_msg(ERROR, "%s: downstream_protocol should be udp or tcp", __func__);
+            return 1;
+        }
+    } else if (strcmp("set_hll_threshold", line) == 0) {
+        config->set_hll_threshold = atoi(value_ptr);
+    } else if (strcmp("io_backend", line) == 0) {
+        if (strcmp("libev", value_ptr) == 0) {
+            config->io_backend = IO_BACKEND_LIBEV;
+        } else if (strcmp("io_uring", value_ptr) == 0) {
+            config->io_backend = IO_BACKEND_IO_URING;
+        } else {
+            log_msg(ERROR, "%s: io_backend should be libev or io_uring", __func__);
+            return 1;
+        }
+    } else if (strcmp("name_limit", line) == 0) {
+        return parse_name_limits(config, value_ptr);
+    } else if (strcmp("name_limit_policy", line) == 0) {
+        if (strcmp("rollup", value_ptr) == 0) {
+            config->name_limit_policy = NAME_LIMIT_ROLLUP;
+        } else if (strcmp("drop", value_ptr) == 0) {
+            config->name_limit_policy = NAME_LIMIT_DROP;
+        } else {
+            log_msg(ERROR, "%s: name_limit_policy should be rollup or drop", __func__);
+            return 1;
+        }
+    } else if (strcmp("name_idle_intervals", line) == 0) {
+        config->name_idle_intervals = atoi(value_ptr);
+        if (config->name_idle_intervals < 1) {
+            log_msg(ERROR, "%s: name_idle_intervals should be positive", __func__);
+            return 1;
+        }
+    } else if (strcmp("timer_percentiles", line) == 0) {
+        return parse_timer_percentiles(config, value_ptr);
+    } else if (strcmp("log_rate_limit", line) == 0) {
+        config->log_rate_limit = atoi(value_ptr);
     } else if (strcmp("dns_refresh_interval", line) == 0) {
-        global.dns_refresh_interval = atoi(value_ptr);
+        config->dns_refresh_interval = atoi(value_ptr);
     } else if (strcmp("downstream_health_check_interval", line) == 0) {
-        global.downstream_health_check_interval = atof(value_ptr);
+        config->downstream_health_check_interval = atof(value_ptr);
+    } else if (strcmp("data_recv_batch_size", line) == 0) {
+        config->data_recv_batch_size = atoi(value_ptr);
+        if (config->data_recv_batch_size < 1 || config->data_recv_batch_size > MAX_DATA_RECV_BATCH_SIZE) {
+            log_msg(ERROR, "%s: data_recv_batch_size should be between 1 and %d", __func__, MAX_DATA_RECV_BATCH_SIZE);
+            return 1;
+        }
+    } else if (strcmp("data_buf_size", line) == 0) {
+        config->data_buf_size = atoi(value_ptr);
+        if (config->data_buf_size < MIN_DATA_BUF_SIZE || config->data_buf_size > MAX_DATA_BUF_SIZE) {
+            log_msg(ERROR, "%s: data_buf_size should be between %d and %d", __func__, MIN_DATA_BUF_SIZE, MAX_DATA_BUF_SIZE);
+            return 1;
+        }
+    } else if (strcmp("downstream_buf_size", line) == 0) {
+        config->downstream_buf_size = atoi(value_ptr);
+        if (config->downstream_buf_size < MIN_DOWNSTREAM_BUF_SIZE || config->downstream_buf_size > MAX_DOWNSTREAM_BUF_SIZE) {
+            log_msg(ERROR, "%s: downstream_buf_size should be between %d and %d", __func__, MIN_DOWNSTREAM_BUF_SIZE, MAX_DOWNSTREAM_BUF_SIZE);
+            return 1;
+        }
+    } else if (strcmp("workers", line) == 0) {
+        config->workers_num = atoi(value_ptr);
+        if (config->workers_num < 1 || config->workers_num > MAX_WORKERS_NUM) {
+            log_msg(ERROR, "%s: workers should be between 1 and %d", __func__, MAX_WORKERS_NUM);
+            return 1;
+        }
+    } else if (strcmp("downstream_queue_size", line) == 0) {
+        config->downstream_queue_size = atoi(value_ptr);
+    } else if (strcmp("downstream_queue_drop_policy", line) == 0) {
+        if (strcmp("oldest", value_ptr) == 0) {
+            config->downstream_queue_drop_policy = DROP_OLDEST;
+        } else if (strcmp("newest", value_ptr) == 0) {
+            config->downstream_queue_drop_policy = DROP_NEWEST;
+        } else {
+            log_msg(ERROR, "%s: downstream_queue_drop_policy should be oldest or newest", __func__);
+            return 1;
+        }
+    } else if (strcmp("spool_file", line) == 0) {
+        free(config->spool_file);
+        config->spool_file = strdup(value_ptr);
+    } else if (strcmp("spool_size", line) == 0) {
+        config->spool_size = strtoull(value_ptr, NULL, 10);
+        if (config->spool_size < MIN_SPOOL_SIZE) {
+            log_msg(ERROR, "%s: spool_size should be at least %d", __func__, MIN_SPOOL_SIZE);
+            return 1;
+        }
+    } else if (strcmp("spool_drain_rate", line) == 0) {
+        config->spool_drain_rate = atoi(value_ptr);
+        if (config->spool_drain_rate < 1) {
+            log_msg(ERROR, "%s: spool_drain_rate should be positive", __func__);
+            return 1;
+        }
     } else if (strcmp("downstream", line) == 0) {
-        return init_downstream(value_ptr);
+        // downstream is initialized when the whole config is read, since buffer and queue sizes can follow it
+        free(config->downstream_config);
+        config->downstream_config = strdup(value_ptr);
     } else {
         log_msg(ERROR, "%s: unknown parameter \"%s\"", __func__, line);
         return 1;
@@ -567,26 +4519,46 @@ int process_config_line(char *line) {
     return 0;
 }
 
-// this function is called if SIGHUP is received
-void on_sighup(int sig) {
-    log_msg(INFO, "%s: sighup received", __func__);
-}
-
 void on_sigint(int sig) {
     log_msg(INFO, "%s: sigint received", __func__);
     exit(0);
 }
 
-// this function loads config file and initializes config fields
-int init_config(char *filename) {
+// this function loads config file into config fields of given structure, other fields are not touched
+int init_config(char *filename, struct global_s *config) {
     size_t n = 0;
     int l = 0;
     int failures = 0;
     char *buffer = NULL;
 
-    global.log_level = DEFAULT_LOG_LEVEL;
-    global.dns_refresh_interval = DEFAULT_DNS_REFRESH_INTERVAL;
-    global.downstream_health_check_interval = DEFAULT_DOWNSTREAM_HEALTHCHECK_INTERVAL;
+    config->log_level = DEFAULT_LOG_LEVEL;
+    config->log_rate_limit = DEFAULT_LOG_RATE_LIMIT;
+    config->admin_port = 0;
+    config->tcp_port = 0;
+    config->unix_dgram_socket = NULL;
+    config->unix_stream_socket = NULL;
+    config->timer_aggregation = TIMER_AGGREGATION_RAW;
+    config->downstream_routing = ROUTING_ROUND_ROBIN;
+    config->downstream_protocol = PROTOCOL_UDP;
+    config->set_hll_threshold = DEFAULT_SET_HLL_THRESHOLD;
+    config->name_idle_intervals = DEFAULT_NAME_IDLE_INTERVALS;
+    config->name_limits_num = 0;
+    config->name_limit_policy = NAME_LIMIT_ROLLUP;
+    config->io_backend = IO_BACKEND_LIBEV;
+    parse_timer_percentiles(config, DEFAULT_TIMER_PERCENTILES);
+    config->self_metrics_prefix = NULL;
+    config->downstream_config = NULL;
+    config->dns_refresh_interval = DEFAULT_DNS_REFRESH_INTERVAL;
+    config->downstream_health_check_interval = DEFAULT_DOWNSTREAM_HEALTHCHECK_INTERVAL;
+    config->data_recv_batch_size = DEFAULT_DATA_RECV_BATCH_SIZE;
+    config->data_buf_size = DEFAULT_DATA_BUF_SIZE;
+    config->downstream_buf_size = DEFAULT_DOWNSTREAM_BUF_SIZE;
+    config->workers_num = DEFAULT_WORKERS_NUM;
+    config->downstream_queue_size = DEFAULT_DOWNSTREAM_QUEUE_SIZE;
+    config->downstream_queue_drop_policy = DROP_OLDEST;
+    config->spool_file = NULL;
+    config->spool_size = DEFAULT_SPOOL_SIZE;
+    config->spool_drain_rate = DEFAULT_SPOOL_DRAIN_RATE;
     FILE *config_file = fopen(filename, "rt");
     if (config_file == NULL) {
         log_msg(ERROR, "%s: fopen() failed %s", __func__, strerror(errno));
@@ -599,57 +4571,105 @@ int init_config(char *filename) {
             buffer[l - 1] = 0;
         }
         if (buffer[0] != '\n' && buffer[0] != '#') {
-            failures += process_config_line(buffer);
+            failures += process_config_line(config, buffer);
         }
     }
     // buffer is reused by getline() so we need to free it only once
     free(buffer);
     fclose(config_file);
+    if (config->downstream_config == NULL) {
+        log_msg(ERROR, "%s: downstream is not set", __func__);
+        failures++;
+    }
     if (failures > 0) {
         log_msg(ERROR, "%s: failed to load config file", __func__);
         return 1;
     }
-    if (signal(SIGHUP, on_sighup) == SIG_ERR) {
+    return 0;
+}
+
+// this function sets up signal handlers, SIGHUP is handled by the loop
+int init_signals() {
+    if (signal(SIGINT, on_sigint) == SIG_ERR) {
         log_msg(ERROR, "%s: signal() failed", __func__);
         return 1;
     }
-    if (signal(SIGINT, on_sigint) == SIG_ERR) {
+    // write to closed downstream tcp connection should fail with EPIPE instead of killing us
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
         log_msg(ERROR, "%s: signal() failed", __func__);
         return 1;
     }
     return 0;
 }
 
+/* resolver thread. Name is resolved again when its TTL expires but not more often than MIN_DNS_REFRESH_INTERVAL
+ * and not less often than dns_refresh_interval. Results are handed to the loop thread which is woken with ev_async
+ */
 void *downstream_refresh(void *args) {
+    struct ev_loop *loop = (struct ev_loop *)args;
+    struct dns_result_s *result = NULL;
+    unsigned int interval = 0;
+    char *name = NULL;
+
     while(1) {
-        sleep(global.dns_refresh_interval);
-        // if sockaddr data was copied let's refresh data
-        if (global.downstream.in_addr_new_ready == 0) {
-            get_dns_data();
+        // name can be replaced by config reload, old names are never freed
+        name = __atomic_load_n(&(global.downstream.data_host), __ATOMIC_ACQUIRE);
+        interval = dns_ttl(name);
+        if (interval == 0 || interval > global.dns_refresh_interval) {
+            interval = global.dns_refresh_interval;
+        }
+        if (interval < MIN_DNS_REFRESH_INTERVAL) {
+            interval = MIN_DNS_REFRESH_INTERVAL;
+        }
+        sleep(interval);
+        result = dns_resolve(__atomic_load_n(&(global.downstream.data_host), __ATOMIC_ACQUIRE));
+        if (result != NULL) {
+            dns_result_put(result);
+            ev_async_send(loop, &(global.downstream.dns_watcher));
         }
     }
     return NULL;
 }
 
+// stops health check and tcp connection of the host and frees it, its queued packets are routed again
+void downstream_free_host(struct ev_loop *loop, struct downstream_host_s *host) {
+    if (host->health_client.super.fd > 0) {
+        if (ev_is_active(&(host->health_client.super))) {
+            ev_io_stop(loop, &(host->health_client.super));
+        }
+        close(host->health_client.super.fd);
+    }
+    downstream_tcp_requeue(&(host->tcp_client));
+    if (host->tcp_client.super.fd >= 0) {
+        downstream_tcp_disconnect(loop, &(host->tcp_client));
+    }
+    free(host);
+}
+
 void update_downstreams(struct ev_loop *loop) {
     struct downstream_host_s *host = global.downstream.downstream_hosts;
     struct downstream_host_s *next = NULL;
     struct downstream_host_s **prev = &global.downstream.downstream_hosts;
+    struct dns_result_s *result = dns_result_take();
+    // addresses which already have hosts
+    int known[MAX_DOWNSTREAM_NUM];
+    // set if hosts were added or removed
+    int changed = 0;
     int i = 0;
     int delete_host = 0;
 
     // if there is no new data just return
-    if (global.downstream.in_addr_new_ready == 0) {
+    if (result == NULL) {
         return;
     }
-    // if there is new sockaddr data let's copy it and reset the flag
+    memset(known, 0, sizeof(known));
     while (host != NULL) {
         next = host->next;
         delete_host = 1;
-        log_msg(DEBUG, "%s: existing ip: %s", __func__, inet_ntoa(host->sa_in_data.sin_addr));
-        for (i = 0; i < global.downstream.downstream_host_num; i++) {
-            if (host->sa_in_data.sin_addr.s_addr == (global.downstream.in_addr_new + i)->s_addr) {
-                (global.downstream.in_addr_new + i)->s_addr = 0;
+        log_msg(DEBUG, "%s: existing ip: %s", __func__, address_string(&(host->health_client.sa)));
+        for (i = 0; i < result->addrs_num; i++) {
+            if (address_equal(&(host->health_client.sa), result->addrs + i)) {
+                known[i] = 1;
                 delete_host = 0;
                 log_msg(DEBUG, "%s: this ip is valid", __func__);
                 break;
@@ -659,41 +4679,52 @@ void update_downstreams(struct ev_loop *loop) {
             global.downstream.current_downstream_host = global.downstream.downstream_hosts;
             log_msg(DEBUG, "%s: removing this ip", __func__);
             *prev = next;
-            if (host->health_client.super.fd > 0) {
-                if (ev_is_active(&(host->health_client.super))) {
-                    ev_io_stop(loop, &(host->health_client.super));
-                }
-                close(host->health_client.super.fd);
-            }
-            free(host);
+            downstream_free_host(loop, host);
+            global.downstream.downstream_host_num--;
+            changed = 1;
+        } else {
+            prev = &(host->next);
         }
-        prev = &(host->next);
         host = next;
     }
-    for (i = 0; i < global.downstream.downstream_host_num; i++) {
-        if ((global.downstream.in_addr_new + i)->s_addr == 0) {
+    for (i = 0; i < result->addrs_num; i++) {
+        if (known[i]) {
             continue;
         }
         host = (struct downstream_host_s *)malloc(sizeof(struct downstream_host_s));
         if (host == NULL) {
             log_msg(ERROR, "%s: failed to allocate memory for the downstream_host_s", __func__);
-            return;
+            break;
+        }
+        host->sa_data_len = address_with_port(&(host->sa_data), result->addrs + i, global.downstream.data_port, global.downstream.flush_family);
+        if (host->sa_data_len == 0) {
+            log_msg(ERROR, "%s: can't send to %s, IPv6 is not available", __func__, address_string(result->addrs + i));
+            free(host);
+            continue;
         }
-        bzero(&(host->sa_in_data), sizeof(host->sa_in_data));
-        host->sa_in_data.sin_family = AF_INET;
-        host->sa_in_data.sin_port = htons(global.downstream.data_port);
-        host->sa_in_data.sin_addr = global.downstream.in_addr_new[i];
-        host->health_client.sa_in.sin_family = AF_INET;
-        host->health_client.sa_in.sin_port = htons(global.downstream.health_port);
-        host->health_client.sa_in.sin_addr = global.downstream.in_addr_new[i];
+        host->health_client.sa_len = address_with_port(&(host->health_client.sa), result->addrs + i, global.downstream.health_port,
+            result->addrs[i].ss_family);
         host->health_client.super.fd = -1;
         host->health_client.alive = 0;
-        log_msg(DEBUG, "%s: added new ip: %s", __func__, inet_ntoa(host->sa_in_data.sin_addr));
+        memset(&(host->tcp_client), 0, sizeof(host->tcp_client));
+        host->tcp_client.super.fd = -1;
+        host->tcp_client.sa_len = address_with_port(&(host->tcp_client.sa), result->addrs + i, global.downstream.data_port,
+            result->addrs[i].ss_family);
+        log_msg(DEBUG, "%s: added new ip: %s", __func__, address_string(&(host->health_client.sa)));
         host->next = global.downstream.downstream_hosts;
         global.downstream.downstream_hosts = host;
+        global.downstream.downstream_host_num++;
+        changed = 1;
+    }
+    if (changed) {
+        downstream_build_ring();
     }
+    free(result);
+}
 
-    global.downstream.in_addr_new_ready = 0;
+// called in the loop thread when resolver thread has new addresses
+void downstream_dns_cb(struct ev_loop *loop, struct ev_async *watcher, int revents) {
+    update_downstreams(loop);
 }
 
 int setnonblock(int fd) {
@@ -710,7 +4741,7 @@ void downstream_mark_down(struct ev_io *watcher) {
     }
     if (health_client->alive == 1) {
         health_client->alive = 0;
-        log_msg(DEBUG, "%s: downstream %s is down", __func__, inet_ntoa(health_client->sa_in.sin_addr));
+        log_msg(DEBUG, "%s: downstream %s is down", __func__, address_string(&(health_client->sa)));
     }
 }
 
@@ -732,7 +4763,8 @@ void downstream_health_read_cb(struct ev_loop *loop, struct ev_io *watcher, int
     }
     if (health_client->alive == 0) {
         health_client->alive = 1;
-        log_msg(DEBUG, "%s: downstream %s is up", __func__, inet_ntoa(health_client->sa_in.sin_addr));
+        log_msg(DEBUG, "%s: downstream %s is up", __func__, address_string(&(health_client->sa)));
+        spool_start_drain(loop);
     }
 }
 
@@ -783,7 +4815,7 @@ void check_downstream_health(struct ev_loop *loop) {
             health_fd = -1;
         }
         if (health_fd < 0) {
-            health_fd = socket(AF_INET, SOCK_STREAM, 0);
+            health_fd = socket(health_client->sa.ss_family, SOCK_STREAM, 0);
             if (health_fd == -1) {
                 log_msg(WARN, "%s: socket() failed %s", __func__, strerror(errno));
                 continue;
@@ -793,7 +4825,7 @@ void check_downstream_health(struct ev_loop *loop) {
                 log_msg(WARN, "%s: setnonblock() failed %s", __func__, strerror(errno));
                 continue;
             }
-            n = connect(health_fd, (struct sockaddr *)&(health_client->sa_in), sizeof(health_client->sa_in));
+            n = connect(health_fd, (struct sockaddr *)&(health_client->sa), health_client->sa_len);
             if (n == -1 && errno == EINPROGRESS) {
                 ev_io_init(watcher, downstream_health_connect_cb, health_fd, EV_WRITE);
             } else {
@@ -815,60 +4847,386 @@ void downstream_healthcheck_timer_cb(struct ev_loop *loop, struct ev_periodic *p
 
 // http://stackoverflow.com/questions/791982/determine-if-a-string-is-a-valid-ip-address-in-c
 int is_valid_ip_address(char *ip_addr) {
-    struct sockaddr_in sa;
-    int result = inet_pton(AF_INET, ip_addr, &(sa.sin_addr));
-    return result != 0;
+    struct in6_addr addr;
+    return inet_pton(AF_INET, ip_addr, &addr) == 1 || inet_pton(AF_INET6, ip_addr, &addr) == 1;
+}
+
+// this function writes text report of self-metrics, returns its length
+int stats_format(char *buffer, int size) {
+    static double percentiles[] = {50, 90, 99, 99.9};
+    struct downstream_host_s *host = NULL;
+    struct stats_s stats;
+    int length = 0;
+    int i = 0;
+    int j = 0;
+
+    stats_collect(&stats);
+    for (i = 0; i < STATS_NUM && length < size; i++) {
+        length += snprintf(buffer + length, size - length, "%s %lu\n", stat_name(i), stats.counters[i]);
+    }
+    for (i = 0; i < HISTOGRAMS_NUM && length < size; i++) {
+        length += snprintf(buffer + length, size - length, "%s_count %lu\n", histogram_name(i), histogram_count(stats.histograms[i]));
+        for (j = 0; j < sizeof(percentiles) / sizeof(percentiles[0]) && length < size; j++) {
+            length += snprintf(buffer + length, size - length, "%s_p%g_us %g\n", histogram_name(i), percentiles[j],
+                histogram_percentile(stats.histograms[i], percentiles[j]));
+        }
+    }
+    if (length < size) {
+        length += snprintf(buffer + length, size - length, "slots_used %d\nslots_interned %d\nflush_queue_length %d\nflush_queue_packets_allocated %d\n",
+            global.slots_used, global.slots_interned, global.downstream.queue_length, global.downstream.packets_allocated);
+    }
+    if (length < size && global.spool.map != NULL) {
+        length += snprintf(buffer + length, size - length, "spool_bytes %lu\n", spool_bytes());
+    }
+    for (host = global.downstream.downstream_hosts; host != NULL && length < size; host = host->next) {
+        length += snprintf(buffer + length, size - length, "downstream %s %s",
+            address_string(&(host->health_client.sa)), host->health_client.alive ? "up" : "down");
+        if (length < size && global.downstream_protocol == PROTOCOL_TCP) {
+            length += snprintf(buffer + length, size - length, " %s %d", host->tcp_client.connected ? "connected" : "disconnected",
+                host->tcp_client.queue_length);
+        }
+        if (length < size) {
+            length += snprintf(buffer + length, size - length, "\n");
+        }
+    }
+    return length < size ? length : size;
+}
+
+// tcp client gets the report and connection is closed
+void admin_tcp_accept_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    char buffer[STATS_BUF_SIZE];
+    int client_fd = accept(watcher->fd, NULL, NULL);
+    int length = 0;
+
+    if (client_fd < 0) {
+        log_msg(WARN, "%s: accept() failed %s", __func__, strerror(errno));
+        return;
+    }
+    length = stats_format(buffer, STATS_BUF_SIZE);
+    // report is small, so it fits into socket buffer of the new connection
+    if (send(client_fd, buffer, length, MSG_DONTWAIT | MSG_NOSIGNAL) != length) {
+        log_msg(WARN, "%s: send() failed %s", __func__, strerror(errno));
+    }
+    close(client_fd);
+}
+
+// any udp datagram is answered with the report
+void admin_udp_read_cb(struct ev_loop *loop, struct ev_io *watcher, int revents) {
+    char buffer[STATS_BUF_SIZE];
+    struct sockaddr_in addr;
+    socklen_t addr_length = sizeof(addr);
+    int length = 0;
+
+    if (recvfrom(watcher->fd, buffer, STATS_BUF_SIZE, MSG_DONTWAIT, (struct sockaddr *)&addr, &addr_length) < 0) {
+        return;
+    }
+    length = stats_format(buffer, STATS_BUF_SIZE);
+    if (sendto(watcher->fd, buffer, length, MSG_DONTWAIT, (struct sockaddr *)&addr, addr_length) != length) {
+        log_msg(WARN, "%s: sendto() failed %s", __func__, strerror(errno));
+    }
+}
+
+// this function creates tcp and udp sockets on localhost for stats requests
+int init_admin(struct ev_loop *loop) {
+    struct sockaddr_in addr;
+    int reuse_addr = 1;
+    int tcp_socket = socket(AF_INET, SOCK_STREAM, 0);
+    int udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (tcp_socket < 0 || udp_socket < 0) {
+        log_msg(ERROR, "%s: socket() failed %s", __func__, strerror(errno));
+        return 1;
+    }
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(global.admin_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(tcp_socket, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(reuse_addr));
+    if (bind(tcp_socket, (struct sockaddr *)&addr, sizeof(addr)) != 0 || bind(udp_socket, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        log_msg(ERROR, "%s: bind() failed %s", __func__, strerror(errno));
+        return 1;
+    }
+    if (listen(tcp_socket, SOMAXCONN) != 0 || setnonblock(tcp_socket) != 0) {
+        log_msg(ERROR, "%s: listen() failed %s", __func__, strerror(errno));
+        return 1;
+    }
+    ev_io_init(&(global.admin_tcp_watcher), admin_tcp_accept_cb, tcp_socket, EV_READ);
+    ev_io_start(loop, &(global.admin_tcp_watcher));
+    ev_io_init(&(global.admin_udp_watcher), admin_udp_read_cb, udp_socket, EV_READ);
+    ev_io_start(loop, &(global.admin_udp_watcher));
+    return 0;
+}
+
+void log_flush_timer_cb(struct ev_loop *loop, struct ev_periodic *p, int revents) {
+    log_flush();
+}
+
+// starts resolver thread unless downstream is ip address or thread is already running
+void start_downstream_refresh(struct ev_loop *loop) {
+    pthread_t thread;
+
+    if (global.downstream_refresh_started || is_valid_ip_address(global.downstream.data_host)) {
+        return;
+    }
+    if (pthread_create(&thread, NULL, downstream_refresh, loop) != 0) {
+        log_msg(ERROR, "%s: pthread_create() failed", __func__);
+        return;
+    }
+    global.downstream_refresh_started = 1;
+}
+
+// binds sockets of all workers to the new data port, workers swap them in from their threads. Old port is kept on error
+int reload_data_port(int port) {
+    int fds[MAX_WORKERS_NUM];
+    int fd = -1;
+    int i = 0;
+
+    for (i = 0; i < global.workers_num; i++) {
+        fds[i] = bind_inet_socket(SOCK_DGRAM, port, global.workers_num > 1);
+        if (fds[i] < 0) {
+            while (i-- > 0) {
+                close(fds[i]);
+            }
+            return 1;
+        }
+    }
+    for (i = 0; i < global.workers_num; i++) {
+        fd = __atomic_exchange_n(&(global.workers[i].new_socket), fds[i], __ATOMIC_ACQ_REL);
+        if (fd >= 0) {
+            close(fd);
+        }
+        ev_async_send(global.workers[i].loop, &(global.workers[i].new_socket_watcher));
+    }
+    global.data_port = port;
+    return 0;
+}
+
+/* replaces all downstream hosts with addresses of the new name. Queued packets are kept and
+ * sent to new hosts once their health check passes
+ */
+void reload_downstream(struct ev_loop *loop, char *host, int data_port, int health_port) {
+    struct downstream_host_s *next = NULL;
+    struct dns_result_s *result = NULL;
+
+    while (global.downstream.downstream_hosts != NULL) {
+        next = global.downstream.downstream_hosts->next;
+        downstream_free_host(loop, global.downstream.downstream_hosts);
+        global.downstream.downstream_hosts = next;
+    }
+    global.downstream.downstream_host_num = 0;
+    global.downstream.current_downstream_host = NULL;
+    downstream_build_ring();
+    // resolver thread may still use the old name, so it isn't freed
+    __atomic_store_n(&(global.downstream.data_host), host, __ATOMIC_RELEASE);
+    global.downstream.data_port = data_port;
+    global.downstream.health_port = health_port;
+    result = dns_resolve(host);
+    if (result == NULL) {
+        log_msg(ERROR, "%s: failed to retrieve downstream hosts", __func__);
+    } else {
+        dns_result_put(result);
+        update_downstreams(loop);
+        check_downstream_health(loop);
+    }
+    start_downstream_refresh(loop);
+}
+
+// returns 1 if optional string setting was changed
+int string_changed(char *a, char *b) {
+    if (a == NULL || b == NULL) {
+        return a != b;
+    }
+    return strcmp(a, b) != 0;
+}
+
+// swaps string setting, the old value is left in config and freed with it
+void string_swap(char **a, char **b) {
+    char *tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+/* applies reloaded config between loop iterations. Aggregated data and flush queue are kept, sockets and timers are
+ * rebuilt only if their settings were changed. Settings which size buffers of running workers need restart
+ */
+void apply_config(struct ev_loop *loop, struct global_s *config) {
+    struct downstream_host_s *host = NULL;
+    char *data_host = NULL;
+    int data_port = 0;
+    int health_port = 0;
+
+    if (config->workers_num != global.workers_num || config->data_recv_batch_size != global.data_recv_batch_size ||
+            config->data_buf_size != global.data_buf_size || config->downstream_buf_size != global.downstream_buf_size ||
+            config->timer_aggregation != global.timer_aggregation || string_changed(config->spool_file, global.spool_file) ||
+            config->spool_size != global.spool_size || config->name_limits_num != global.name_limits_num ||
+            memcmp(config->name_limits, global.name_limits, sizeof(global.name_limits)) != 0 ||
+            config->io_backend != global.io_backend) {
+        log_msg(WARN, "%s: workers, data_recv_batch_size, data_buf_size, downstream_buf_size, timer_aggregation, "
+            "spool_file, spool_size, name_limit and io_backend are changed on restart only", __func__);
+    }
+    global.log_level = config->log_level;
+    global.log_rate_limit = config->log_rate_limit;
+    global.dns_refresh_interval = config->dns_refresh_interval;
+    global.set_hll_threshold = config->set_hll_threshold;
+    global.name_idle_intervals = config->name_idle_intervals;
+    global.name_limit_policy = config->name_limit_policy;
+    memcpy(global.timer_percentiles, config->timer_percentiles, sizeof(global.timer_percentiles));
+    global.timer_percentiles_num = config->timer_percentiles_num;
+    global.downstream_routing = config->downstream_routing;
+    global.downstream_queue_size = config->downstream_queue_size;
+    global.downstream_queue_drop_policy = config->downstream_queue_drop_policy;
+    global.spool_drain_rate = config->spool_drain_rate;
+    string_swap(&(global.self_metrics_prefix), &(config->self_metrics_prefix));
+    if (global.downstream_protocol == PROTOCOL_TCP && config->downstream_protocol == PROTOCOL_UDP) {
+        for (host = global.downstream.downstream_hosts; host != NULL; host = host->next) {
+            downstream_tcp_requeue(&(host->tcp_client));
+            if (host->tcp_client.super.fd >= 0) {
+                downstream_tcp_disconnect(loop, &(host->tcp_client));
+            }
+        }
+    }
+    global.downstream_protocol = config->downstream_protocol;
+    if (config->downstream_flush_interval != global.downstream_flush_interval) {
+        global.downstream_flush_interval = config->downstream_flush_interval;
+        ev_periodic_set(&(global.downstream_flush_timer_watcher), 0.0, global.downstream_flush_interval, 0);
+        ev_periodic_again(loop, &(global.downstream_flush_timer_watcher));
+    }
+    if (config->downstream_health_check_interval != global.downstream_health_check_interval) {
+        global.downstream_health_check_interval = config->downstream_health_check_interval;
+        ev_periodic_set(&(global.downstream_healthcheck_timer_watcher), 0.0, global.downstream_health_check_interval, 0);
+        ev_periodic_again(loop, &(global.downstream_healthcheck_timer_watcher));
+    }
+    if (config->data_port != global.data_port && reload_data_port(config->data_port) != 0) {
+        log_msg(ERROR, "%s: failed to change data_port, keeping %d", __func__, global.data_port);
+    }
+    if (config->tcp_port != global.tcp_port) {
+        stop_listener(loop, &(global.tcp_watcher));
+        global.tcp_port = config->tcp_port;
+        init_tcp_listener(loop);
+    }
+    if (string_changed(config->unix_stream_socket, global.unix_stream_socket)) {
+        stop_listener(loop, &(global.unix_stream_watcher));
+        string_swap(&(global.unix_stream_socket), &(config->unix_stream_socket));
+        init_unix_stream_listener(loop);
+    }
+    if (string_changed(config->unix_dgram_socket, global.unix_dgram_socket)) {
+        stop_listener(loop, &(global.unix_dgram_watcher));
+        string_swap(&(global.unix_dgram_socket), &(config->unix_dgram_socket));
+        init_unix_dgram_listener(loop);
+    }
+    if (config->admin_port != global.admin_port) {
+        stop_listener(loop, &(global.admin_tcp_watcher));
+        stop_listener(loop, &(global.admin_udp_watcher));
+        global.admin_port = config->admin_port;
+        if (global.admin_port > 0) {
+            init_admin(loop);
+        }
+    }
+    if (string_changed(config->downstream_config, global.downstream_config)) {
+        if (parse_downstream(config->downstream_config, &data_host, &data_port, &health_port) != 0) {
+            log_msg(ERROR, "%s: failed to change downstream, keeping %s", __func__, global.downstream_config);
+            return;
+        }
+        log_msg(INFO, "%s: downstream is changed to %s", __func__, config->downstream_config);
+        string_swap(&(global.downstream_config), &(config->downstream_config));
+        reload_downstream(loop, data_host, data_port, health_port);
+    }
+}
+
+// config is reloaded into a fresh structure, so current config is untouched if the new one is invalid
+void sighup_cb(struct ev_loop *loop, struct ev_signal *watcher, int revents) {
+    struct global_s *config = (struct global_s *)calloc(1, sizeof(struct global_s));
+
+    log_msg(INFO, "%s: sighup received, reloading %s", __func__, global.config_file);
+    if (config == NULL) {
+        log_msg(ERROR, "%s: failed to allocate memory for config", __func__);
+        return;
+    }
+    if (init_config(global.config_file, config) != 0) {
+        log_msg(ERROR, "%s: config reload failed, current config is kept", __func__);
+    } else {
+        apply_config(loop, config);
+    }
+    free(config->self_metrics_prefix);
+    free(config->unix_stream_socket);
+    free(config->unix_dgram_socket);
+    free(config->downstream_config);
+    free(config->spool_file);
+    free(config);
 }
 
+// benchmarks include this file to get access to its internals
+#ifndef STATSD_AGGREGATOR_NO_MAIN
 int main(int argc, char *argv[]) {
     struct ev_loop *loop = ev_default_loop(0);
-    int data_socket;
-    struct sockaddr_in addr;
-    struct ev_io socket_watcher;
-    struct ev_periodic downstream_flush_timer_watcher;
-    struct ev_periodic downstream_healthcheck_timer_watcher;
+    struct ev_periodic log_flush_timer_watcher;
     ev_tstamp downstream_flush_timer_at = 0.0;
     ev_tstamp downstream_healthcheck_timer_at = 0.0;
-    pthread_t downstream_socket_refresh_thread;
+    int i = 0;
 
-   if (argc != 2) {
+    // buffered log lines should not be lost on exit
+    atexit(log_flush);
+    if (argc != 2) {
         fprintf(stdout, "Usage: %s config.file\n", argv[0]);
         exit(1);
     }
-    if (init_config(argv[1]) != 0) {
+    global.config_file = argv[1];
+    if (init_config(global.config_file, &global) != 0) {
         log_msg(ERROR, "%s: init_config() failed", __func__);
         exit(1);
     }
+    if (init_signals() != 0 || init_downstream(global.downstream_config) != 0 || init_spool() != 0) {
+        log_msg(ERROR, "%s: initialization failed", __func__);
+        exit(1);
+    }
+    global.tokenizer = tokenizer_select();
 
-    if ((data_socket = socket(PF_INET, SOCK_DGRAM, 0)) < 0 ) {
-        log_msg(ERROR, "%s: socket() error %s", __func__, strerror(errno));
+    global.workers = (struct worker_s *)calloc(global.workers_num, sizeof(struct worker_s));
+    if (global.workers == NULL) {
+        log_msg(ERROR, "%s: failed to allocate memory for workers", __func__);
+        exit(1);
+    }
+    for (i = 0; i < global.workers_num; i++) {
+        if (init_worker(global.workers + i, i) != 0) {
+            log_msg(ERROR, "%s: init_worker() failed", __func__);
+            return(1);
+        }
+    }
+
+    // signal watcher is started before other threads, so they inherit the blocked SIGHUP
+    ev_signal_init(&(global.sighup_watcher), sighup_cb, SIGHUP);
+    ev_signal_start(loop, &(global.sighup_watcher));
+    ev_async_init(&(global.downstream.dns_watcher), downstream_dns_cb);
+    ev_async_start(loop, &(global.downstream.dns_watcher));
+    // if downstream is specified via ip address no need to run downstream_refresh()
+    start_downstream_refresh(loop);
+
+    if (start_workers(loop) != 0) {
+        log_msg(ERROR, "%s: start_workers() failed", __func__);
         return(1);
     }
-    bzero(&addr, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(global.data_port);
-    addr.sin_addr.s_addr = INADDR_ANY;
 
-    if (bind(data_socket, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
-        log_msg(ERROR, "%s: bind() failed %s", __func__, strerror(errno));
+    if (init_listeners(loop) != 0) {
+        log_msg(ERROR, "%s: init_listeners() failed", __func__);
         return(1);
     }
 
-    // if downstream is specified via ip address no need to run downstream_refresh()
-    if (! is_valid_ip_address(global.downstream.data_host)) {
-        pthread_create(&downstream_socket_refresh_thread, NULL, downstream_refresh, NULL);
+    if (global.admin_port > 0 && init_admin(loop) != 0) {
+        log_msg(ERROR, "%s: init_admin() failed", __func__);
+        return(1);
     }
 
-    ev_io_init(&socket_watcher, udp_read_cb, data_socket, EV_READ);
-    ev_io_start(loop, &socket_watcher);
+    ev_periodic_init (&(global.downstream_flush_timer_watcher), downstream_flush_timer_cb, downstream_flush_timer_at, global.downstream_flush_interval, 0);
+    ev_periodic_start (loop, &(global.downstream_flush_timer_watcher));
 
-    ev_periodic_init (&downstream_flush_timer_watcher, downstream_flush_timer_cb, downstream_flush_timer_at, global.downstream_flush_interval, 0);
-    ev_periodic_start (loop, &downstream_flush_timer_watcher);
+    ev_periodic_init (&(global.downstream_healthcheck_timer_watcher), downstream_healthcheck_timer_cb, downstream_healthcheck_timer_at, global.downstream_health_check_interval, 0);
+    ev_periodic_start (loop, &(global.downstream_healthcheck_timer_watcher));
 
-    ev_periodic_init (&downstream_healthcheck_timer_watcher, downstream_healthcheck_timer_cb, downstream_healthcheck_timer_at, global.downstream_health_check_interval, 0);
-    ev_periodic_start (loop, &downstream_healthcheck_timer_watcher);
+    ev_periodic_init (&log_flush_timer_watcher, log_flush_timer_cb, 0.0, LOG_FLUSH_INTERVAL, 0);
+    ev_periodic_start (loop, &log_flush_timer_watcher);
 
     ev_loop(loop, 0);
     log_msg(ERROR, "%s: ev_loop() exited", __func__);
     return(0);
 }
+#endif
@@ -0,0 +1,10 @@
+#!/usr/bin/env ruby
+
+require './statsd-aggregator-test-lib'
+
+# distinct names don't fit into single packet, but each counter should be sent once per flush interval
+3.times do
+    (0...4).each do |p|
+        send_data((0...50).map {|i| "counter.number.#{p * 50 + i}:1|c\n"}.join)
+    end
+end
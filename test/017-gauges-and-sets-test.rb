@@ -0,0 +1,13 @@
+#!/usr/bin/env ruby
+
+require './statsd-aggregator-test-lib'
+
+# gauge is sent with its last value, deltas are added to it
+send_data("gauge.absolute:5|g:7|g\ngauge.absolute:+3|g\n" * 4)
+# gauge which got deltas only is sent as delta
+send_data("gauge.delta:+3|g:-5|g\n" * 4)
+# negative gauge is set to 0 first
+send_data("gauge.negative:10|g:-20|g\n" * 4)
+send_data("gauge.invalid:xx|g\n" * 4)
+# set members are sent once
+send_data("set.users:user1|s:user2|s:user1|s\nset.users:user3|s|@0.1\n" * 4)
@@ -0,0 +1,21 @@
+#!/usr/bin/env ruby
+
+require './statsd-aggregator-test-lib'
+
+# names are evicted after two flush intervals without data
+add_config("name_idle_intervals=2")
+send_data("counter.idle:1|c\ncounter.busy:1|c\n")
+wait_flush()
+expect_stat("slots_interned", 2)
+send_data("counter.busy:1|c\n")
+wait_flush()
+# counter.idle got no data during one interval
+expect_stat("slots_interned", 2)
+send_data("counter.busy:1|c\n")
+wait_flush()
+# counter.idle got no data during two intervals
+expect_stat("slots_interned", 1)
+# evicted name is interned again
+send_data("counter.idle:1|c\ncounter.busy:1|c\n")
+wait_flush()
+expect_stat("slots_interned", 2)
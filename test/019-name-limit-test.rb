@@ -0,0 +1,25 @@
+#!/usr/bin/env ruby
+
+require './statsd-aggregator-test-lib'
+
+flood = (1..10).map {|i| "req.flood#{i}:1|c\n"}.join
+established = "req.a:1|c\nreq.b:1|c\nreq.c:1|c\n"
+
+# only 3 names starting with req. get their own slot, the rest is rolled up into req.overflow
+add_config("name_limit=req.:3")
+send_data(established + "other.name:1|c\n")
+wait_flush()
+# flood of new names comes first, established names keep their slots in every following flush
+send_data(flood + established)
+wait_flush()
+send_data(flood + established)
+wait_flush()
+send_data(flood + established)
+wait_flush()
+# established names got no data, their slots are reserved during one more flush
+send_data(flood)
+wait_flush()
+# then first names of the flood get them
+send_data(flood)
+wait_flush()
+send_data(flood + established)
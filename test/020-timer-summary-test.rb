@@ -0,0 +1,14 @@
+#!/usr/bin/env ruby
+
+require './statsd-aggregator-test-lib'
+
+# timers are sent as count, sum, min, max and percentiles
+add_config("timer_aggregation=summary")
+add_config("timer_percentiles=25,50,90,99.9")
+send_data("timer.positive:10|ms:20|ms:30|ms:40|ms\ntimer.positive:1000|ms\n")
+# sampled value counts as 1 / rate values
+send_data("timer.sampled:5|ms|@0.1\ntimer.sampled:7|ms|@0.5:9|ms\n")
+# negative values are sent as gauges which are set to 0 first
+send_data("timer.negative:-5|ms\ntimer.negative:-3|ms\ntimer.negative:-1|ms\n")
+send_data("timer.mixed:-100|ms:-2|ms:0|ms:0|ms:3|ms|@0.25:250|ms\n")
+send_data("timer.invalid:xx|ms\n")
@@ -10,6 +10,7 @@
 # simulator.
 
 require 'eventmachine'
+require 'socket'
 
 # port statsd aggregator listens on
 IN_PORT = 9000
@@ -17,6 +18,8 @@ IN_PORT = 9000
 OUT_PORT = 9100
 # downstream health port
 HEALTH_PORT = 9200
+# port statsd aggregator reports self-metrics on
+ADMIN_PORT = 9300
 # location of config file for statsd aggregator. This config file is generated for each test run.
 CONFIG_FILE = "/tmp/statsd-aggregator.conf"
 # location of statsd aggregator executable
@@ -34,7 +37,8 @@ DEFAULT_TEST_TIMEOUT = 20
 # min and max metrics length (those are processed differently than metrics with garbage content)
 MIN_METRICS_LENGTH = 6
 MAX_METRICS_LENGTH = 1450
-MAX_COUNTER_LENGTH = 18 # because of "%.15g|c\n"
+# timer sketch buckets keep that many top bits of mantissa
+TIMER_SKETCH_PRECISION_BITS = 7
 
 # we are extending String class with numeric? method
 # it should return true if string is float number, false otherwise
@@ -77,21 +81,148 @@ class StatsdAggregator
     def initialize(statsd_aggregator_test)
         # each slot corresponds to the metric, data with same metric name should go to one and the same slot
         @slots = []
-        # how much data we have ready for transfer to the downstream
-        @active_buffer_length = 0
         @sat = statsd_aggregator_test
+        # name_limit config is list of [prefix, limit]
+        @name_limits = []
+        # timers are sent as count, sum, min, max and percentiles in summary mode
+        @timer_summary = false
+        @timer_percentiles = [50, 90, 99]
+        @sat.config.each do |c|
+            if c.start_with?("name_limit=")
+                @name_limits = c.split("=", 2)[1].split(",").map {|l| [l[0...l.rindex(":")], l[l.rindex(":") + 1..-1].to_i]}
+            elsif c == "timer_aggregation=summary"
+                @timer_summary = true
+            elsif c.start_with?("timer_percentiles=")
+                @timer_percentiles = c.split("=", 2)[1].split(",").map {|p| p.to_f}
+            end
+        end
+        # names which got their own slot in the previous flush interval, they are admitted first
+        @previous_names = []
+        # how many names of each name_limit got their own slot in the previous and the current flush interval,
+        # and how many of the latter had it in the previous one
+        @reserved = [0] * @name_limits.size
+        @admitted = [0] * @name_limits.size
+        @returned = [0] * @name_limits.size
+    end
+
+    # key of the sketch bucket is sign, exponent and top bits of mantissa of the value
+    def timer_sketch_key(value)
+        [value].pack("G").unpack1("Q>") >> (52 - TIMER_SKETCH_PRECISION_BITS)
+    end
+
+    # returns middle of the bucket range
+    def timer_sketch_value(key)
+        lower = [key << (52 - TIMER_SKETCH_PRECISION_BITS)].pack("Q>").unpack1("G")
+        upper = [(key + 1) << (52 - TIMER_SKETCH_PRECISION_BITS)].pack("Q>").unpack1("G")
+        (lower + upper) / 2
+    end
+
+    # returns approximate percentile of timer samples, each sample is [value, weight]
+    def timer_percentile(samples, percentile)
+        count = samples.sum {|s| s[1]}
+        rank = [count * percentile / 100, 1].max
+        # samples of the same bucket are counted together, zero values are between negative and positive ones
+        buckets = Hash.new(0)
+        samples.each {|s| buckets[s[0] == 0 ? 0 : timer_sketch_value(timer_sketch_key(s[0]))] += s[1]}
+        seen = 0
+        value = 0
+        buckets.keys.sort.each do |v|
+            seen += buckets[v]
+            value = v
+            break if seen >= rank
+        end
+        [[value, samples.map {|s| s[0]}.min].max, samples.map {|s| s[0]}.max].min
+    end
+
+    # negative absolute gauge would be taken as delta, so it is set to 0 first
+    def absolute_gauge(value)
+        value < 0 ? ["0|g", sprintf("%.15g|g", value)] : [sprintf("%.15g|g", value)]
+    end
+
+    # timer slot is sent as several metrics with name suffixes
+    def timer_summary_slots(s)
+        values = s[:values].map {|v| v[0]}
+        slots = [
+            {name: "#{s[:name]}.count", values: ["#{s[:values].sum {|v| v[1]}}|c"]},
+            {name: "#{s[:name]}.sum", values: [sprintf("%.15g|c", s[:values].sum {|v| v[0] * v[1]})]},
+            {name: "#{s[:name]}.min", values: absolute_gauge(values.min)},
+            {name: "#{s[:name]}.max", values: absolute_gauge(values.max)}
+        ]
+        @timer_percentiles.each do |p|
+            slots << {name: "#{s[:name]}.p#{sprintf("%g", p).tr(".", "_")}", values: absolute_gauge(timer_percentile(s[:values], p))}
+        end
+        slots
     end
 
     # simulates flushing data to the downstream
+    # slots are packed into packets not exceeding MAX_METRICS_LENGTH, values of the slot which
+    # doesn't fit into packet are split into several lines with the same name
     def flush()
-        # let's filter out slots with data
-        slots_with_data = @slots.select {|s| ! s[:values].empty? }
-        if ! slots_with_data.empty?
-            # event, which we 
-            @sat.expect({source: "network", data: slots_with_data})
+        packet = []
+        packet_length = 0
+        slots = @slots.flat_map {|s| s[:type] == "timer" && ! s[:values].empty? ? timer_summary_slots(s) : [s]}
+        slots.each do |s|
+            values = s[:values].dup
+            while ! values.empty?
+                line_values = []
+                # name followed by ":"
+                line_length = s[:name].size + 1
+                # each value is followed by ":" or "\n"
+                while ! values.empty? && packet_length + line_length + values[0].size + 1 <= MAX_METRICS_LENGTH
+                    line_length += values[0].size + 1
+                    line_values << values.shift
+                end
+                if line_values.empty?
+                    # not even single value fits, let's start new packet
+                    @sat.expect({source: "network", data: packet})
+                    packet = []
+                    packet_length = 0
+                    next
+                end
+                packet << {name: s[:name], values: line_values}
+                packet_length += line_length
+            end
+        end
+        if ! packet.empty?
+            @sat.expect({source: "network", data: packet})
         end
+        @previous_names = @slots.map {|s| s[:name]}
+        @reserved = @admitted
+        @admitted = [0] * @name_limits.size
+        @returned = [0] * @name_limits.size
         @slots = []
-        @active_buffer_length = 0
+    end
+
+    # returns index of name_limit with the longest prefix of the name or nil if name isn't limited
+    def find_name_limit(name)
+        found = nil
+        @name_limits.each_with_index do |l, i|
+            if name == "#{l[0]}overflow"
+                return nil
+            end
+            if l[0].size < name.size && name.start_with?(l[0]) && (found == nil || l[0].size > @name_limits[found][0].size)
+                found = i
+            end
+        end
+        found
+    end
+
+    # returns name metric is aggregated under, names over name_limit are rolled up into overflow metric
+    def admit_name(name)
+        if @slots.any? {|s| s[:name] == name}
+            return name
+        end
+        idx = find_name_limit(name)
+        if idx == nil
+            return name
+        end
+        if @previous_names.include?(name)
+            @returned[idx] += 1
+        elsif @admitted[idx] + @reserved[idx] - @returned[idx] >= @name_limits[idx][1]
+            return "#{@name_limits[idx][0]}overflow"
+        end
+        @admitted[idx] += 1
+        name
     end
 
     # find slot with given name or create new slot, return index of the slot
@@ -101,16 +232,13 @@ class StatsdAggregator
                 return i
             end
         end
-        if @active_buffer_length + (name.size + 1) > MAX_METRICS_LENGTH
-            flush()
-        end
         # each slot has following properties:
         # name
-        # type (unknown, counter or other)
-        # counter - used exclusively for counter aggregation
+        # type (unknown, counter, gauge, set or other)
+        # counter - used for counter and gauge aggregation
+        # absolute - gauge got value without sign
         # values - list of values for non counter metrics
-        @slots << {name: name, type: "unknown", counter: 0.0, values: []}
-        @active_buffer_length += (name.size + 1)
+        @slots << {name: name, type: "unknown", counter: 0.0, absolute: false, values: []}
         @slots.size - 1
     end
 
@@ -129,6 +257,12 @@ class StatsdAggregator
             metric_type = "other"
             if a[1] == "c"
                 metric_type = "counter"
+            elsif a[1] == "g"
+                metric_type = "gauge"
+            elsif a[1] == "s"
+                metric_type = "set"
+            elsif a[1] == "ms" && @timer_summary
+                metric_type = "timer"
             end
             if slot[:type] == "unknown"
                 # this is newly created slot, setting type
@@ -141,14 +275,6 @@ class StatsdAggregator
                     next
                 end
             end
-            if @active_buffer_length + (metric_type == "counter" ? MAX_COUNTER_LENGTH : m.size + 1) > MAX_METRICS_LENGTH
-                # we have enough data, let's flush
-                flush()
-                # flush() resets slots, need to create new slot
-                @slots << {name: name, type: metric_type, counter: 0.0, values: []}
-                @active_buffer_length += (name.size + 1)
-                slot = @slots[0]
-            end
             if metric_type == "counter"
                 # counters are treated differently
                 # default rate is 1.0
@@ -161,21 +287,50 @@ class StatsdAggregator
                     # metric value should be numerical, otherwise it's invalid
                     @sat.expect({source: "stdout", data: "invalid value in counter data \"#{m}\""})
                 else
-                    if slot[:values][0] != nil
-                        # if this is not 1st value we need to subtract data length from total length
-                        @active_buffer_length -= (sprintf("%.15g|c", slot[:counter]).to_s.size + 1)
-                    end
                     # counter value is updated
                     slot[:counter] += (a[0].to_f / rate)
-                    # total length is updated
-                    @active_buffer_length += (sprintf("%.15g|c", slot[:counter]).to_s.size + 1)
                     # new value is appended to the list
                     slot[:values][0] = sprintf("%.15g|c", slot[:counter]).to_s
                 end
+            elsif metric_type == "gauge"
+                if ! a[0].numeric?
+                    @sat.expect({source: "stdout", data: "invalid value in gauge data \"#{m}\""})
+                    next
+                end
+                # value with sign changes gauge, value without sign sets it
+                if a[0][0] == "+" || a[0][0] == "-"
+                    slot[:counter] += a[0].to_f
+                else
+                    slot[:counter] = a[0].to_f
+                    slot[:absolute] = true
+                end
+                if ! slot[:absolute]
+                    slot[:values] = [sprintf("%+.15g|g", slot[:counter])]
+                elsif slot[:counter] < 0
+                    # negative value would be taken as delta, so gauge is set to 0 first
+                    slot[:values] = ["0|g", sprintf("%.15g|g", slot[:counter])]
+                else
+                    slot[:values] = [sprintf("%.15g|g", slot[:counter])]
+                end
+            elsif metric_type == "timer"
+                if ! a[0].numeric?
+                    @sat.expect({source: "stdout", data: "invalid value in timer data \"#{m}\""})
+                    next
+                end
+                # sampled value counts as 1 / rate values
+                rate = 1.0
+                if a[2] != nil && a[2][0] == "@" && a[2][1..-1].numeric?
+                    rate = a[2][1..-1].to_f
+                end
+                slot[:values] << [a[0].to_f, rate > 0 && rate < 1 ? (1 / rate + 0.5).to_i : 1]
+            elsif metric_type == "set"
+                # only distinct members are sent
+                if ! slot[:values].include?("#{a[0]}|s")
+                    slot[:values] << "#{a[0]}|s"
+                end
             else
                 # this is not counter, just append it to the list of values
                 slot[:values] << m
-                @active_buffer_length += (m.size + 1)
             end
         end
     end
@@ -187,6 +342,7 @@ class StatsdAggregator
             # no : means no metrics data
             @sat.expect({source: "stdout", data: "invalid metric #{s}"})
         else
+            a[0] = admit_name(a[0])
             slot_idx = find_slot(a[0])
             insert_values_into_slot(slot_idx, a)
         end
@@ -206,7 +362,7 @@ class StatsdAggregator
 end
 
 class StatsdAggregatorTest
-    attr_accessor :timeout, :test_sequence, :health_check_done
+    attr_accessor :timeout, :test_sequence, :config, :health_check_done
 
     # this function sends data during test execution
     def send_data_impl(data)
@@ -214,6 +370,41 @@ class StatsdAggregatorTest
         @data_socket.send(data, 0, '127.0.0.1', IN_PORT)
     end
 
+    # this function checks value reported by admin port during test execution
+    def expect_stat_impl(stat)
+        name, value = stat
+        socket = TCPSocket.new('127.0.0.1', ADMIN_PORT)
+        report = socket.read
+        socket.close
+        actual = report[/^#{name} (\S+)$/, 1]
+        if actual != value.to_s
+            die("#{name} is #{actual}, expected #{value}")
+        end
+    end
+
+    # this function runs test sequence till the end or till the step which waits for flush,
+    # the rest of it is run by notify() when data of the flush interval is received
+    def run_steps()
+        while ! @test_sequence.empty?
+            method, arg = @test_sequence.shift
+            if method == nil
+                die("No method specified")
+            end
+            if method == :wait_flush
+                @sa.flush()
+                @waiting_flush = true
+                return
+            end
+            send(method, arg)
+        end
+        @sa.flush()
+        if @expected_events.empty? && @stdout.empty?
+            EventMachine.stop()
+            exit(SUCCESS_EXIT_STATUS)
+        end
+        @test_completed = true
+    end
+
     # this function:
     # - creates udp network socket to accept traffic from statsd-aggregator binary
     # - start statsd-aggregator-binary
@@ -229,6 +420,8 @@ class StatsdAggregatorTest
             f.puts("data_port=#{IN_PORT}")
             f.puts("downstream_flush_interval=#{FLUSH_INTERVAL}")
             f.puts("downstream=localhost:#{OUT_PORT}:#{HEALTH_PORT}")
+            f.puts("admin_port=#{ADMIN_PORT}")
+            @config.each {|c| f.puts(c)}
         end
         # socket for sending data
         @data_socket = UDPSocket.new
@@ -252,19 +445,7 @@ class StatsdAggregatorTest
                     end
                 end,
                 proc do
-                    @test_sequence.each do |run_data|
-                        method = run_data[0]
-                        if method == nil
-                            die("No method specified")
-                        end
-                        send(method, run_data[1])
-                    end
-                    @sa.flush()
-                    if @expected_events.empty? && @stdout.empty?
-                        EventMachine.stop()
-                        exit(SUCCESS_EXIT_STATUS)
-                    end
-                    @test_completed = true
+                    run_steps()
                 end
             )
         end
@@ -272,9 +453,11 @@ class StatsdAggregatorTest
 
     def initialize()
         @test_sequence = []
+        @config = []
         @expected_events = []
         @timeout = DEFAULT_TEST_TIMEOUT
         @test_completed = false
+        @waiting_flush = false
         @stdout = ""
         @id = 0
         @health_check_done = false
@@ -319,6 +502,11 @@ class StatsdAggregatorTest
             else
                 die("Unknown event source: #{event[:source]}")
         end
+        # data of the flush interval is received, test sequence goes on
+        if @stdout.empty? && @expected_events.empty? && @waiting_flush
+            @waiting_flush = false
+            run_steps()
+        end
         # if all expected events matched - test passed ok
         # otherwise it would fail because of timeout
         if @stdout.empty? && @expected_events.empty? && @test_completed
@@ -351,6 +539,21 @@ def send_data(data)
     @sat.test_sequence << [:send_data_impl, data]
 end
 
+# adds line to the config of statsd aggregator
+def add_config(line)
+    @sat.config << line
+end
+
+# following data goes to the next flush interval, data sent before should be flushed
+def wait_flush()
+    @sat.test_sequence << [:wait_flush]
+end
+
+# checks value of self-metric reported by admin port
+def expect_stat(name, value)
+    @sat.test_sequence << [:expect_stat_impl, [name, value]]
+end
+
 # syntactic sugar end
 
 # test configuration is done, now let's run it